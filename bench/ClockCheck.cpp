@@ -0,0 +1,169 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+
+// Feeds ClockRecovery a simulated minute of audio and video whose capture
+// times come from a device clock drifting 100 ppm against the host's, and
+// checks that the mapped times follow the host clock to within a
+// millisecond. Both streams share one ClockRecovery, as they do in the
+// plugin, with different encoder latencies so that their frames arrive
+// interleaved out of capture order. Exits non-zero if anything is off.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "ClockRecovery.hpp"
+
+namespace
+{
+    constexpr double kDrift{1.0001};
+    constexpr uint64_t kDeviceBase{123456789000000};
+    constexpr uint64_t kHostBase{5000000000};
+
+    // Encoder latency, then USB transfer plus exponential queueing delay
+    constexpr double kVideoLatency{30e6};
+    constexpr double kAudioLatency{10e6};
+    constexpr double kTransfer{1e6};
+    constexpr double kMeanJitter{3e6};
+
+    int g_failures{0};
+
+    void check(const bool passed, const char *what)
+    {
+        std::printf("%s  %s\n", passed ? "ok  " : "FAIL", what);
+        if (!passed)
+        {
+            ++g_failures;
+        }
+    }
+
+    struct Frame
+    {
+        uint64_t deviceTime;
+        uint64_t arrival;
+        bool isVideo;
+    };
+
+    // Frames of duration seconds of 60 fps video and 48 kHz AAC, in the
+    // order they arrive. deviceBase is where the device clock stands at
+    // the start, hostStart where the host clock does.
+    std::vector<Frame> simulate(std::mt19937 &random, const double start, const double duration,
+                                const uint64_t deviceBase, const uint64_t hostStart)
+    {
+        std::exponential_distribution<double> jitter{1.0 / kMeanJitter};
+        std::vector<Frame> frames;
+
+        const auto addStream = [&](const double interval, const double latency, const bool isVideo) {
+            // Each stream is sent in order, so a delayed frame holds up the
+            // ones behind it
+            double arrival{0.0};
+
+            for (auto t = start; t < start + duration; t += interval)
+            {
+                const auto hostCapture = static_cast<double>(hostStart) + (t - start) * kDrift;
+                arrival = std::max(arrival, hostCapture + latency + kTransfer + jitter(random));
+                frames.push_back(Frame{deviceBase + static_cast<uint64_t>(t), static_cast<uint64_t>(arrival), isVideo});
+            }
+        };
+
+        addStream(1e9 / 60.0, kVideoLatency, true);
+        addStream(1024e9 / 48000.0, kAudioLatency, false);
+
+        std::stable_sort(frames.begin(), frames.end(),
+                         [](const Frame &a, const Frame &b) { return a.arrival < b.arrival; });
+        return frames;
+    }
+
+    // Largest error of the mapped video capture times after settle
+    // nanoseconds, against the host time the quickest frames reveal, and
+    // the range of intervals between consecutive video frames
+    struct Result
+    {
+        double maxError{0.0};
+        double minInterval{1e18};
+        double maxInterval{0.0};
+    };
+
+    Result run(ClockRecovery &clock, const std::vector<Frame> &frames, const uint64_t deviceBase,
+               const uint64_t hostStart, const double settle)
+    {
+        Result result;
+        double previous{0.0};
+
+        for (const auto &frame : frames)
+        {
+            clock.update(frame.deviceTime, frame.arrival);
+
+            if (!frame.isVideo)
+            {
+                continue;
+            }
+
+            const auto elapsed = static_cast<double>(frame.deviceTime - deviceBase);
+            const auto truth = static_cast<double>(hostStart) + elapsed * kDrift + kAudioLatency + kTransfer;
+
+            // toHostTime() is on OBS's clock, which is set to match portal's
+            const auto mapped = static_cast<double>(clock.toHostTime(frame.deviceTime));
+
+            if (elapsed >= settle)
+            {
+                result.maxError = std::max(result.maxError, std::fabs(mapped - truth));
+                result.minInterval = std::min(result.minInterval, mapped - previous);
+                result.maxInterval = std::max(result.maxInterval, mapped - previous);
+            }
+
+            previous = mapped;
+        }
+
+        return result;
+    }
+}
+
+int main()
+{
+    std::mt19937 random{1};
+    ClockRecovery clock;
+
+    // Deterministic, rather than measured from the live clocks
+    clock.setObsOffset(0);
+
+    const auto minute = simulate(random, 0.0, 60e9, kDeviceBase, kHostBase);
+    const auto steady = run(clock, minute, kDeviceBase, kHostBase, 10e9);
+
+    std::printf("error %.3f ms, video frame interval %.3f..%.3f ms\n", steady.maxError / 1e6,
+                steady.minInterval / 1e6, steady.maxInterval / 1e6);
+
+    check(steady.maxError < 1e6, "a minute of drifting, interleaved frames maps to within 1 ms");
+    check((steady.minInterval > 16.4e6) && (steady.maxInterval < 17.0e6),
+          "video keeps its spacing, so the clock never resynchronizes");
+
+    // The device reboots and its clock starts over near zero
+    const auto hostRestart = kHostBase + 70000000000;
+    const auto restart = simulate(random, 0.0, 5e9, 1000, hostRestart);
+    const auto restarted = run(clock, restart, 1000, hostRestart, 2e9);
+
+    check(restarted.maxError < 1e6, "a device clock that starts over is followed within 2 s");
+
+    std::printf("\n%d failed\n", g_failures);
+    return (g_failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,271 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+
+// Runs the plugin's side of the control back-channel against a FakeDevice
+// and checks that requests reach the device and answers come back: the
+// hello and the frame version agreed in it, keyframe requests and their
+// rate limit, quality steps, loss accounting on version 2 frames, and that a
+// corrupt stream drops the connection. Exits non-zero if anything is off.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <thread>
+
+#include "Channel.hpp"
+#include "DeviceControl.hpp"
+#include "FakeDevice.hpp"
+#include "Protocol.hpp"
+
+#ifdef WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+namespace
+{
+    constexpr auto kTimeout = std::chrono::milliseconds(1000);
+
+    // Plays the part of Portal, counting what arrives
+    class Receiver final : public portal::ChannelDelegate
+    {
+    public:
+        void channel_onPacketsReceive(const portal::ProtocolPacketSpan &packets) override
+        {
+            for (const auto &packet : packets)
+            {
+                ++m_frames;
+                m_payloadBytes += packet.packet.size();
+                m_lost += packet.lostBefore;
+
+                if (packet.flags & portal::PortalFrameFlagKeyframe)
+                {
+                    ++m_keyframes;
+                }
+            }
+        }
+
+        void channel_onStop() override {}
+
+        std::atomic<std::size_t> m_frames{0};
+        std::atomic<std::size_t> m_keyframes{0};
+        std::atomic<std::size_t> m_payloadBytes{0};
+        std::atomic<uint64_t> m_lost{0};
+    };
+
+    int g_failures{0};
+
+    // For what happens on the channel's receiving thread
+    bool waitUntil(const std::function<bool()> &condition)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + kTimeout;
+        while (!condition())
+        {
+            if (std::chrono::steady_clock::now() > deadline)
+            {
+                return false;
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        return true;
+    }
+
+    void check(const bool passed, const char *what)
+    {
+        std::printf("%s  %s\n", passed ? "ok  " : "FAIL", what);
+        if (!passed)
+        {
+            ++g_failures;
+        }
+    }
+
+    std::shared_ptr<portal::Channel> openChannel(FakeDevice *&device, const FakeDevice::Options &options,
+                                                 std::shared_ptr<Receiver> receiver)
+    {
+        auto backend = std::make_unique<FakeDevice>(options);
+        device = backend.get();
+
+        auto channel = std::make_shared<portal::Channel>(0, std::move(backend));
+        channel->configureProtocolDelegate();
+        channel->setDelegate(receiver);
+
+        return channel;
+    }
+}
+
+int main()
+{
+    constexpr uint32_t kVideo{101};
+
+    {
+        FakeDevice *device{nullptr};
+        auto receiver = std::make_shared<Receiver>();
+        auto channel = openChannel(device, FakeDevice::Options{}, receiver);
+
+        check(device->waitFor([&]() { return device->helloVersion() == portal::kPortalFrameMaxVersion; }, kTimeout),
+              "hello carries the newest frame version");
+
+        std::atomic<uint32_t> status{~0u};
+        const auto onResponse = [&](const portal::ProtocolPacket &response) {
+            uint32_t value{0};
+            std::memcpy(&value, response.packet.data(), sizeof(value));
+            status = ntohl(value);
+        };
+
+        // Refused until the answer to the hello has been read
+        const auto sendRequest = [&]() {
+            return channel->request(portal::kPortalFrameTypeKeyframeRequest, nullptr, 0, onResponse);
+        };
+
+        check(waitUntil(sendRequest) && device->waitFor([&]() { return device->keyframeRequests() == 1; }, kTimeout) &&
+                  waitUntil([&]() { return status == portal::PortalRequestStatusOk; }),
+              "a tagged request gets its own answer");
+
+        DeviceControl control;
+        control.setChannel(channel);
+
+        control.requestKeyframe();
+        control.requestKeyframe();
+        check(device->waitFor([&]() { return device->keyframeRequests() == 2; }, kTimeout) &&
+                  !device->waitFor([&]() { return device->keyframeRequests() > 2; }, std::chrono::milliseconds(100)),
+              "keyframe requests are rate limited");
+
+        control.reportLoad(true);
+        control.reportLoad(true);
+        check(device->waitFor([&]() { return device->quality() == -1; }, kTimeout) &&
+                  !device->waitFor([&]() { return device->quality() < -1; }, std::chrono::milliseconds(100)),
+              "falling behind lowers quality one step at a time");
+
+        device->sendFrame(kVideo, "k", portal::PortalFrameFlagKeyframe);
+        device->sendFrame(kVideo, "r");
+        device->skipFrames(kVideo, 2);
+        device->sendFrame(kVideo, "r");
+        check(waitUntil([&]() { return receiver->m_frames == 3; }) && (receiver->m_keyframes == 1) &&
+                  (receiver->m_lost == 2),
+              "frames skipped by the device are counted as lost");
+
+        channel->close();
+        check(!channel->send(portal::SimpleDataPacketProtocol::encodeFrame(kVideo, 0, nullptr, 0)),
+              "a closed channel refuses to send");
+    }
+
+    {
+        FakeDevice::Options options;
+        options.answersHello = false;
+        options.answersRequests = false;
+
+        FakeDevice *device{nullptr};
+        auto receiver = std::make_shared<Receiver>();
+        auto channel = openChannel(device, options, receiver);
+
+        device->sendFrame(kVideo, "k", portal::PortalFrameFlagKeyframe);
+        check(waitUntil([&]() { return receiver->m_frames == 1; }), "an old device still streams");
+
+        check(!channel->request(portal::kPortalFrameTypeKeyframeRequest, nullptr, 0, nullptr),
+              "requests wait for the device to answer the hello");
+
+        // PeerTalk senders put 1 in the version field of plain headers
+        auto frame = portal::SimpleDataPacketProtocol::encodeFrame(kVideo, 0, "12345678", 8);
+        const auto version = htonl(1);
+        std::memcpy(frame.data(), &version, sizeof(version));
+        device->sendBytes(frame);
+        device->sendBytes(frame);
+
+        check(waitUntil([&]() { return receiver->m_frames == 3; }) && (receiver->m_payloadBytes == 17),
+              "without an answer to the hello, version fields don't change the header");
+
+        channel->close();
+    }
+
+    {
+        FakeDevice::Options options;
+        options.answersRequests = false;
+
+        FakeDevice *device{nullptr};
+        auto receiver = std::make_shared<Receiver>();
+        auto channel = openChannel(device, options, receiver);
+
+        // The first request is tagged 1, and stays waiting for an answer
+        std::atomic<bool> isAnswered{false};
+        check(waitUntil([&]() {
+                  return channel->request(portal::kPortalFrameTypeKeyframeRequest, nullptr, 0,
+                                          [&](const portal::ProtocolPacket &) { isAnswered = true; });
+              }),
+              "a request is sent once the hello is answered");
+
+        device->sendBytes(portal::SimpleDataPacketProtocol::encodeFrame(kVideo, 1, "k", 1));
+        check(waitUntil([&]() { return receiver->m_frames == 1; }) && !isAnswered,
+              "a media frame with a waiting request's tag isn't taken for its answer");
+
+        channel->close();
+    }
+
+    {
+        FakeDevice *device{nullptr};
+        auto receiver = std::make_shared<Receiver>();
+        auto channel = openChannel(device, FakeDevice::Options{}, receiver);
+
+        device->sendFrame(kVideo, "k", portal::PortalFrameFlagKeyframe);
+        check(waitUntil([&]() { return receiver->m_frames == 1; }), "frames arrive before the corrupt header");
+
+        const auto allocationCount = portal::PacketBufferPool::shared().allocationCount();
+
+        // A version 0 header claiming almost 4 GB of payload
+        auto header = portal::SimpleDataPacketProtocol::encodeFrame(kVideo, 0, nullptr, 0);
+        const auto payloadSize = htonl(0xfffffff0u);
+        std::memcpy(header.data() + 12, &payloadSize, sizeof(payloadSize));
+        device->sendBytes(header);
+
+        const auto frame = portal::SimpleDataPacketProtocol::encodeFrame(kVideo, 0, nullptr, 0);
+        check(waitUntil([&]() { return !channel->send(frame); }) &&
+                  (portal::PacketBufferPool::shared().allocationCount() == allocationCount),
+              "an oversized frame drops the connection without allocating for it");
+
+        channel->close();
+    }
+
+    {
+        FakeDevice *device{nullptr};
+        auto receiver = std::make_shared<Receiver>();
+        auto channel = openChannel(device, FakeDevice::Options{}, receiver);
+
+        check(device->waitFor([&]() { return device->helloVersion() != 0; }, kTimeout), "the hello is answered");
+
+        auto frame = portal::SimpleDataPacketProtocol::encodeFrame(kVideo, 0, "12345678", 8);
+        const auto version = htonl(7);
+        std::memcpy(frame.data(), &version, sizeof(version));
+        device->sendBytes(frame);
+
+        const auto probe = portal::SimpleDataPacketProtocol::encodeFrame(kVideo, 0, nullptr, 0);
+        check(waitUntil([&]() { return !channel->send(probe); }) && (receiver->m_frames == 0),
+              "a frame version that wasn't agreed on drops the connection");
+
+        channel->close();
+    }
+
+    std::printf("\n%d failed\n", g_failures);
+    return (g_failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,560 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+// Replays a recorded portal stream through the plugin's protocol parser and
+// decoders, without OBS or a device, and reports how fast it decodes.
+//
+// The input is either a channel capture (see StreamCapture.hpp), which keeps
+// the original reads and their timing, or a raw stream holding the bytes
+// exactly as the device sends them: portal frames of a big-endian header
+// (version, type, tag, payload size, and once the device has answered the
+// hello with version 1 or later, the capture time) followed by the payload.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FFMpegAudioDecoder.hpp"
+#include "FFMpegVideoDecoder.hpp"
+#include "H264Parser.hpp"
+#include "LatencyTracer.hpp"
+#include "PacketBuffer.hpp"
+#include "Protocol.hpp"
+#include "StreamCapture.hpp"
+
+#ifdef WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    // Bytes handed to the parser at once when not pacing, about what a
+    // single USB read returns
+    constexpr std::size_t kReadSize{1 << 16};
+
+    // Stop waiting for output once nothing has come out for this long. The
+    // last few pictures stay inside a frame threaded decoder for good.
+    constexpr auto kIdleTimeout = std::chrono::milliseconds(500);
+
+    std::atomic<std::size_t> g_allocationCount{0};
+}
+
+// Every operator new in the process is counted, which covers the plugin's
+// own allocations but not the ones libavcodec makes with av_malloc.
+void *operator new(std::size_t size)
+{
+    g_allocationCount.fetch_add(1, std::memory_order_relaxed);
+
+    if (const auto memory = std::malloc(size ? size : 1))
+    {
+        return memory;
+    }
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void *memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+
+namespace
+{
+    struct BenchmarkOptions final
+    {
+        std::string streamPath{};
+
+        // Video frames per second to release a raw stream at, 0 for max speed
+        double pacedFps{0.0};
+
+        // Replay a capture with its original timing rather than at max speed
+        bool realtime{false};
+
+        std::vector<int> threadCounts{0};
+        DecodeThreading threading{DecodeThreading::FrameAndSlice};
+        bool decodeAudio{true};
+    };
+
+    struct RunResult final
+    {
+        int threadCount{0};
+        std::size_t fedPictures{0};
+        std::size_t videoFrames{0};
+        std::size_t audioFrames{0};
+        double seconds{0.0};
+        LatencyHistogram::Summary decode{};
+        LatencyHistogram::Summary queue{};
+        LatencyHistogram::Summary total{};
+        std::size_t allocations{0};
+        std::size_t packetBuffers{0};
+    };
+
+    // Stands in for the obs_source the decoders output to
+    class OutputSink final
+    {
+    public:
+        OutputSink()
+        {
+            m_source.output_video = [](void *param, const obs_source_frame *) {
+                static_cast<OutputSink *>(param)->onOutput(true);
+            };
+            m_source.output_audio = [](void *param, const obs_source_audio *) {
+                static_cast<OutputSink *>(param)->onOutput(false);
+            };
+            m_source.param = this;
+        }
+
+        obs_source_t *source() noexcept { return &m_source; }
+
+        std::size_t videoFrames() const noexcept { return m_videoFrames.load(); }
+        std::size_t audioFrames() const noexcept { return m_audioFrames.load(); }
+
+        Clock::time_point lastVideoOutput()
+        {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            return m_lastVideoOutput;
+        }
+
+        // Blocks while more than maxInFlight pictures are waiting to come
+        // out, so the decoders' queues never overflow. Gives up when output
+        // stalls, e.g. because the decoder dropped or rejected pictures.
+        void waitForBacklog(const std::size_t fedPictures, const std::size_t maxInFlight)
+        {
+            std::unique_lock<std::mutex> lock{m_mutex};
+
+            auto outputFrames = m_videoFrames.load();
+            while (fedPictures > outputFrames + maxInFlight)
+            {
+                if (!m_cv.wait_for(lock, kIdleTimeout, [&]() { return m_videoFrames.load() != outputFrames; }))
+                {
+                    return;
+                }
+
+                outputFrames = m_videoFrames.load();
+            }
+        }
+
+        // Waits until output has stopped for kIdleTimeout
+        void waitUntilIdle()
+        {
+            std::unique_lock<std::mutex> lock{m_mutex};
+
+            std::size_t outputFrames{0};
+            do
+            {
+                outputFrames = m_videoFrames.load() + m_audioFrames.load();
+            } while (m_cv.wait_for(lock, kIdleTimeout,
+                                   [&]() { return m_videoFrames.load() + m_audioFrames.load() != outputFrames; }));
+        }
+
+    private:
+        void onOutput(const bool isVideo)
+        {
+            {
+                std::lock_guard<std::mutex> lock{m_mutex};
+
+                if (isVideo)
+                {
+                    m_lastVideoOutput = Clock::now();
+                    ++m_videoFrames;
+                }
+                else
+                {
+                    ++m_audioFrames;
+                }
+            }
+
+            m_cv.notify_all();
+        }
+
+        obs_source_t                m_source{};
+        std::mutex                  m_mutex{};
+        std::condition_variable     m_cv{};
+        std::atomic<std::size_t>    m_videoFrames{0};
+        std::atomic<std::size_t>    m_audioFrames{0};
+        Clock::time_point           m_lastVideoOutput{};
+    };
+
+    // Plays the part of the Portal/IOSCameraInput delegate chain
+    class StreamFeeder final : public portal::SimpleDataPacketProtocolDelegate
+    {
+    public:
+        StreamFeeder(FFMpegVideoDecoder &videoDecoder, FFMpegAudioDecoder *audioDecoder)
+            :
+            m_videoDecoder{videoDecoder},
+            m_audioDecoder{audioDecoder}
+        {
+        }
+
+        void simpleDataPacketProtocolDelegate_onProcessPackets(const portal::ProtocolPacketSpan &packets) override
+        {
+            for (const auto &packet : packets)
+            {
+                if (packet.type != PacketTypeVideo)
+                {
+                    continue;
+                }
+
+                const auto data = reinterpret_cast<const uint8_t *>(packet.packet.data());
+                if (classifyH264Packet(data, packet.packet.size()) != H264FrameType::Config)
+                {
+                    ++m_fedPictures;
+                }
+            }
+
+            m_videoDecoder.input(packets);
+
+            if (m_audioDecoder)
+            {
+                m_audioDecoder->input(packets);
+            }
+        }
+
+        std::size_t fedPictures() const noexcept { return m_fedPictures; }
+
+    private:
+        FFMpegVideoDecoder&     m_videoDecoder;
+        FFMpegAudioDecoder*     m_audioDecoder{nullptr};
+        std::size_t             m_fedPictures{0};
+    };
+
+    // Calls onFrame(frameData, frameSize) for each complete portal frame in
+    // a raw stream. Like the parser, it only reads versions once the
+    // device's answer to the hello has gone by.
+    template <typename Callback>
+    void forEachPortalFrame(const portal::MappedFile &stream, Callback onFrame)
+    {
+        std::size_t offset{0};
+        bool isHelloAnswered{false};
+        uint32_t agreedVersion{0};
+
+        while (offset + sizeof(portal::PortalFrame) <= stream.size())
+        {
+            portal::PortalFrame header;
+            std::memcpy(&header, stream.data() + offset, sizeof(header));
+
+            const auto version = isHelloAnswered ? ntohl(header.version) : 0;
+            if (version > agreedVersion)
+            {
+                std::fprintf(stderr, "Frame version %u wasn't agreed on, the stream ends here\n", version);
+                break;
+            }
+
+            const auto headerSize = portal::portalFrameHeaderSize(version);
+            const auto frameSize = headerSize + ntohl(header.payloadSize);
+            if (offset + frameSize > stream.size())
+            {
+                break;
+            }
+
+            if (!isHelloAnswered && (ntohl(header.type) == portal::kPortalFrameTypeHello) &&
+                (ntohl(header.payloadSize) >= sizeof(uint32_t)))
+            {
+                uint32_t payload;
+                std::memcpy(&payload, stream.data() + offset + headerSize, sizeof(payload));
+
+                isHelloAnswered = true;
+                agreedVersion = std::min(ntohl(payload), portal::kPortalFrameMaxVersion);
+            }
+
+            onFrame(stream.data() + offset, frameSize);
+            offset += frameSize;
+        }
+    }
+
+    // Does what Channel's receiving thread does, reading from the capture
+    void replayCapture(const BenchmarkOptions &options, portal::SimpleDataPacketProtocol &protocol,
+                       std::function<void()> throttle)
+    {
+        const auto pacing = options.realtime ? portal::ReplayChannelBackend::Pacing::Original
+                                             : portal::ReplayChannelBackend::Pacing::MaxSpeed;
+
+        auto backend = portal::ReplayChannelBackend::open(options.streamPath, pacing);
+        if (!backend)
+        {
+            return;
+        }
+
+        if (!options.realtime)
+        {
+            backend->setThrottle(std::move(throttle));
+        }
+
+        for (;;)
+        {
+            std::size_t size{0};
+            const auto buffer = protocol.prepareWrite(size);
+
+            std::size_t received{0};
+            if (backend->receive(buffer, size, received) != 0)
+            {
+                break;
+            }
+
+            if (received > 0)
+            {
+                protocol.commitWrite(received, portal::monotonicNanoseconds());
+            }
+        }
+    }
+
+    RunResult runBenchmark(const portal::MappedFile &stream, const bool isCapture, const BenchmarkOptions &options,
+                           const int threadCount)
+    {
+        OutputSink sink;
+
+        SourceOutputs outputs;
+        outputs.add(sink.source());
+
+        FFMpegVideoDecoder videoDecoder;
+        videoDecoder.m_outputs = &outputs;
+        videoDecoder.setDecodeOptions(DecodeOptions{threadCount, options.threading});
+        videoDecoder.init();
+
+        std::unique_ptr<FFMpegAudioDecoder> audioDecoder;
+        if (options.decodeAudio)
+        {
+            audioDecoder.reset(new FFMpegAudioDecoder());
+            audioDecoder->m_outputs = &outputs;
+            audioDecoder->init();
+        }
+
+        auto feeder = std::make_shared<StreamFeeder>(videoDecoder, audioDecoder.get());
+        auto protocol = std::make_shared<portal::SimpleDataPacketProtocol>();
+        protocol->setDelegate(feeder);
+
+        // Keep the decoder's queue short enough that it never starts
+        // skipping pictures to catch up
+        const auto decoderThreads = threadCount ? threadCount : static_cast<int>(std::thread::hardware_concurrency());
+        const auto maxInFlight = static_cast<std::size_t>(std::max(decoderThreads, 1)) + 4;
+
+        auto &tracer = LatencyTracer::shared();
+        tracer.takeSummary(LatencyTrack::Video, LatencyStage::Decode);
+        tracer.takeSummary(LatencyTrack::Video, LatencyStage::Queue);
+        tracer.takeSummary(LatencyTrack::Video, LatencyStage::Total);
+
+        const auto allocations = g_allocationCount.load();
+        const auto packetBuffers = portal::PacketBufferPool::shared().allocationCount();
+        const auto start = Clock::now();
+
+        if (isCapture)
+        {
+            replayCapture(options, *protocol, [&]() { sink.waitForBacklog(feeder->fedPictures(), maxInFlight); });
+        }
+        else if (options.pacedFps > 0.0)
+        {
+            const auto interval = std::chrono::duration<double>(1.0 / options.pacedFps);
+            std::size_t pictures{0};
+
+            forEachPortalFrame(stream, [&](const char *frame, const std::size_t frameSize) {
+                protocol->processData(frame, static_cast<int>(frameSize));
+
+                if (feeder->fedPictures() > pictures)
+                {
+                    pictures = feeder->fedPictures();
+                    std::this_thread::sleep_until(start + std::chrono::duration_cast<Clock::duration>(interval * pictures));
+                }
+            });
+        }
+        else
+        {
+            for (std::size_t offset{0}; offset < stream.size(); offset += kReadSize)
+            {
+                sink.waitForBacklog(feeder->fedPictures(), maxInFlight);
+
+                const auto length = std::min(kReadSize, stream.size() - offset);
+                protocol->processData(stream.data() + offset, static_cast<int>(length));
+            }
+        }
+
+        sink.waitUntilIdle();
+
+        RunResult result{};
+        result.threadCount = threadCount;
+        result.fedPictures = feeder->fedPictures();
+        result.videoFrames = sink.videoFrames();
+        result.audioFrames = sink.audioFrames();
+        result.seconds = std::chrono::duration<double>(sink.lastVideoOutput() - start).count();
+        result.decode = tracer.takeSummary(LatencyTrack::Video, LatencyStage::Decode);
+        result.queue = tracer.takeSummary(LatencyTrack::Video, LatencyStage::Queue);
+        result.total = tracer.takeSummary(LatencyTrack::Video, LatencyStage::Total);
+        result.allocations = g_allocationCount.load() - allocations;
+        result.packetBuffers = portal::PacketBufferPool::shared().allocationCount() - packetBuffers;
+
+        videoDecoder.shutdown();
+        if (audioDecoder)
+        {
+            audioDecoder->shutdown();
+        }
+
+        return result;
+    }
+
+    double milliseconds(const uint64_t nanoseconds)
+    {
+        return static_cast<double>(nanoseconds) / 1000000.0;
+    }
+
+    void printResult(const RunResult &result)
+    {
+        const auto frames = std::max<std::size_t>(result.videoFrames, 1);
+        const auto fps = (result.seconds > 0.0) ? (static_cast<double>(result.videoFrames) / result.seconds) : 0.0;
+
+        std::printf("%7d %8zu/%-8zu %8.1f   %6.2f %6.2f %6.2f   %6.2f %6.2f   %6.2f %6.2f   %8.2f %8zu\n",
+                    result.threadCount, result.videoFrames, result.fedPictures, fps,
+                    milliseconds(result.decode.p50), milliseconds(result.decode.p99), milliseconds(result.decode.max),
+                    milliseconds(result.queue.p50), milliseconds(result.queue.p99),
+                    milliseconds(result.total.p50), milliseconds(result.total.p99),
+                    static_cast<double>(result.allocations) / static_cast<double>(frames), result.packetBuffers);
+    }
+
+    void printUsage(const char *program)
+    {
+        std::fprintf(stderr,
+                     "Usage: %s [options] <stream>\n"
+                     "\n"
+                     "Decodes a recorded portal stream and reports decoding throughput and latency.\n"
+                     "\n"
+                     "  --realtime                 replay a capture with its original timing\n"
+                     "  --paced <fps>              release a raw stream's video frames at this rate\n"
+                     "  --threads <n>[,<n>...]     decoder thread counts to run, 0 is one per core (default 0)\n"
+                     "  --threading <frame|slice>  libavcodec threading type (default frame)\n"
+                     "  --no-audio                 only decode video\n"
+                     "  --verbose                  show the decoders' log messages\n",
+                     program);
+    }
+
+    bool parseOptions(const int argc, char **argv, BenchmarkOptions &options)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            const std::string argument{argv[i]};
+            const auto hasValue = (i + 1 < argc);
+
+            if ((argument == "--paced") && hasValue)
+            {
+                options.pacedFps = std::atof(argv[++i]);
+            }
+            else if ((argument == "--threads") && hasValue)
+            {
+                options.threadCounts.clear();
+
+                std::stringstream list{argv[++i]};
+                std::string count;
+                while (std::getline(list, count, ','))
+                {
+                    options.threadCounts.push_back(std::atoi(count.c_str()));
+                }
+            }
+            else if ((argument == "--threading") && hasValue)
+            {
+                const std::string threading{argv[++i]};
+                if (threading == "slice")
+                {
+                    options.threading = DecodeThreading::Slice;
+                }
+                else if (threading != "frame")
+                {
+                    return false;
+                }
+            }
+            else if (argument == "--realtime")
+            {
+                options.realtime = true;
+            }
+            else if (argument == "--no-audio")
+            {
+                options.decodeAudio = false;
+            }
+            else if (argument == "--verbose")
+            {
+                obs_stub_log_level = LOG_DEBUG;
+            }
+            else if ((argument[0] != '-') && options.streamPath.empty())
+            {
+                options.streamPath = argument;
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+        return !options.streamPath.empty() && !options.threadCounts.empty();
+    }
+}
+
+int main(int argc, char **argv)
+{
+    BenchmarkOptions options;
+    obs_stub_log_level = LOG_WARNING;
+
+    if (!parseOptions(argc, argv, options))
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    portal::MappedFile stream;
+    if (!stream.open(options.streamPath))
+    {
+        std::fprintf(stderr, "Could not open %s\n", options.streamPath.c_str());
+        return 1;
+    }
+
+    const auto isCapture = portal::ReplayChannelBackend::isCapture(stream.data(), stream.size());
+    const auto isPaced = isCapture ? options.realtime : (options.pacedFps > 0.0);
+
+    std::printf("%s: %.1f MB %s, %s, %s threading\n\n", options.streamPath.c_str(),
+                static_cast<double>(stream.size()) / (1024.0 * 1024.0), isCapture ? "capture" : "raw stream",
+                isPaced ? "paced" : "max speed", (options.threading == DecodeThreading::Slice) ? "slice" : "frame");
+
+    std::printf("%7s %17s %8s   %20s   %13s   %13s   %8s %8s\n", "threads", "frames out/in", "fps",
+                "decode p50/p99/max", "queue p50/p99", "total p50/p99", "allocs/f", "buffers");
+
+    LatencyTracer::shared().enable();
+
+    for (const auto threadCount : options.threadCounts)
+    {
+        printResult(runBenchmark(stream, isCapture, options, threadCount));
+    }
+
+    return 0;
+}
@@ -0,0 +1,248 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+
+#include <algorithm>
+#include <cstring>
+
+#include "FakeDevice.hpp"
+#include "Protocol.hpp"
+
+#ifdef WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+namespace
+{
+    void appendBigEndian32(std::vector<char> &data, const uint32_t value)
+    {
+        const auto bigEndian = htonl(value);
+        const auto bytes = reinterpret_cast<const char *>(&bigEndian);
+        data.insert(data.end(), bytes, bytes + sizeof(bigEndian));
+    }
+
+    void appendBigEndian64(std::vector<char> &data, const uint64_t value)
+    {
+        appendBigEndian32(data, static_cast<uint32_t>(value >> 32));
+        appendBigEndian32(data, static_cast<uint32_t>(value));
+    }
+
+    uint32_t readBigEndian32(const char *data)
+    {
+        uint32_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return ntohl(value);
+    }
+}
+
+FakeDevice::FakeDevice(const Options &options)
+    :
+    m_options{options}
+{
+}
+
+void FakeDevice::sendFrame(const uint32_t type, const std::string &payload, const uint32_t flags,
+                           const uint64_t captureTime)
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    appendBigEndian32(m_toHost, m_version);
+    appendBigEndian32(m_toHost, type);
+    appendBigEndian32(m_toHost, 0);
+    appendBigEndian32(m_toHost, static_cast<uint32_t>(payload.size()));
+
+    if (m_version >= portal::kPortalFrameVersionCaptureTime)
+    {
+        appendBigEndian64(m_toHost, captureTime);
+    }
+
+    if (m_version >= portal::kPortalFrameVersionSequence)
+    {
+        appendBigEndian64(m_toHost, m_sequences[type]++);
+        appendBigEndian32(m_toHost, flags);
+        appendBigEndian32(m_toHost, 0);
+    }
+
+    m_toHost.insert(m_toHost.end(), payload.begin(), payload.end());
+
+    m_cv.notify_all();
+}
+
+void FakeDevice::sendBytes(const std::vector<char> &bytes)
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    m_toHost.insert(m_toHost.end(), bytes.begin(), bytes.end());
+    m_cv.notify_all();
+}
+
+void FakeDevice::skipFrames(const uint32_t type, const uint64_t count)
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_sequences[type] += count;
+}
+
+bool FakeDevice::waitFor(const std::function<bool()> &condition, const std::chrono::milliseconds timeout)
+{
+    std::unique_lock<std::mutex> lock{m_mutex};
+    return m_cv.wait_for(lock, timeout, condition);
+}
+
+int FakeDevice::receive(char *buffer, const std::size_t size, std::size_t &received)
+{
+    std::unique_lock<std::mutex> lock{m_mutex};
+
+    received = 0;
+    m_cv.wait_for(lock, kReceiveTimeout, [&]() { return !m_toHost.empty() || m_interrupted || m_closed; });
+
+    if (m_closed)
+    {
+        return -1;
+    }
+
+    // Hand the bytes over in reads of any size, like a socket would
+    received = std::min(size, m_toHost.size());
+    if (received > 0)
+    {
+        std::memcpy(buffer, m_toHost.data(), received);
+        m_toHost.erase(m_toHost.begin(), m_toHost.begin() + static_cast<std::ptrdiff_t>(received));
+    }
+
+    return 0;
+}
+
+int FakeDevice::send(const char *data, const std::size_t size)
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    if (m_closed)
+    {
+        return -1;
+    }
+
+    m_fromHost.insert(m_fromHost.end(), data, data + size);
+
+    // Take every complete frame off the front
+    std::size_t offset{0};
+    while (m_fromHost.size() - offset >= sizeof(portal::PortalFrame))
+    {
+        const auto frame = m_fromHost.data() + offset;
+        const auto payloadSize = readBigEndian32(frame + 12);
+        const auto frameSize = sizeof(portal::PortalFrame) + payloadSize;
+
+        if (m_fromHost.size() - offset < frameSize)
+        {
+            break;
+        }
+
+        handleFrame(readBigEndian32(frame), readBigEndian32(frame + 4), readBigEndian32(frame + 8),
+                    frame + sizeof(portal::PortalFrame), payloadSize);
+        offset += frameSize;
+    }
+
+    m_fromHost.erase(m_fromHost.begin(), m_fromHost.begin() + static_cast<std::ptrdiff_t>(offset));
+    m_cv.notify_all();
+
+    return 0;
+}
+
+void FakeDevice::handleFrame(const uint32_t version, const uint32_t type, const uint32_t tag, const char *payload,
+                             const std::size_t size)
+{
+    if (type == portal::kPortalFrameTypeHello)
+    {
+        m_helloVersion = version;
+
+        if (m_options.answersHello)
+        {
+            m_version = std::min(version, portal::kPortalFrameVersionSequence);
+
+            const auto bigEndian = htonl(m_version);
+            const auto frame = portal::SimpleDataPacketProtocol::encodeFrame(
+                type, 0, reinterpret_cast<const char *>(&bigEndian), sizeof(bigEndian));
+
+            m_toHost.insert(m_toHost.end(), frame.begin(), frame.end());
+        }
+
+        return;
+    }
+
+    if (!m_options.answersRequests)
+    {
+        return;
+    }
+
+    switch (type)
+    {
+    case portal::kPortalFrameTypeKeyframeRequest:
+        ++m_keyframeRequests;
+        respond(type, tag, portal::PortalRequestStatusOk);
+        break;
+
+    case portal::kPortalFrameTypeQualityRequest:
+    {
+        if (!m_options.supportsQuality || (size < sizeof(uint32_t)))
+        {
+            respond(type, tag, portal::PortalRequestStatusUnsupported);
+            break;
+        }
+
+        const auto steps = static_cast<int32_t>(readBigEndian32(payload));
+        const auto quality = std::min(std::max(m_quality + steps, m_options.minQuality), m_options.maxQuality);
+
+        respond(type, tag, (quality == m_quality) ? portal::PortalRequestStatusLimit : portal::PortalRequestStatusOk);
+        m_quality = quality;
+        break;
+    }
+
+    default:
+        respond(type, tag, portal::PortalRequestStatusUnsupported);
+        break;
+    }
+}
+
+void FakeDevice::respond(const uint32_t type, const uint32_t tag, const uint32_t status)
+{
+    if (tag == 0)
+    {
+        return;
+    }
+
+    const auto bigEndian = htonl(status);
+    const auto frame = portal::SimpleDataPacketProtocol::encodeFrame(type, tag, reinterpret_cast<const char *>(&bigEndian),
+                                                                     sizeof(bigEndian));
+
+    m_toHost.insert(m_toHost.end(), frame.begin(), frame.end());
+}
+
+void FakeDevice::interrupt()
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_interrupted = true;
+    m_cv.notify_all();
+}
+
+void FakeDevice::close()
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_closed = true;
+    m_cv.notify_all();
+}
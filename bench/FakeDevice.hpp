@@ -0,0 +1,108 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+
+#ifndef FakeDevice_hpp
+#define FakeDevice_hpp
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ChannelBackend.hpp"
+
+// Stands in for the app on the device at the other end of a portal Channel.
+// It sends whatever frames it is given, with the header of the version
+// agreed in the hello, and answers the plugin's hello, keyframe and quality
+// requests the way a device would, keeping track of what it was asked for.
+class FakeDevice final : public portal::ChannelBackend
+{
+public:
+    struct Options
+    {
+        // A device too old to know about the hello or requests ignores them
+        bool answersHello{true};
+        bool answersRequests{true};
+        bool supportsQuality{true};
+
+        // Quality steps the encoder can go, relative to where it starts
+        int minQuality{-3};
+        int maxQuality{0};
+    };
+
+    explicit FakeDevice(const Options &options);
+
+    // Queues a frame of the agreed version; version 2 frames are numbered in
+    // sequence with the frames of the same type sent before them
+    void sendFrame(const uint32_t type, const std::string &payload, const uint32_t flags = 0,
+                   const uint64_t captureTime = 0);
+
+    // Queues bytes as they are, such as a broken frame header
+    void sendBytes(const std::vector<char> &bytes);
+
+    // Leaves the next count sequence numbers of type out, as if the frames
+    // had been dropped on the device
+    void skipFrames(const uint32_t type, const uint64_t count);
+
+    // Waits until condition() holds, checking it whenever the plugin sends
+    // something. False on timeout.
+    bool waitFor(const std::function<bool()> &condition, const std::chrono::milliseconds timeout);
+
+    // What the plugin asked for; read them inside waitFor() or once it's done
+    uint32_t helloVersion() const noexcept { return m_helloVersion; }
+    std::size_t keyframeRequests() const noexcept { return m_keyframeRequests; }
+    int quality() const noexcept { return m_quality; }
+
+    // ChannelBackend
+
+    int receive(char *buffer, const std::size_t size, std::size_t &received) override;
+    int send(const char *data, const std::size_t size) override;
+    void interrupt() override;
+    void close() override;
+
+private:
+    static constexpr auto kReceiveTimeout = std::chrono::milliseconds(10);
+
+    void handleFrame(const uint32_t version, const uint32_t type, const uint32_t tag, const char *payload,
+                     const std::size_t size);
+    void respond(const uint32_t type, const uint32_t tag, const uint32_t status);
+
+    const Options                   m_options;
+
+    std::mutex                      m_mutex{};
+    std::condition_variable         m_cv{};
+    std::vector<char>               m_toHost{};
+    std::vector<char>               m_fromHost{};       // Partial frames
+    std::map<uint32_t, uint64_t>    m_sequences{};
+    bool                            m_interrupted{false};
+    bool                            m_closed{false};
+
+    uint32_t                        m_helloVersion{0};
+    uint32_t                        m_version{0};       // Agreed in the hello
+    std::size_t                     m_keyframeRequests{0};
+    int                             m_quality{0};
+};
+
+#endif /* FakeDevice_hpp */
@@ -0,0 +1,112 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include <obs.h>
+#include <obs-avc.h>
+#include <util/platform.h>
+
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+
+int obs_stub_log_level{LOG_INFO};
+
+void blog(int log_level, const char *format, ...)
+{
+    if (log_level > obs_stub_log_level)
+    {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    std::vfprintf(stderr, format, args);
+    va_end(args);
+
+    std::fputc('\n', stderr);
+}
+
+void obs_source_output_video(obs_source_t *source, const struct obs_source_frame *frame)
+{
+    if (source && source->output_video)
+    {
+        source->output_video(source->param, frame);
+    }
+}
+
+void obs_source_output_audio(obs_source_t *source, const struct obs_source_audio *audio)
+{
+    if (source && source->output_audio)
+    {
+        source->output_audio(source->param, audio);
+    }
+}
+
+bool video_format_get_parameters(enum video_colorspace color_space, enum video_range_type range,
+                                 float matrix[16], float min_range[3], float max_range[3])
+{
+    UNUSED_PARAMETER(color_space);
+
+    // Nothing renders the frames, so an identity matrix will do
+    std::memset(matrix, 0, sizeof(float) * 16);
+    for (int i = 0; i < 4; ++i)
+    {
+        matrix[i * 5] = 1.0f;
+    }
+
+    const auto full = (range == VIDEO_RANGE_FULL);
+    for (int i = 0; i < 3; ++i)
+    {
+        min_range[i] = full ? 0.0f : 16.0f / 255.0f;
+        max_range[i] = full ? 1.0f : 235.0f / 255.0f;
+    }
+
+    return true;
+}
+
+bool obs_avc_keyframe(const uint8_t *data, size_t size)
+{
+    // Same test as libobs: any IDR slice NAL unit
+    for (size_t i = 0; i + 3 < size; ++i)
+    {
+        if ((data[i] == 0) && (data[i + 1] == 0) && (data[i + 2] == 1))
+        {
+            const auto type = data[i + 3] & 0x1f;
+            if (type == 5)
+            {
+                return true;
+            }
+
+            if (type == 1)
+            {
+                return false;
+            }
+
+            i += 2;
+        }
+    }
+
+    return false;
+}
+
+uint64_t os_gettime_ns(void)
+{
+    const auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count());
+}
@@ -0,0 +1,48 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+// The few libusbmuxd calls the portal channel makes, for building it without
+// libusbmuxd. There is never a device on the other end.
+
+#include <usbmuxd.h>
+
+int usbmuxd_send(int sfd, const char *data, uint32_t len, uint32_t *sent_bytes)
+{
+    (void)sfd;
+    (void)data;
+    (void)len;
+    *sent_bytes = 0;
+    return -1;
+}
+
+int usbmuxd_recv_timeout(int sfd, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
+{
+    (void)sfd;
+    (void)data;
+    (void)len;
+    (void)timeout;
+    *recv_bytes = 0;
+    return -1;
+}
+
+int usbmuxd_disconnect(int sfd)
+{
+    (void)sfd;
+    return -1;
+}
@@ -0,0 +1,143 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+// Just enough of libobs for the decoders to build outside of OBS. The
+// names and layouts match libobs, but only what the plugin's decoding path
+// touches is declared.
+
+#ifndef OBS_STUB_H
+#define OBS_STUB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_AV_PLANES 8
+
+#define LOG_ERROR 100
+#define LOG_WARNING 200
+#define LOG_INFO 300
+#define LOG_DEBUG 400
+
+#define UNUSED_PARAMETER(param) (void)param
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum video_format {
+	VIDEO_FORMAT_NONE,
+	VIDEO_FORMAT_I420,
+	VIDEO_FORMAT_NV12,
+	VIDEO_FORMAT_YVYU,
+	VIDEO_FORMAT_YUY2,
+	VIDEO_FORMAT_UYVY,
+	VIDEO_FORMAT_RGBA,
+	VIDEO_FORMAT_BGRA,
+	VIDEO_FORMAT_BGRX,
+	VIDEO_FORMAT_Y800,
+	VIDEO_FORMAT_I444,
+};
+
+enum video_colorspace {
+	VIDEO_CS_DEFAULT,
+	VIDEO_CS_601,
+	VIDEO_CS_709,
+};
+
+enum video_range_type {
+	VIDEO_RANGE_DEFAULT,
+	VIDEO_RANGE_PARTIAL,
+	VIDEO_RANGE_FULL,
+};
+
+enum audio_format {
+	AUDIO_FORMAT_UNKNOWN,
+	AUDIO_FORMAT_U8BIT,
+	AUDIO_FORMAT_16BIT,
+	AUDIO_FORMAT_32BIT,
+	AUDIO_FORMAT_FLOAT,
+	AUDIO_FORMAT_U8BIT_PLANAR,
+	AUDIO_FORMAT_16BIT_PLANAR,
+	AUDIO_FORMAT_32BIT_PLANAR,
+	AUDIO_FORMAT_FLOAT_PLANAR,
+};
+
+enum speaker_layout {
+	SPEAKERS_UNKNOWN,
+	SPEAKERS_MONO,
+	SPEAKERS_STEREO,
+	SPEAKERS_2POINT1,
+	SPEAKERS_4POINT0,
+	SPEAKERS_4POINT1,
+	SPEAKERS_5POINT1,
+	SPEAKERS_7POINT1 = 8,
+};
+
+struct obs_source_frame {
+	uint8_t *data[MAX_AV_PLANES];
+	uint32_t linesize[MAX_AV_PLANES];
+	uint32_t width;
+	uint32_t height;
+	uint64_t timestamp;
+
+	enum video_format format;
+	float color_matrix[16];
+	bool full_range;
+	float color_range_min[3];
+	float color_range_max[3];
+	bool flip;
+};
+
+struct obs_source_audio {
+	const uint8_t *data[MAX_AV_PLANES];
+	uint32_t frames;
+
+	enum speaker_layout speakers;
+	enum audio_format format;
+	uint32_t samples_per_sec;
+
+	uint64_t timestamp;
+};
+
+// Unlike in libobs the source is not opaque: whoever hosts the decoders
+// fills in where output should go.
+struct obs_source {
+	void (*output_video)(void *param, const struct obs_source_frame *frame);
+	void (*output_audio)(void *param, const struct obs_source_audio *audio);
+	void *param;
+};
+
+typedef struct obs_source obs_source_t;
+
+// Messages below this level are dropped, LOG_INFO by default
+extern int obs_stub_log_level;
+
+void blog(int log_level, const char *format, ...);
+
+void obs_source_output_video(obs_source_t *source, const struct obs_source_frame *frame);
+void obs_source_output_audio(obs_source_t *source, const struct obs_source_audio *audio);
+
+bool video_format_get_parameters(enum video_colorspace color_space, enum video_range_type range,
+				 float matrix[16], float min_range[3], float max_range[3]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
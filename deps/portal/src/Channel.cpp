@@ -21,25 +21,174 @@ Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
 namespace portal
 {
     Channel::Channel(const int port, const int conn)
+        : Channel(port, makeDeviceChannelBackend(conn))
+    {
+    }
+
+    Channel::Channel(const int port, std::unique_ptr<ChannelBackend> backend)
         : m_port{port},
-          m_conn{conn},
-          m_protocol{std::make_unique<SimpleDataPacketProtocol>()},
-          m_running{StartInternalThread()}
+          m_backend{std::move(backend)},
+          m_protocol{std::make_unique<SimpleDataPacketProtocol>()}
     {
+        // Set before reading starts, or it may see false and stop at once
+        m_running = true;
+
+        const auto fd = m_backend->pollableFd();
+        if (fd >= 0)
+        {
+            m_reactor = Reactor::shared();
+        }
+
+        if (m_reactor && !m_reactor->add(fd, this))
+        {
+            m_reactor = nullptr;
+        }
+
+        if (!m_reactor)
+        {
+            StartInternalThread();
+        }
+
+        // Tells the device which frame versions we read. Reading is already
+        // running, so frames sent in reply are never missed.
+        send(SimpleDataPacketProtocol::helloFrame());
     }
 
     Channel::~Channel()
     {
-        m_running = false;
+        StopInternalThread();
         WaitForInternalThreadToExit();
         portal_log_stderr("%s: Deallocating", __func__);
     }
 
     void Channel::close()
     {
-        m_running = false;
+        StopInternalThread();
         WaitForInternalThreadToExit();
-        usbmuxd_disconnect(m_conn);
+        m_backend->close();
+        stopCapture();
+
+        // A send() on another thread may still be writing the front frame
+        std::lock_guard<std::mutex> flushLock{m_flushMutex};
+        std::lock_guard<std::mutex> lock{m_sendMutex};
+        m_sendQueue.clear();
+        m_sentOffset = 0;
+    }
+
+    bool Channel::startCapture(const std::string &path)
+    {
+        auto capture = StreamCaptureWriter::create(path);
+        if (!capture)
+        {
+            return false;
+        }
+
+        std::atomic_store(&m_capture, capture);
+        portal_log_stdout("Capturing channel %d to %s", m_port, path.c_str());
+
+        return true;
+    }
+
+    void Channel::stopCapture()
+    {
+        // The writer finishes once the receiving thread lets go of it too
+        std::atomic_store(&m_capture, std::shared_ptr<StreamCaptureWriter>{});
+    }
+
+    bool Channel::send(std::vector<char> frame)
+    {
+        {
+            std::lock_guard<std::mutex> lock{m_sendMutex};
+
+            if (!m_running || (m_sendQueue.size() >= kMaxQueuedFrames))
+            {
+                return false;
+            }
+
+            m_sendQueue.push_back(std::move(frame));
+        }
+
+        if (m_backend->sendsWithoutBlocking())
+        {
+            flushSendQueue();
+        }
+
+        return true;
+    }
+
+    bool Channel::request(const uint32_t type, const char *payload, const std::size_t size, ResponseHandler onResponse)
+    {
+        auto frame = m_protocol->encodeRequest(type, payload, size, std::move(onResponse));
+        return !frame.empty() && send(std::move(frame));
+    }
+
+    void Channel::flushSendQueue()
+    {
+        std::lock_guard<std::mutex> flushLock{m_flushMutex};
+
+        for (;;)
+        {
+            const char *data{nullptr};
+            std::size_t size{0};
+            {
+                std::lock_guard<std::mutex> lock{m_sendMutex};
+                if (m_sendQueue.empty())
+                {
+                    waitForWritable(false);
+                    return;
+                }
+
+                // Only this function removes frames, and pushing to a deque
+                // leaves the existing ones where they are
+                const auto &frame = m_sendQueue.front();
+                data = frame.data() + m_sentOffset;
+                size = frame.size() - m_sentOffset;
+            }
+
+            std::size_t sent{0};
+            if (m_backend->trySend(data, size, sent) != 0)
+            {
+                portal_log_stderr("There was an error sending data");
+
+                std::lock_guard<std::mutex> lock{m_sendMutex};
+                m_sendQueue.clear();
+                m_sentOffset = 0;
+                waitForWritable(false);
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock{m_sendMutex};
+            if (sent < size)
+            {
+                // The socket is full; carry on once it has room, whether or
+                // not the device sends anything meanwhile
+                m_sentOffset += sent;
+                waitForWritable(true);
+                return;
+            }
+
+            m_sendQueue.pop_front();
+            m_sentOffset = 0;
+        }
+    }
+
+    void Channel::waitForWritable(const bool waits)
+    {
+        if (waits == m_waitsForWritable)
+        {
+            return;
+        }
+
+        m_waitsForWritable = waits;
+
+        if (m_reactor)
+        {
+            m_reactor->watchWritable(m_backend->pollableFd(), this, waits);
+        }
+        else
+        {
+            m_backend->setWaitsForWritable(waits);
+        }
     }
 
     bool Channel::StartInternalThread()
@@ -59,23 +208,37 @@ namespace portal
     void Channel::StopInternalThread()
     {
         m_running = false;
+
+        if (m_reactor)
+        {
+            // Waits for a read in progress on the reactor thread
+            m_reactor->remove(m_backend->pollableFd(), this);
+            return;
+        }
+
+        // Wake the thread if it is waiting for data
+        m_backend->interrupt();
     }
 
     void Channel::InternalThreadEntry()
     {
         while (m_running)
         {
-            constexpr uint32_t numberOfBytesToAskFor = 65536; // (1 << 16); // This is the value in DarkLighting
+            // Receive straight into the protocol's buffer so that every byte
+            // is written exactly once on its way to the decoders.
+            std::size_t numberOfBytesToAskFor = 0;
+            const auto buffer = m_protocol->prepareWrite(numberOfBytesToAskFor);
+
+            flushSendQueue();
 
-            uint32_t numberOfBytesReceived = 0;
-            char buffer[numberOfBytesToAskFor] = {0};
+            std::size_t numberOfBytesReceived = 0;
 
-            const int ret = usbmuxd_recv_timeout(m_conn, (char *)&buffer, numberOfBytesToAskFor, &numberOfBytesReceived, 10);
+            const int ret = m_backend->receive(buffer, numberOfBytesToAskFor, numberOfBytesReceived);
             if (ret == 0)
             {
                 if ((numberOfBytesReceived > 0) && m_running)
                 {
-                    m_protocol->processData((char *)buffer, numberOfBytesReceived);
+                    processReceived(buffer, numberOfBytesReceived);
                 }
             }
             else
@@ -86,12 +249,68 @@ namespace portal
         }
     }
 
-    void Channel::simpleDataPacketProtocolDelegate_onProcessPacket(const Packet packet, const int type, const int tag)
+    bool Channel::reactor_onReadable()
+    {
+        flushSendQueue();
+
+        for (std::size_t i = 0; (i < kReadsPerWakeup) && m_running; ++i)
+        {
+            std::size_t numberOfBytesToAskFor = 0;
+            const auto buffer = m_protocol->prepareWrite(numberOfBytesToAskFor);
+
+            std::size_t numberOfBytesReceived = 0;
+
+            if (m_backend->tryReceive(buffer, numberOfBytesToAskFor, numberOfBytesReceived) != 0)
+            {
+                portal_log_stderr("There was an error receiving data");
+                m_running = false;
+                break;
+            }
+
+            if (numberOfBytesReceived == 0)
+            {
+                // Drained; the reactor calls again once more data arrives
+                break;
+            }
+
+            processReceived(buffer, numberOfBytesReceived);
+        }
+
+        return m_running;
+    }
+
+    bool Channel::reactor_onWritable()
+    {
+        flushSendQueue();
+        return m_running;
+    }
+
+    void Channel::processReceived(const char *buffer, const std::size_t size)
+    {
+        const auto receivedTime = monotonicNanoseconds();
+
+        // Tee before parsing, which may reuse the buffer
+        const auto capture = std::atomic_load(&m_capture);
+        if (capture)
+        {
+            capture->write(buffer, size, receivedTime);
+        }
+
+        m_protocol->commitWrite(size, receivedTime);
+
+        if (m_protocol->hasFailed())
+        {
+            portal_log_stderr("Dropping the connection, its stream can't be parsed");
+            m_running = false;
+        }
+    }
+
+    void Channel::simpleDataPacketProtocolDelegate_onProcessPackets(const ProtocolPacketSpan &packets)
     {
         auto strongDelegate = m_delegate.lock();
         if (strongDelegate)
         {
-            strongDelegate->channel_onPacketReceive(packet, type, tag);
+            strongDelegate->channel_onPacketsReceive(packets);
         }
     }
 } // namespace portal
@@ -16,32 +16,66 @@ Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
  with this program. If not, see <https://www.gnu.org/licenses/>
  */
 
+#ifndef PORTAL_CHANNEL_H
+#define PORTAL_CHANNEL_H
+
 #include <usbmuxd.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include "logging.hpp"
+#include "ChannelBackend.hpp"
 #include "Protocol.hpp"
+#include "Reactor.hpp"
+#include "StreamCapture.hpp"
 
 namespace portal
 {
     struct ChannelDelegate
     {
-        virtual void channel_onPacketReceive(std::vector<char> packet, const int type, const int tag) = 0;
+        virtual void channel_onPacketsReceive(const ProtocolPacketSpan &packets) = 0;
         virtual void channel_onStop() = 0;
         virtual ~ChannelDelegate(){};
     };
 
-    class Channel final : public SimpleDataPacketProtocolDelegate, public std::enable_shared_from_this<Channel>
+    // Reads a device connection and feeds it to the protocol parser, either
+    // on the shared Reactor when the backend supports it, or on a thread of
+    // its own.
+    class Channel final : public SimpleDataPacketProtocolDelegate,
+                          public ReactorHandler,
+                          public std::enable_shared_from_this<Channel>
     {
     public:
         Channel(const int port, const int conn);
+        Channel(const int port, std::unique_ptr<ChannelBackend> backend);
         ~Channel();
 
         std::shared_ptr<Channel> getptr() { return shared_from_this(); }
 
         void close();
 
-        void simpleDataPacketProtocolDelegate_onProcessPacket(const Packet packet, const int type, const int tag) override;
+        // Tees every read into a capture file (see StreamCapture.hpp) until
+        // stopCapture() or the Channel goes away. Safe to call while running.
+        bool startCapture(const std::string &path);
+        void stopCapture();
+
+        // Queues an encoded frame for the device and returns without waiting
+        // for it to be written. Returns false once the channel is closed or
+        // when kMaxQueuedFrames are already waiting.
+        bool send(std::vector<char> frame);
+
+        // Sends a request; see SimpleDataPacketProtocol::encodeRequest().
+        // onResponse runs on the receiving thread. Returns false until the
+        // device has answered the hello.
+        bool request(const uint32_t type, const char *payload, const std::size_t size, ResponseHandler onResponse);
+
+        void simpleDataPacketProtocolDelegate_onProcessPackets(const ProtocolPacketSpan &packets) override;
+        bool reactor_onReadable() override;
+        bool reactor_onWritable() override;
 
         void setDelegate(std::shared_ptr<ChannelDelegate> delegate) { m_delegate = delegate; }
         int getPort() const noexcept { return m_port; }
@@ -51,14 +85,37 @@ namespace portal
         // Data members
 
         int m_port{};
-        int m_conn{};
 
+        std::unique_ptr<ChannelBackend> m_backend{nullptr};
         std::unique_ptr<SimpleDataPacketProtocol> m_protocol{nullptr};
         std::weak_ptr<ChannelDelegate> m_delegate{};
 
-        bool m_running{false};
+        // Read with std::atomic_load, the receiving thread may be using it
+        std::shared_ptr<StreamCaptureWriter> m_capture{nullptr};
+
+        std::atomic<bool> m_running{false};
         std::thread m_thread;
 
+        // Frames waiting to be written, oldest first. Sockets that can be
+        // written without blocking are flushed by whoever queues a frame,
+        // and once full, by the receiving thread as soon as they have room
+        // again; otherwise the receiving thread writes them between reads.
+        // The front frame may be partially written already.
+        static constexpr std::size_t kMaxQueuedFrames{64};
+
+        std::mutex m_sendMutex{};                   // Guards the queue
+        std::mutex m_flushMutex{};                  // Held while writing
+        std::deque<std::vector<char>> m_sendQueue{};
+        std::size_t m_sentOffset{0};                // Of the front frame
+        bool m_waitsForWritable{false};             // Guarded by m_flushMutex
+
+        // Set when the channel is read by the reactor instead of m_thread
+        Reactor *m_reactor{nullptr};
+
+        // Reads handled per wakeup, so a busy channel doesn't hold up the
+        // others sharing its reactor thread
+        static constexpr std::size_t kReadsPerWakeup{4};
+
         // Utility functions
 
         void setPacketDelegate(std::shared_ptr<SimpleDataPacketProtocolDelegate> delegate)
@@ -66,6 +123,10 @@ namespace portal
             m_protocol->setDelegate(delegate);
         }
 
+        void processReceived(const char *buffer, const std::size_t size);
+        void flushSendQueue();
+        void waitForWritable(const bool waits);
+
         bool StartInternalThread();
         void WaitForInternalThreadToExit();
         void StopInternalThread();
@@ -78,3 +139,5 @@ namespace portal
         }
     };
 } // namespace portal
+
+#endif
@@ -0,0 +1,283 @@
+/*
+ portal
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include <usbmuxd.h>
+
+#ifdef __linux__
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "ChannelBackend.hpp"
+#include "logging.hpp"
+
+namespace portal
+{
+    std::unique_ptr<ChannelBackend> makeDeviceChannelBackend(const int conn)
+    {
+#ifdef __linux__
+        auto backend = EpollChannelBackend::create(conn);
+        if (backend)
+        {
+            return backend;
+        }
+#endif
+
+        return std::make_unique<UsbmuxdChannelBackend>(conn);
+    }
+
+    int UsbmuxdChannelBackend::receive(char *buffer, const std::size_t size, std::size_t &received)
+    {
+        uint32_t numberOfBytesReceived = 0;
+
+        const int ret = usbmuxd_recv_timeout(m_conn, buffer, static_cast<uint32_t>(size), &numberOfBytesReceived,
+                                             kReceiveTimeout);
+
+        received = numberOfBytesReceived;
+        return (ret == 0) ? 0 : -1;
+    }
+
+    int UsbmuxdChannelBackend::send(const char *data, const std::size_t size)
+    {
+        std::size_t offset{0};
+        while (offset < size)
+        {
+            uint32_t sent = 0;
+            if (usbmuxd_send(m_conn, data + offset, static_cast<uint32_t>(size - offset), &sent) != 0)
+            {
+                return -1;
+            }
+
+            offset += sent;
+        }
+
+        return 0;
+    }
+
+    void UsbmuxdChannelBackend::close()
+    {
+        usbmuxd_disconnect(m_conn);
+    }
+
+#ifdef __linux__
+    std::unique_ptr<EpollChannelBackend> EpollChannelBackend::create(const int conn)
+    {
+        const auto flags = fcntl(conn, F_GETFL);
+        if ((flags < 0) || (fcntl(conn, F_SETFL, flags | O_NONBLOCK) < 0))
+        {
+            return nullptr;
+        }
+
+        const auto epollFd = epoll_create1(EPOLL_CLOEXEC);
+        const auto eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+        epoll_event socketEvent{};
+        socketEvent.events = EPOLLIN | EPOLLRDHUP;
+        socketEvent.data.fd = conn;
+
+        epoll_event wakeEvent{};
+        wakeEvent.events = EPOLLIN;
+        wakeEvent.data.fd = eventFd;
+
+        if ((epollFd < 0) || (eventFd < 0) ||
+            (epoll_ctl(epollFd, EPOLL_CTL_ADD, conn, &socketEvent) < 0) ||
+            (epoll_ctl(epollFd, EPOLL_CTL_ADD, eventFd, &wakeEvent) < 0))
+        {
+            portal_log_stderr("Could not set up epoll, falling back to polling");
+
+            if (epollFd >= 0)
+            {
+                ::close(epollFd);
+            }
+
+            if (eventFd >= 0)
+            {
+                ::close(eventFd);
+            }
+
+            fcntl(conn, F_SETFL, flags);
+            return nullptr;
+        }
+
+        return std::unique_ptr<EpollChannelBackend>(new EpollChannelBackend(conn, epollFd, eventFd));
+    }
+
+    EpollChannelBackend::EpollChannelBackend(const int conn, const int epollFd, const int eventFd)
+        :
+        m_conn{conn},
+        m_epollFd{epollFd},
+        m_eventFd{eventFd}
+    {
+    }
+
+    EpollChannelBackend::~EpollChannelBackend()
+    {
+        ::close(m_epollFd);
+        ::close(m_eventFd);
+    }
+
+    int EpollChannelBackend::tryReceive(char *buffer, const std::size_t size, std::size_t &received)
+    {
+        received = 0;
+
+        for (;;)
+        {
+            const auto ret = recv(m_conn, buffer, size, 0);
+            if (ret > 0)
+            {
+                received = static_cast<std::size_t>(ret);
+                return 0;
+            }
+
+            if (ret == 0)
+            {
+                // The device closed the connection
+                return -1;
+            }
+
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+        }
+    }
+
+    int EpollChannelBackend::receive(char *buffer, const std::size_t size, std::size_t &received)
+    {
+        for (;;)
+        {
+            // Try the read first; while a frame is streaming in there usually
+            // is data waiting, and the epoll_wait can be skipped.
+            const auto ret = tryReceive(buffer, size, received);
+            if ((ret != 0) || (received > 0))
+            {
+                return ret;
+            }
+
+            epoll_event events[2];
+            const auto count = epoll_wait(m_epollFd, events, 2, -1);
+            if ((count < 0) && (errno != EINTR))
+            {
+                return -1;
+            }
+
+            for (int i = 0; i < count; ++i)
+            {
+                // The eventfd is never read, so once interrupted every
+                // receive returns at once.
+                if (events[i].data.fd == m_eventFd)
+                {
+                    return 0;
+                }
+
+                // Room to finish sending, which the caller does between reads
+                if (events[i].events & EPOLLOUT)
+                {
+                    return 0;
+                }
+            }
+        }
+    }
+
+    int EpollChannelBackend::send(const char *data, const std::size_t size)
+    {
+        std::size_t offset{0};
+        while (offset < size)
+        {
+            const auto ret = ::send(m_conn, data + offset, size - offset, MSG_NOSIGNAL);
+            if (ret >= 0)
+            {
+                offset += static_cast<std::size_t>(ret);
+                continue;
+            }
+
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+            {
+                return -1;
+            }
+
+            // Wait for room in the socket's send buffer
+            pollfd writable{m_conn, POLLOUT, 0};
+            if ((poll(&writable, 1, -1) < 0) && (errno != EINTR))
+            {
+                return -1;
+            }
+        }
+
+        return 0;
+    }
+
+    int EpollChannelBackend::trySend(const char *data, const std::size_t size, std::size_t &sent)
+    {
+        sent = 0;
+
+        for (;;)
+        {
+            const auto ret = ::send(m_conn, data, size, MSG_NOSIGNAL);
+            if (ret >= 0)
+            {
+                sent = static_cast<std::size_t>(ret);
+                return 0;
+            }
+
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+        }
+    }
+
+    void EpollChannelBackend::setWaitsForWritable(const bool waits)
+    {
+        epoll_event socketEvent{};
+        socketEvent.events = EPOLLIN | EPOLLRDHUP | (waits ? EPOLLOUT : 0u);
+        socketEvent.data.fd = m_conn;
+
+        if (epoll_ctl(m_epollFd, EPOLL_CTL_MOD, m_conn, &socketEvent) < 0)
+        {
+            portal_log_stderr("Could not wait for the connection to be writable");
+        }
+    }
+
+    void EpollChannelBackend::interrupt()
+    {
+        const uint64_t value{1};
+        const auto ret = write(m_eventFd, &value, sizeof(value));
+        (void)ret;
+    }
+
+    void EpollChannelBackend::close()
+    {
+        usbmuxd_disconnect(m_conn);
+    }
+#endif
+} // namespace portal
@@ -0,0 +1,142 @@
+/*
+ portal
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef PORTAL_CHANNEL_BACKEND_H
+#define PORTAL_CHANNEL_BACKEND_H
+
+#include <cstddef>
+#include <memory>
+
+namespace portal
+{
+    // Where a Channel reads its bytes from. The default is a usbmuxd
+    // connection to the device; captures can be replayed through the same
+    // Channel with a ReplayChannelBackend.
+    class ChannelBackend
+    {
+    public:
+        virtual ~ChannelBackend(){};
+
+        // Reads up to size bytes into buffer, waiting for data either until
+        // some arrives or for a short while (around 10ms), depending on the
+        // backend. Returns 0 on success, which includes receiving no bytes,
+        // and a negative value once the connection is gone.
+        virtual int receive(char *buffer, const std::size_t size, std::size_t &received) = 0;
+
+        // A descriptor that becomes readable when there is data to receive,
+        // for backends the Reactor can wait on, or -1
+        virtual int pollableFd() const { return -1; }
+
+        // Like receive(), but returns at once when no data is available.
+        // Only used on backends with a pollableFd().
+        virtual int tryReceive(char *buffer, const std::size_t size, std::size_t &received)
+        {
+            return receive(buffer, size, received);
+        }
+
+        // Writes size bytes to the device. Returns 0 once all of them are
+        // sent and a negative value on error. Backends without a device on
+        // the other end, such as replays, discard the data.
+        virtual int send(const char *data, const std::size_t size)
+        {
+            (void)data;
+            (void)size;
+            return 0;
+        }
+
+        // Writes what it can of size bytes without waiting for room, and
+        // sets sent to how many that was. Returns 0 on success, which
+        // includes sending nothing, and a negative value on error. Unless
+        // sendsWithoutBlocking(), this is send() and may wait.
+        virtual int trySend(const char *data, const std::size_t size, std::size_t &sent)
+        {
+            sent = 0;
+            if (send(data, size) != 0)
+            {
+                return -1;
+            }
+
+            sent = size;
+            return 0;
+        }
+
+        virtual bool sendsWithoutBlocking() const { return false; }
+
+        // While set, a receive() waiting for data also returns, having
+        // received nothing, once the connection can be written again. Used
+        // to finish a partial trySend() when the device sends nothing.
+        virtual void setWaitsForWritable(const bool waits) { (void)waits; }
+
+        // Makes a receive() blocked on another thread, and every one after
+        // it, return right away
+        virtual void interrupt() {}
+
+        virtual void close() = 0;
+    };
+
+    // The best backend for a usbmuxd connection on this platform
+    std::unique_ptr<ChannelBackend> makeDeviceChannelBackend(const int conn);
+
+    class UsbmuxdChannelBackend final : public ChannelBackend
+    {
+    public:
+        explicit UsbmuxdChannelBackend(const int conn) : m_conn{conn} {}
+
+        int receive(char *buffer, const std::size_t size, std::size_t &received) override;
+        int send(const char *data, const std::size_t size) override;
+        void close() override;
+
+    private:
+        static constexpr unsigned int kReceiveTimeout{10};
+
+        int m_conn{};
+    };
+
+#ifdef __linux__
+    // Waits on the connection's socket with epoll instead of polling it, so
+    // an idle channel never wakes up and a read starts as soon as data is
+    // available. interrupt() signals an eventfd in the same epoll set.
+    class EpollChannelBackend final : public ChannelBackend
+    {
+    public:
+        // Returns nullptr if epoll or the eventfd can't be set up
+        static std::unique_ptr<EpollChannelBackend> create(const int conn);
+
+        ~EpollChannelBackend();
+
+        int receive(char *buffer, const std::size_t size, std::size_t &received) override;
+        int pollableFd() const override { return m_conn; }
+        int tryReceive(char *buffer, const std::size_t size, std::size_t &received) override;
+        int send(const char *data, const std::size_t size) override;
+        int trySend(const char *data, const std::size_t size, std::size_t &sent) override;
+        bool sendsWithoutBlocking() const override { return true; }
+        void setWaitsForWritable(const bool waits) override;
+        void interrupt() override;
+        void close() override;
+
+    private:
+        EpollChannelBackend(const int conn, const int epollFd, const int eventFd);
+
+        int m_conn{-1};
+        int m_epollFd{-1};
+        int m_eventFd{-1};
+    };
+#endif
+} // namespace portal
+
+#endif
@@ -16,6 +16,8 @@ Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
  with this program. If not, see <https://www.gnu.org/licenses/>
  */
 
+#include <chrono>
+#include <cstdlib>
 #include <string>
 #include <list>
 #include <sstream>
@@ -77,6 +79,18 @@ namespace portal
             m_connectedChannel = std::make_shared<Channel>(port, conn);
             m_connectedChannel->configureProtocolDelegate();
             m_connectedChannel->setDelegate(channelDelegate);
+
+            // Record the raw stream for offline replay when asked to
+            const auto captureDirectory = std::getenv("PORTAL_CAPTURE_DIR");
+            if (captureDirectory && *captureDirectory)
+            {
+                const auto seconds = std::chrono::duration_cast<std::chrono::seconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count();
+
+                std::ostringstream path;
+                path << captureDirectory << "/portal-" << m_uuid << "-" << seconds << ".cap";
+                m_connectedChannel->startCapture(path.str());
+            }
         }
         else
         {
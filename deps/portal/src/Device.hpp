@@ -16,6 +16,9 @@ Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
  with this program. If not, see <https://www.gnu.org/licenses/>
  */
 
+#ifndef PORTAL_DEVICE_H
+#define PORTAL_DEVICE_H
+
 #include <map>
 #include <string>
 #include <vector>
@@ -55,6 +58,9 @@ namespace portal
         bool isConnected() const;
         void disconnect();
 
+        // The channel opened by connect(), or nullptr
+        std::shared_ptr<Channel> channel() const noexcept { return m_connectedChannel; }
+
         int usbmuxdHandle() const noexcept { return m_device.handle; }
         uint16_t productID() const noexcept { return m_device.product_id; }
         std::string uuid() const noexcept { return m_uuid; }
@@ -87,3 +93,5 @@ namespace portal
         friend std::ostream &operator<<(std::ostream &os, const Device &v);
     };
 } // namespace portal
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ portal
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include "PacketBuffer.hpp"
+
+namespace portal
+{
+    PacketBuffer::PacketBuffer(const std::size_t capacity)
+        :
+        m_data{std::make_unique<char[]>(capacity + kPacketPadding)},
+        m_capacity{capacity}
+    {
+    }
+
+    PacketBufferPool &PacketBufferPool::shared()
+    {
+        // Intentionally leaked so that buffers released during static
+        // destruction still have a pool to return to.
+        static auto pool = new PacketBufferPool();
+        return *pool;
+    }
+
+    std::size_t PacketBufferPool::sizeClassIndex(const std::size_t capacity) noexcept
+    {
+        std::size_t index{0};
+        std::size_t classSize{kMinSizeClass};
+
+        while (classSize < capacity)
+        {
+            classSize <<= 1;
+            ++index;
+        }
+
+        return index;
+    }
+
+    std::shared_ptr<PacketBuffer> PacketBufferPool::acquire(const std::size_t capacity)
+    {
+        const auto index = sizeClassIndex(capacity);
+        const auto deleter = [this](PacketBuffer *buffer) { release(buffer); };
+
+        if (index >= kSizeClassCount)
+        {
+            // Too large to be worth keeping around
+            m_allocationCount++;
+            return std::shared_ptr<PacketBuffer>(new PacketBuffer(capacity));
+        }
+
+        PacketBuffer *buffer{nullptr};
+        {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            auto &freeBuffers = m_freeBuffers[index];
+            if (!freeBuffers.empty())
+            {
+                buffer = freeBuffers.back();
+                freeBuffers.pop_back();
+            }
+        }
+
+        if (!buffer)
+        {
+            m_allocationCount++;
+            buffer = new PacketBuffer(kMinSizeClass << index);
+        }
+
+        return std::shared_ptr<PacketBuffer>(buffer, deleter);
+    }
+
+    void PacketBufferPool::release(PacketBuffer *buffer) noexcept
+    {
+        const auto index = sizeClassIndex(buffer->capacity());
+
+        {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            auto &freeBuffers = m_freeBuffers[index];
+            if (freeBuffers.size() < kMaxFreeBuffersPerClass)
+            {
+                freeBuffers.push_back(buffer);
+                return;
+            }
+        }
+
+        delete buffer;
+    }
+} // namespace portal
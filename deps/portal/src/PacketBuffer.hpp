@@ -0,0 +1,125 @@
+/*
+ portal
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef PORTAL_PACKET_BUFFER_H
+#define PORTAL_PACKET_BUFFER_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace portal
+{
+    // Number of readable bytes every PacketBuffer keeps past its capacity.
+    // This matches AV_INPUT_BUFFER_PADDING_SIZE so payloads can be handed to
+    // libavcodec, whose bitstream readers may read past the end of the data.
+    constexpr std::size_t kPacketPadding{64};
+
+    // A fixed-capacity block of memory that received bytes are written into
+    // and frames are parsed out of in place. Payloads handed to delegates are
+    // views into a PacketBuffer, which stays alive for as long as any view
+    // still references it.
+    class PacketBuffer final
+    {
+    public:
+        explicit PacketBuffer(const std::size_t capacity);
+        ~PacketBuffer() = default;
+
+        PacketBuffer(const PacketBuffer &other) = delete;
+        PacketBuffer &operator=(const PacketBuffer &other) = delete;
+
+        char *data() noexcept { return m_data.get(); }
+        const char *data() const noexcept { return m_data.get(); }
+        std::size_t capacity() const noexcept { return m_capacity; }
+
+    private:
+        std::unique_ptr<char[]>     m_data{nullptr};
+        std::size_t                 m_capacity{0};
+    };
+
+    // Process-wide pool of PacketBuffers grouped into power-of-two size
+    // classes. Buffers handed out by acquire() return to their size class
+    // when the last reference to them is dropped, on whichever thread that
+    // happens to be.
+    class PacketBufferPool final
+    {
+    public:
+        static PacketBufferPool &shared();
+
+        std::shared_ptr<PacketBuffer> acquire(const std::size_t capacity);
+
+        // Number of buffers allocated from the heap since startup
+        std::size_t allocationCount() const noexcept { return m_allocationCount.load(); }
+
+        // Capacity of the largest buffers the pool keeps around
+        static constexpr std::size_t maxPooledCapacity() noexcept { return kMinSizeClass << (kSizeClassCount - 1); }
+
+    private:
+        static constexpr std::size_t kMinSizeClass{1 << 20};
+        static constexpr std::size_t kSizeClassCount{7}; // 1 MB ... 64 MB
+        static constexpr std::size_t kMaxFreeBuffersPerClass{8};
+
+        PacketBufferPool() = default;
+
+        void release(PacketBuffer *buffer) noexcept;
+        static std::size_t sizeClassIndex(const std::size_t capacity) noexcept;
+
+        std::mutex                                                  m_mutex{};
+        std::array<std::vector<PacketBuffer *>, kSizeClassCount>    m_freeBuffers{};
+        std::atomic<std::size_t>                                    m_allocationCount{0};
+    };
+
+    // A read-only view of a single frame payload. Copying a Packet only bumps
+    // the reference count of the PacketBuffer it points into.
+    class Packet final
+    {
+    public:
+        Packet() = default;
+        Packet(std::shared_ptr<const PacketBuffer> buffer, const std::size_t offset, const std::size_t size,
+               const bool padded = false) noexcept
+            :
+            m_buffer{std::move(buffer)},
+            m_data{m_buffer->data() + offset},
+            m_size{size},
+            m_padded{padded}
+        {
+        }
+
+        const char *data() const noexcept { return m_data; }
+        std::size_t size() const noexcept { return m_size; }
+        bool empty() const noexcept { return (m_size == 0); }
+
+        // True when at least kPacketPadding zeroed bytes follow the payload
+        bool isPadded() const noexcept { return m_padded; }
+
+        const char *begin() const noexcept { return m_data; }
+        const char *end() const noexcept { return m_data + m_size; }
+        char operator[](const std::size_t i) const noexcept { return m_data[i]; }
+
+    private:
+        std::shared_ptr<const PacketBuffer> m_buffer{nullptr};
+        const char*                         m_data{nullptr};
+        std::size_t                         m_size{0};
+        bool                                m_padded{false};
+    };
+} // namespace portal
+
+#endif
@@ -159,11 +159,11 @@ namespace portal
         }
     }
 
-    void Portal::channel_onPacketReceive(const Packet packet, const int type, const int tag)
+    void Portal::channel_onPacketsReceive(const ProtocolPacketSpan &packets)
     {
         if (m_delegate)
         {
-            m_delegate->portal_onDevicePacketReceive(packet, type, tag);
+            m_delegate->portal_onDevicePacketsReceive(packets);
         }
     }
 
@@ -16,6 +16,9 @@ Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
  with this program. If not, see <https://www.gnu.org/licenses/>
  */
 
+#ifndef PORTAL_PORTAL_H
+#define PORTAL_PORTAL_H
+
 #include <usbmuxd.h>
 #include <vector>
 #include <list>
@@ -29,12 +32,11 @@ using portal_channel_receive_cb_t = void (*)(char *buffer, int buffer_len, void
 
 namespace portal
 {
-    using Packet = std::vector<char>;
     using DeviceMap = std::map<int, Device::shared_ptr>;
 
     struct PortalDelegate
     {
-        virtual void portal_onDevicePacketReceive(const Packet packet, const int type, const int tag) = 0;
+        virtual void portal_onDevicePacketsReceive(const ProtocolPacketSpan &packets) = 0;
         virtual void portal_onDeviceListUpdate(const DeviceMap deviceMap) = 0;
         virtual ~PortalDelegate(){};
     };
@@ -81,9 +83,11 @@ namespace portal
         void addDevice(const usbmuxd_device_info_t &device);
         void removeDevice(const usbmuxd_device_info_t &device);
 
-        void channel_onPacketReceive(const Packet packet, const int type, const int tag);
+        void channel_onPacketsReceive(const ProtocolPacketSpan &packets);
         void channel_onStop();
 
         friend void pt_usbmuxd_cb(const usbmuxd_event_t *event, void *user_data);
     };
 } // namespace portal
+
+#endif
@@ -19,6 +19,7 @@ Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
 #include <cstdint>
 #include <iostream>
 #include <cstring>
+#include <algorithm>
 #include "Protocol.hpp"
 
 #ifdef WIN32
@@ -36,70 +37,442 @@ namespace portal
 
     SimpleDataPacketProtocol::~SimpleDataPacketProtocol()
     {
-        m_buffer.clear();
+        reset();
         portal_log_stdout("SimpleDataPacketProtocol destroyed");
     }
 
-    int SimpleDataPacketProtocol::processData(const char *data, const int dataLength)
+    void SimpleDataPacketProtocol::reset()
+    {
+        m_buffer = nullptr;
+        m_readOffset = 0;
+        m_writeOffset = 0;
+        m_pendingFrameSize = 0;
+        m_pendingFrameReceivedTime = 0;
+        m_isHelloAnswered = false;
+        m_peerVersion = 0;
+        m_sequences.clear();
+        m_lostFrameCount = 0;
+        m_reorderedFrameCount = 0;
+        m_hasFailed = false;
+
+        std::lock_guard<std::mutex> lock{m_requestMutex};
+        m_acceptsRequests = false;
+        m_pendingRequests.clear();
+    }
+
+    std::vector<char> SimpleDataPacketProtocol::helloFrame()
+    {
+        auto frame = encodeFrame(kPortalFrameTypeHello, 0, nullptr, 0);
+
+        // The one frame whose version isn't about its own header
+        const auto version = htonl(kPortalFrameMaxVersion);
+        memcpy(frame.data(), &version, sizeof(version));
+
+        return frame;
+    }
+
+    std::vector<char> SimpleDataPacketProtocol::encodeFrame(const uint32_t type, const uint32_t tag,
+                                                            const char *payload, const std::size_t size)
+    {
+        PortalFrame header;
+        header.version = htonl(0);
+        header.type = htonl(type);
+        header.tag = htonl(tag);
+        header.payloadSize = htonl(static_cast<uint32_t>(size));
+
+        std::vector<char> frame(sizeof(header) + size);
+        memcpy(frame.data(), &header, sizeof(header));
+
+        if (size > 0)
+        {
+            memcpy(frame.data() + sizeof(header), payload, size);
+        }
+
+        return frame;
+    }
+
+    std::vector<char> SimpleDataPacketProtocol::encodeRequest(const uint32_t type, const char *payload,
+                                                              const std::size_t size, ResponseHandler onResponse)
+    {
+        uint32_t tag{0};
+        {
+            std::lock_guard<std::mutex> lock{m_requestMutex};
+
+            if (!m_acceptsRequests)
+            {
+                return {};
+            }
+
+            // Zero means untagged, so skip it when the counter wraps
+            tag = m_nextTag++;
+            if (m_nextTag == 0)
+            {
+                m_nextTag = 1;
+            }
+
+            if (m_pendingRequests.size() == kMaxPendingRequests)
+            {
+                m_pendingRequests.pop_front();
+            }
+
+            m_pendingRequests.push_back(PendingRequest{type, tag, std::move(onResponse)});
+        }
+
+        return encodeFrame(type, tag, payload, size);
+    }
+
+    bool SimpleDataPacketProtocol::dispatchResponse(const ProtocolPacket &packet)
     {
-        if (dataLength > 0)
+        ResponseHandler onResponse;
         {
-            // Add data recieved to the end of buffer.
-            m_buffer.insert(m_buffer.end(), data, data + dataLength);
+            std::lock_guard<std::mutex> lock{m_requestMutex};
+
+            // Media frames may carry tags too, only an answer of the
+            // request's own type counts
+            auto request = std::find_if(m_pendingRequests.begin(), m_pendingRequests.end(), [&](const PendingRequest &r) {
+                return (r.type == static_cast<uint32_t>(packet.type)) && (r.tag == static_cast<uint32_t>(packet.tag));
+            });
+
+            if (request == m_pendingRequests.end())
+            {
+                return false;
+            }
+
+            onResponse = std::move(request->onResponse);
+            m_pendingRequests.erase(request);
+        }
+
+        if (onResponse)
+        {
+            onResponse(packet);
         }
 
+        return true;
+    }
+
+    void SimpleDataPacketProtocol::reserve(const std::size_t size)
+    {
+        if (m_buffer && (m_readOffset == m_writeOffset) && (m_buffer.use_count() == 1))
+        {
+            // Everything has been parsed and no Packet points into the buffer,
+            // so start writing from the beginning again.
+            m_readOffset = 0;
+            m_writeOffset = 0;
+        }
+
+        if (m_buffer && (m_buffer->capacity() - m_writeOffset >= size))
+        {
+            return;
+        }
+
+        auto buffer = PacketBufferPool::shared().acquire(bufferedSize() + size);
+
+        if (m_buffer)
+        {
+            memcpy(buffer->data(), m_buffer->data() + m_readOffset, bufferedSize());
+        }
+
+        m_writeOffset = bufferedSize();
+        m_readOffset = 0;
+        m_buffer = buffer;
+    }
+
+    void SimpleDataPacketProtocol::padAfterFrame()
+    {
+        // The frame just parsed ends exactly where the next read would start,
+        // so zero the padding behind it and start the next read after that.
+        // PacketBuffer always has kPacketPadding bytes beyond its capacity.
+        memset(m_buffer->data() + m_writeOffset, 0, kPacketPadding);
+
+        m_writeOffset = std::min(m_writeOffset + kPacketPadding, m_buffer->capacity());
+        m_readOffset = m_writeOffset;
+    }
+
+    static uint64_t readBigEndian64(const char *data) noexcept
+    {
+        uint64_t value{0};
+        for (std::size_t i = 0; i < sizeof(value); ++i)
+        {
+            value = (value << 8) | static_cast<uint8_t>(data[i]);
+        }
+
+        return value;
+    }
+
+    static uint32_t readBigEndian32(const char *data) noexcept
+    {
+        uint32_t value;
+        memcpy(&value, data, sizeof(value));
+
+        return ntohl(value);
+    }
+
+    std::size_t SimpleDataPacketProtocol::parseFrame(ProtocolPacket &packet)
+    {
         // Ensure that the data inside the buffer is at least as big as the
-        // length variable (32 bit int) and then read it out
-        if (m_buffer.size() < sizeof(PortalFrame))
+        // frame header and then read it out
+        if (bufferedSize() < sizeof(PortalFrame))
         {
-            return -1;
+            return sizeof(PortalFrame);
         }
 
         // Read the portal frame out
         PortalFrame frame;
-        memcpy(&frame, &m_buffer[0], sizeof(PortalFrame));
-
-        uint32_t length = 0;
-        length = ntohl(length);
+        memcpy(&frame, m_buffer->data() + m_readOffset, sizeof(PortalFrame));
 
         frame.version = ntohl(frame.version);
         frame.type = ntohl(frame.type);
         frame.tag = ntohl(frame.tag);
         frame.payloadSize = ntohl(frame.payloadSize);
 
-        if (frame.payloadSize == 0)
+        // Until the device answers the hello the field isn't ours to read.
+        // After that, a version it didn't agree to means we have lost track
+        // of where frames start; guessing would only misread what follows.
+        if (m_isHelloAnswered && (frame.version > m_peerVersion))
         {
-            portal_log_stdout("Payload is empty!");
-            m_buffer.erase(m_buffer.begin(), m_buffer.begin() + sizeof(PortalFrame) + frame.payloadSize);
-            return -1;
+            portal_log_stderr("Frame of type %u has version %u, %u was agreed on; the stream is corrupt", frame.type,
+                              frame.version, m_peerVersion);
+            m_hasFailed = true;
+            return sizeof(PortalFrame);
+        }
+
+        const auto version = m_isHelloAnswered ? frame.version : 0;
+        const auto headerSize = portalFrameHeaderSize(version);
+        if (bufferedSize() < headerSize)
+        {
+            return headerSize;
         }
 
-        // Read payload size now
         // Check if we've got all the data for the packet
+        const std::size_t frameSize = headerSize + frame.payloadSize;
 
-        if (m_buffer.size() <= (sizeof(PortalFrame) + frame.payloadSize))
+        // Otherwise a single corrupt header would have us allocate up to
+        // 4 GB before any of the payload arrived
+        if (frameSize > PacketBufferPool::maxPooledCapacity())
         {
-            // We haven't got the data for the packet just yet, so wait for next time!
-            return -1;
+            portal_log_stderr("Frame of type %u claims %u bytes, the stream is corrupt", frame.type,
+                              frame.payloadSize);
+            m_hasFailed = true;
+            return headerSize;
         }
 
-        // Read length bytes as that is the packet
-        const auto first = m_buffer.begin() + sizeof(PortalFrame);
-        const auto last = m_buffer.begin() + sizeof(PortalFrame) + frame.payloadSize;
-        auto newVec = std::vector<char>(first, last);
+        if (bufferedSize() < frameSize)
+        {
+            return frameSize;
+        }
+
+        const auto isPadded = (bufferedSize() == frameSize);
+
+        // The payload is handed out as a view into the buffer, no copy is made
+        packet.packet = Packet(m_buffer, m_readOffset + headerSize, frame.payloadSize, isPadded);
+        packet.type = frame.type;
+        packet.tag = frame.tag;
+        packet.version = version;
 
-        auto strongDelegate = m_delegate.lock();
-        if (strongDelegate)
+        const auto extension = m_buffer->data() + m_readOffset + sizeof(PortalFrame);
+        if (packet.version >= kPortalFrameVersionCaptureTime)
         {
-            strongDelegate->simpleDataPacketProtocolDelegateDidProcessPacket(newVec, frame.type, frame.tag);
+            packet.timing.captured = readBigEndian64(extension);
         }
 
-        // Remove the data from buffer
-        m_buffer.erase(m_buffer.begin(), m_buffer.begin() + sizeof(PortalFrame) + frame.payloadSize);
+        if (packet.version >= kPortalFrameVersionSequence)
+        {
+            packet.sequence = readBigEndian64(extension + sizeof(uint64_t));
+            packet.flags = readBigEndian32(extension + 2 * sizeof(uint64_t));
+        }
+
+        m_readOffset += frameSize;
 
-        // Attempt to parse another packet
-        processData(nullptr, 0);
+        if (isPadded)
+        {
+            padAfterFrame();
+        }
 
         return 0;
     }
+
+    void SimpleDataPacketProtocol::trackSequence(ProtocolPacket &packet)
+    {
+        auto state = std::find_if(m_sequences.begin(), m_sequences.end(),
+                                  [&](const SequenceState &s) { return s.type == packet.type; });
+
+        if (state == m_sequences.end())
+        {
+            // Nothing to compare the first frame of a type against
+            m_sequences.push_back(SequenceState{packet.type, packet.sequence + 1});
+            return;
+        }
+
+        if (packet.sequence < state->next)
+        {
+            // Older than one already delivered; pass it on and let the
+            // receiver decide what a late frame is still good for
+            ++m_reorderedFrameCount;
+            return;
+        }
+
+        if (packet.sequence > state->next)
+        {
+            packet.lostBefore = packet.sequence - state->next;
+            m_lostFrameCount += packet.lostBefore;
+
+            portal_log_stderr("Lost %llu frames of type %d before frame %llu (%llu in total)",
+                              static_cast<unsigned long long>(packet.lostBefore), packet.type,
+                              static_cast<unsigned long long>(packet.sequence),
+                              static_cast<unsigned long long>(m_lostFrameCount));
+        }
+
+        state->next = packet.sequence + 1;
+    }
+
+    void SimpleDataPacketProtocol::acceptHello(const ProtocolPacket &packet)
+    {
+        if (m_isHelloAnswered)
+        {
+            return;
+        }
+
+        // Frames parsed from here on may have the agreed version's header
+        m_isHelloAnswered = true;
+        m_peerVersion = (packet.packet.size() >= sizeof(uint32_t)) ? readBigEndian32(packet.packet.data()) : 0;
+
+        if (m_peerVersion > kPortalFrameMaxVersion)
+        {
+            portal_log_stderr("Device wants to send version %u frames, we only read up to %u", m_peerVersion,
+                              kPortalFrameMaxVersion);
+            m_hasFailed = true;
+            return;
+        }
+
+        portal_log_stdout("Device sends version %u frames", m_peerVersion);
+
+        std::lock_guard<std::mutex> lock{m_requestMutex};
+        m_acceptsRequests = true;
+    }
+
+    char *SimpleDataPacketProtocol::prepareWrite(std::size_t &size)
+    {
+        if (m_pendingFrameSize > kPortalFrameMaxHeaderSize)
+        {
+            // Only read up to the end of the partially received frame
+            size = m_pendingFrameSize - bufferedSize();
+            reserve(size);
+        }
+        else
+        {
+            reserve(kMinWriteSize);
+            size = m_buffer->capacity() - m_writeOffset;
+        }
+
+        return m_buffer->data() + m_writeOffset;
+    }
+
+    int SimpleDataPacketProtocol::commitWrite(const std::size_t length, const uint64_t receivedTime)
+    {
+        if (m_hasFailed)
+        {
+            return -1;
+        }
+
+        const auto now = receivedTime ? receivedTime : monotonicNanoseconds();
+
+        if (bufferedSize() == 0)
+        {
+            m_pendingFrameReceivedTime = now;
+        }
+
+        m_writeOffset += length;
+
+        // Pull every complete frame out of the buffer in one pass
+        std::size_t missingFrameSize{0};
+        ProtocolPacket packet{};
+
+        while (!m_hasFailed && ((missingFrameSize = parseFrame(packet)) == 0))
+        {
+            packet.timing.received = m_pendingFrameReceivedTime;
+            packet.timing.parsed = monotonicNanoseconds();
+
+            // Whatever follows arrived with this read
+            m_pendingFrameReceivedTime = now;
+
+            if (packet.type == static_cast<int>(kPortalFrameTypeHello))
+            {
+                acceptHello(packet);
+                packet = ProtocolPacket{};
+                continue;
+            }
+
+            if (packet.version >= kPortalFrameVersionSequence)
+            {
+                trackSequence(packet);
+            }
+
+            // Answers to our requests may come without a payload
+            if ((packet.tag != 0) && dispatchResponse(packet))
+            {
+                packet = ProtocolPacket{};
+                continue;
+            }
+
+            if (packet.packet.empty())
+            {
+                portal_log_stdout("Payload is empty!");
+
+                // parseFrame() only sets what the frame's version carries, so
+                // nothing of this frame may leak into the next
+                packet = ProtocolPacket{};
+                continue;
+            }
+
+            m_parsedPackets.push_back(std::move(packet));
+            packet = ProtocolPacket{};
+        }
+
+        // Nothing past a broken header is read, so don't make room for it
+        m_pendingFrameSize = m_hasFailed ? 0 : missingFrameSize;
+
+        const auto packetCount = m_parsedPackets.size();
+        if (packetCount > 0)
+        {
+            auto strongDelegate = m_delegate.lock();
+            if (strongDelegate)
+            {
+                strongDelegate->simpleDataPacketProtocolDelegate_onProcessPackets(ProtocolPacketSpan(m_parsedPackets.data(), packetCount));
+            }
+
+            // Drop our references so the buffer can be recycled once the
+            // delegate is done with the packets.
+            m_parsedPackets.clear();
+        }
+
+        return (packetCount > 0) ? 0 : -1;
+    }
+
+    int SimpleDataPacketProtocol::processData(const char *data, const int dataLength)
+    {
+        // Copying path for callers that already hold the data in memory
+        const std::size_t totalLength = (dataLength > 0) ? dataLength : 0;
+        std::size_t offset{0};
+        int ret{-1};
+
+        do
+        {
+            std::size_t size{0};
+            const auto destination = prepareWrite(size);
+            const auto length = std::min(size, totalLength - offset);
+
+            if (length > 0)
+            {
+                memcpy(destination, data + offset, length);
+                offset += length;
+            }
+
+            if (commitWrite(length) == 0)
+            {
+                ret = 0;
+            }
+        } while ((offset < totalLength) && !m_hasFailed);
+
+        return ret;
+    }
 } // namespace portal
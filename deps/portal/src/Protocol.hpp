@@ -19,10 +19,16 @@ Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
 #ifndef PORTAL_SIMPLE_DATA_PACKET_PROTOCOL_H
 #define PORTAL_SIMPLE_DATA_PACKET_PROTOCOL_H
 
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
 #include <vector>
 #include <memory>
 
 #include "logging.hpp"
+#include "PacketBuffer.hpp"
 
 namespace portal
 {
@@ -46,9 +52,149 @@ namespace portal
 
     } PortalFrame;
 
+    // Frames with version 1 and up follow the PortalFrame header with the
+    // time the frame was captured, as big-endian nanoseconds on the device's
+    // own clock. payloadSize doesn't include it.
+    //
+    // Versions only mean this once the device has acknowledged the hello
+    // (see kPortalFrameTypeHello). Before that every frame has the plain
+    // header whatever its version field says, as PeerTalk based senders put
+    // their own protocol version (1) there.
+    constexpr uint32_t kPortalFrameVersionCaptureTime{1};
+
+    // Version 2 frames add, after the capture time, a big-endian 64-bit
+    // sequence number counting the frames of each type separately, then
+    // 32 bits of PortalFrameFlags and 32 reserved bits.
+    constexpr uint32_t kPortalFrameVersionSequence{2};
+
+    // Highest frame version this side understands
+    constexpr uint32_t kPortalFrameMaxVersion{kPortalFrameVersionSequence};
+
+    // What a version 2 frame says about its payload, so that it can be
+    // handled without parsing it.
+    enum PortalFrameFlags : uint32_t
+    {
+        // Decoding can (re)start at this frame
+        PortalFrameFlagKeyframe = 1 << 0,
+
+        // Codec configuration, such as H.264 parameter sets
+        PortalFrameFlagConfig = 1 << 1,
+
+        // Nothing else refers to this frame; it can be dropped safely
+        PortalFrameFlagDiscardable = 1 << 2
+    };
+
+    // Sent once when a connection opens. Its version field is the highest
+    // frame version we read. A device that knows this frame type answers
+    // with a hello of its own, with a plain header and a big-endian u32
+    // payload: the version of the frames it sends from then on, no higher
+    // than ours. Devices that don't know it ignore it, and their frames
+    // are read with the plain header.
+    constexpr uint32_t kPortalFrameTypeHello{100};
+
+    // Requests we send the device, once it has answered the hello. Each is
+    // answered with a frame of the same type and tag whose payload is a
+    // big-endian PortalRequestStatus. Devices that don't support requests
+    // never answer.
+
+    // Asks the encoder for a keyframe as soon as possible. No payload.
+    constexpr uint32_t kPortalFrameTypeKeyframeRequest{110};
+
+    // Asks the encoder to move by a number of quality steps, a big-endian
+    // int32; negative steps lower the bitrate or resolution. What a step is
+    // worth is up to the device.
+    constexpr uint32_t kPortalFrameTypeQualityRequest{111};
+
+    enum PortalRequestStatus : uint32_t
+    {
+        PortalRequestStatusOk = 0,
+        PortalRequestStatusUnsupported = 1,
+
+        // Already at the lowest or highest quality
+        PortalRequestStatusLimit = 2
+    };
+
+    // Bytes in front of the payload of a frame with the given version
+    constexpr std::size_t portalFrameHeaderSize(const uint32_t version) noexcept
+    {
+        return sizeof(PortalFrame) +
+               ((version >= kPortalFrameVersionCaptureTime) ? sizeof(uint64_t) : 0) +
+               ((version >= kPortalFrameVersionSequence) ? (sizeof(uint64_t) + 2 * sizeof(uint32_t)) : 0);
+    }
+
+    constexpr std::size_t kPortalFrameMaxHeaderSize{portalFrameHeaderSize(kPortalFrameMaxVersion)};
+
+    // Monotonic clock used to timestamp packets on their way through the
+    // plugin, in nanoseconds.
+    inline uint64_t monotonicNanoseconds() noexcept
+    {
+        const auto now = std::chrono::steady_clock::now().time_since_epoch();
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count());
+    }
+
+    struct PacketTiming final
+    {
+        // When the read carrying the first bytes of the frame returned
+        uint64_t received{0};
+
+        // When the last byte arrived and the frame was parsed
+        uint64_t parsed{0};
+
+        // When the device captured the frame, on the device's clock. Zero
+        // for frames older than kPortalFrameVersionCaptureTime.
+        uint64_t captured{0};
+    };
+
+    // A complete frame parsed out of the stream.
+    struct ProtocolPacket final
+    {
+        Packet packet;
+        int type;
+        int tag;
+        PacketTiming timing;
+
+        // Header version the frame was sent with
+        uint32_t version{0};
+
+        // Version 2 and up only, zero otherwise
+        uint64_t sequence{0};
+        uint32_t flags{0};
+
+        // Frames of the same type the sequence skipped right before this
+        // one, that is, lost on the device before they were sent
+        uint64_t lostBefore{0};
+    };
+
+    // A non-owning view of the frames parsed out of a single read. It is only
+    // valid for the duration of the delegate callback it is passed to; copy
+    // the Packets out of it to keep them.
+    class ProtocolPacketSpan final
+    {
+    public:
+        ProtocolPacketSpan(const ProtocolPacket *packets, const std::size_t count) noexcept
+            :
+            m_packets{packets},
+            m_count{count}
+        {
+        }
+
+        const ProtocolPacket *begin() const noexcept { return m_packets; }
+        const ProtocolPacket *end() const noexcept { return m_packets + m_count; }
+        const ProtocolPacket &operator[](const std::size_t i) const noexcept { return m_packets[i]; }
+        std::size_t size() const noexcept { return m_count; }
+        bool empty() const noexcept { return (m_count == 0); }
+
+    private:
+        const ProtocolPacket*   m_packets{nullptr};
+        std::size_t             m_count{0};
+    };
+
+    // Called with the frame answering a request
+    using ResponseHandler = std::function<void(const ProtocolPacket &response)>;
+
     struct SimpleDataPacketProtocolDelegate
     {
-        virtual void simpleDataPacketProtocolDelegate_onProcessPacket(std::vector<char> packet, const int type, const int tag) = 0;
+        virtual void simpleDataPacketProtocolDelegate_onProcessPackets(const ProtocolPacketSpan &packets) = 0;
         virtual ~SimpleDataPacketProtocolDelegate(){};
     };
 
@@ -63,14 +209,116 @@ namespace portal
         int processData(const char *data, const int dataLength);
         void reset();
 
+        // Zero-copy receive path. prepareWrite() returns where the next bytes
+        // read from the socket should go and how many may be written there;
+        // commitWrite() then parses whatever was written. While a frame is
+        // partially received the writable size is capped at the end of that
+        // frame, so large payloads end up followed by zeroed padding.
+        // receivedTime is when the read returned, as monotonicNanoseconds();
+        // zero means now.
+        char *prepareWrite(std::size_t &size);
+        int commitWrite(const std::size_t length, const uint64_t receivedTime = 0);
+
         void setDelegate(std::shared_ptr<SimpleDataPacketProtocolDelegate> delegate)
         {
             m_delegate = delegate;
         }
 
+        // The frame to send when the connection opens
+        static std::vector<char> helloFrame();
+
+        // A version 0 frame ready to send. A non-zero tag asks the receiver
+        // to answer with that tag.
+        static std::vector<char> encodeFrame(const uint32_t type, const uint32_t tag, const char *payload,
+                                             const std::size_t size);
+
+        // Like encodeFrame(), with a tag of its own. The frame of the same
+        // type and tag that answers it goes to onResponse, on the receiving
+        // thread, instead of the delegate. Requests that are never answered
+        // are forgotten once kMaxPendingRequests newer ones are waiting.
+        // Empty until the device has answered the hello, as devices that
+        // haven't may be sending their own tags. Safe on any thread.
+        std::vector<char> encodeRequest(const uint32_t type, const char *payload, const std::size_t size,
+                                        ResponseHandler onResponse);
+
+        // Read these on the receiving thread, such as from the delegate.
+        // Frame version the device agreed to in its answer to the hello,
+        // zero until then
+        uint32_t peerVersion() const noexcept { return m_peerVersion; }
+
+        // Sequence accounting over version 2 frames since the last reset()
+        uint64_t lostFrameCount() const noexcept { return m_lostFrameCount; }
+        uint64_t reorderedFrameCount() const noexcept { return m_reorderedFrameCount; }
+
+        // Set once the stream can't be parsed any further, e.g. after a
+        // frame header claiming an impossible size or a version that wasn't
+        // agreed on. The connection should be dropped.
+        bool hasFailed() const noexcept { return m_hasFailed; }
+
     private:
+        // Received bytes are appended to m_buffer at m_writeOffset and frames
+        // are parsed from m_readOffset. When the tail of the buffer runs out,
+        // the unparsed remainder (at most one partial frame) is moved to a
+        // buffer from the PacketBufferPool; buffers still referenced by
+        // outstanding Packets return to the pool when the last view goes away.
+        static constexpr std::size_t kMinWriteSize{1 << 16};
+
         std::weak_ptr<SimpleDataPacketProtocolDelegate> m_delegate{};
-        std::vector<char> m_buffer{};
+        std::shared_ptr<PacketBuffer> m_buffer{nullptr};
+        std::size_t m_readOffset{0};
+        std::size_t m_writeOffset{0};
+
+        // Size of the frame at m_readOffset once its header has been read
+        std::size_t m_pendingFrameSize{0};
+
+        // When the first bytes of the frame at m_readOffset were received
+        uint64_t m_pendingFrameReceivedTime{0};
+
+        bool m_hasFailed{false};
+
+        // Frames parsed out of the current read, reused between reads
+        std::vector<ProtocolPacket> m_parsedPackets{};
+
+        bool m_isHelloAnswered{false};
+        uint32_t m_peerVersion{0};
+
+        // The sequence number expected next, per frame type. There are only
+        // ever a couple of types, so a linear search is the fastest lookup.
+        struct SequenceState
+        {
+            int type;
+            uint64_t next;
+        };
+
+        std::vector<SequenceState> m_sequences{};
+        uint64_t m_lostFrameCount{0};
+        uint64_t m_reorderedFrameCount{0};
+
+        // Requests waiting for an answer, oldest first
+        static constexpr std::size_t kMaxPendingRequests{32};
+
+        struct PendingRequest
+        {
+            uint32_t type;
+            uint32_t tag;
+            ResponseHandler onResponse;
+        };
+
+        // Guards the requests, and whether they can be sent yet
+        std::mutex m_requestMutex{};
+        bool m_acceptsRequests{false};
+        std::deque<PendingRequest> m_pendingRequests{};
+        uint32_t m_nextTag{1};
+
+        // Utility functions
+
+        std::size_t bufferedSize() const noexcept { return m_writeOffset - m_readOffset; }
+        void reserve(const std::size_t size);
+        std::size_t parseFrame(ProtocolPacket &packet);
+        void trackSequence(ProtocolPacket &packet);
+        void acceptHello(const ProtocolPacket &packet);
+        bool dispatchResponse(const ProtocolPacket &packet);
+        void padAfterFrame();
     };
 } // namespace portal
 
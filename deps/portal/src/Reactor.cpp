@@ -0,0 +1,284 @@
+/*
+ portal
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
+#include "Reactor.hpp"
+#include "logging.hpp"
+
+namespace portal
+{
+#ifdef __linux__
+    Reactor *Reactor::shared()
+    {
+        // Leaked on purpose, the threads wait in epoll_wait until the process exits
+        static Reactor *reactor = []() -> Reactor * {
+            // hardware_concurrency() may not know, and returns 0
+            auto threadCount = std::clamp<std::size_t>(std::thread::hardware_concurrency(), 1, kDefaultThreadCount);
+
+            const auto value = std::getenv("PORTAL_REACTOR_THREADS");
+            if (value && *value)
+            {
+                threadCount = std::min<std::size_t>(std::strtoul(value, nullptr, 10), kMaxThreadCount);
+            }
+
+            if (threadCount == 0)
+            {
+                return nullptr;
+            }
+
+            auto reactor = new Reactor(threadCount);
+            if (reactor->m_loops.empty())
+            {
+                delete reactor;
+                return nullptr;
+            }
+
+            portal_log_stdout("Reading channels on %zu reactor thread(s)", reactor->m_loops.size());
+            return reactor;
+        }();
+
+        return reactor;
+    }
+
+    Reactor::Reactor(const std::size_t threadCount)
+    {
+        for (std::size_t i = 0; i < threadCount; ++i)
+        {
+            auto loop = std::make_unique<Loop>();
+            loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+            if (loop->epollFd < 0)
+            {
+                portal_log_stderr("Could not create a reactor thread: %s", std::strerror(errno));
+                break;
+            }
+
+            loop->thread = std::thread(&Reactor::run, this, loop.get());
+            m_loops.push_back(std::move(loop));
+        }
+    }
+
+    bool Reactor::add(const int fd, ReactorHandler *handler)
+    {
+        Loop *loop = nullptr;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            // The thread serving the fewest descriptors, so one busy device
+            // shares it with as few others as possible
+            std::size_t fewest{SIZE_MAX};
+            for (const auto &candidate : m_loops)
+            {
+                const auto count = static_cast<std::size_t>(
+                    std::count_if(m_assignments.begin(), m_assignments.end(),
+                                  [&](const auto &assignment) { return assignment.second == candidate.get(); }));
+
+                if (count < fewest)
+                {
+                    fewest = count;
+                    loop = candidate.get();
+                }
+            }
+
+            m_assignments[fd] = loop;
+        }
+
+        std::lock_guard<std::mutex> lock(loop->mutex);
+        loop->handlers[fd] = std::make_shared<Entry>(Entry{handler, false});
+
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = fd;
+
+        if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+        {
+            portal_log_stderr("Could not add descriptor %d to the reactor: %s", fd, std::strerror(errno));
+            removeLocked(loop, fd);
+            return false;
+        }
+
+        return true;
+    }
+
+    Reactor::Loop *Reactor::loopOf(const int fd)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const auto it = m_assignments.find(fd);
+        return (it != m_assignments.end()) ? it->second : nullptr;
+    }
+
+    void Reactor::remove(const int fd, ReactorHandler *handler)
+    {
+        const auto loop = loopOf(fd);
+        if (!loop)
+        {
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(loop->mutex);
+
+        const auto it = loop->handlers.find(fd);
+        if ((it == loop->handlers.end()) || (it->second->handler != handler))
+        {
+            return;
+        }
+
+        const auto entry = it->second;
+        removeLocked(loop, fd);
+
+        // On the loop's own thread the only handler running is the caller
+        if (loop->thread.get_id() != std::this_thread::get_id())
+        {
+            loop->idle.wait(lock, [&]() { return !entry->isRunning; });
+        }
+    }
+
+    void Reactor::watchWritable(const int fd, ReactorHandler *handler, const bool watch)
+    {
+        const auto loop = loopOf(fd);
+        if (!loop)
+        {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(loop->mutex);
+
+        const auto it = loop->handlers.find(fd);
+        if ((it == loop->handlers.end()) || (it->second->handler != handler))
+        {
+            return;
+        }
+
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP | (watch ? EPOLLOUT : 0u);
+        event.data.fd = fd;
+
+        if (epoll_ctl(loop->epollFd, EPOLL_CTL_MOD, fd, &event) < 0)
+        {
+            portal_log_stderr("Could not update descriptor %d in the reactor: %s", fd, std::strerror(errno));
+        }
+    }
+
+    void Reactor::removeLocked(Loop *loop, const int fd)
+    {
+        epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        loop->handlers.erase(fd);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const auto it = m_assignments.find(fd);
+        if ((it != m_assignments.end()) && (it->second == loop))
+        {
+            m_assignments.erase(it);
+        }
+    }
+
+    void Reactor::run(Loop *loop)
+    {
+        epoll_event events[kMaxEvents];
+
+        for (;;)
+        {
+            const auto count = epoll_wait(loop->epollFd, events, kMaxEvents, -1);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                portal_log_stderr("Reactor thread stopped: %s", std::strerror(errno));
+                return;
+            }
+
+            for (int i = 0; i < count; ++i)
+            {
+                const auto fd = events[i].data.fd;
+
+                std::shared_ptr<Entry> entry;
+                {
+                    // Look the handler up again, it may have been removed
+                    // since epoll_wait returned
+                    std::lock_guard<std::mutex> lock(loop->mutex);
+                    const auto it = loop->handlers.find(fd);
+                    if (it == loop->handlers.end())
+                    {
+                        continue;
+                    }
+
+                    entry = it->second;
+                    entry->isRunning = true;
+                }
+
+                // Anything other than room to write, including errors and
+                // hangups, is for the read to find out about
+                const auto flags = events[i].events;
+                auto keepsRunning = true;
+
+                if (flags & EPOLLOUT)
+                {
+                    keepsRunning = entry->handler->reactor_onWritable();
+                }
+
+                if (keepsRunning && (flags & ~static_cast<uint32_t>(EPOLLOUT)))
+                {
+                    keepsRunning = entry->handler->reactor_onReadable();
+                }
+
+                std::lock_guard<std::mutex> lock(loop->mutex);
+                entry->isRunning = false;
+                loop->idle.notify_all();
+
+                // Unless it was removed, or replaced, while running
+                const auto it = loop->handlers.find(fd);
+                if (!keepsRunning && (it != loop->handlers.end()) && (it->second == entry))
+                {
+                    removeLocked(loop, fd);
+                }
+            }
+        }
+    }
+#else
+    Reactor *Reactor::shared()
+    {
+        return nullptr;
+    }
+
+    bool Reactor::add(const int, ReactorHandler *)
+    {
+        return false;
+    }
+
+    void Reactor::remove(const int, ReactorHandler *)
+    {
+    }
+
+    void Reactor::watchWritable(const int, ReactorHandler *, const bool)
+    {
+    }
+#endif
+} // namespace portal
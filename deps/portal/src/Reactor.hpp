@@ -0,0 +1,111 @@
+/*
+ portal
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef PORTAL_REACTOR_H
+#define PORTAL_REACTOR_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace portal
+{
+    struct ReactorHandler
+    {
+        // Called on a reactor thread whenever the handler's descriptor is
+        // readable. Should read a bounded amount and return; returning false
+        // removes the handler.
+        virtual bool reactor_onReadable() = 0;
+
+        // Called the same way whenever the descriptor is writable, while
+        // the handler watches for that (see Reactor::watchWritable())
+        virtual bool reactor_onWritable() { return true; }
+
+        virtual ~ReactorHandler(){};
+    };
+
+    // Process-wide set of threads that wait on the sockets of every Channel
+    // at once, instead of each Channel running a thread of its own. Each
+    // descriptor is served by a single reactor thread, so everything a
+    // handler feeds (protocol parsing, the decoders' queues) keeps exactly
+    // one producer. Descriptors go to the thread serving the fewest.
+    //
+    // Handlers run without any of the reactor's locks held, so removing one
+    // only waits for that handler, never for the others on its thread.
+    //
+    // There is a thread per core, up to kDefaultThreadCount, so a few
+    // devices each get one. PORTAL_REACTOR_THREADS overrides that; 0
+    // disables the reactor and Channels fall back to their own threads.
+    class Reactor final
+    {
+    public:
+        // nullptr if the reactor is disabled or not supported on this platform
+        static Reactor *shared();
+
+        bool add(const int fd, ReactorHandler *handler);
+
+        // Once this returns the handler is not running and won't be called
+        // again. Safe to call more than once, and from the handler itself.
+        void remove(const int fd, ReactorHandler *handler);
+
+        // Whether the handler is also called when its descriptor can be
+        // written, e.g. while output is waiting for room in the socket
+        void watchWritable(const int fd, ReactorHandler *handler, const bool watch);
+
+    private:
+        static constexpr std::size_t kDefaultThreadCount{4};
+        static constexpr std::size_t kMaxThreadCount{64};
+        static constexpr int kMaxEvents{64};
+
+        struct Entry
+        {
+            ReactorHandler *handler{nullptr};
+            bool isRunning{false};
+        };
+
+        struct Loop
+        {
+            int epollFd{-1};
+            std::thread thread{};
+
+            // Guards the handlers and whether each is running. remove()
+            // waits on idle for a handler that is.
+            std::mutex mutex{};
+            std::condition_variable idle{};
+            std::unordered_map<int, std::shared_ptr<Entry>> handlers{};
+        };
+
+        explicit Reactor(const std::size_t threadCount);
+
+        void run(Loop *loop);
+        Loop *loopOf(const int fd);
+        void removeLocked(Loop *loop, const int fd);
+
+        std::vector<std::unique_ptr<Loop>> m_loops{};
+
+        // Which loop each descriptor was added to
+        std::mutex m_mutex{};
+        std::unordered_map<int, Loop *> m_assignments{};
+    };
+} // namespace portal
+
+#endif
@@ -0,0 +1,371 @@
+/*
+ portal
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "logging.hpp"
+#include "Protocol.hpp"
+#include "StreamCapture.hpp"
+
+namespace portal
+{
+    namespace
+    {
+        void appendLittleEndian(std::vector<char> &out, const uint64_t value, const std::size_t size)
+        {
+            for (std::size_t i{0}; i < size; ++i)
+            {
+                out.push_back(static_cast<char>((value >> (i * 8)) & 0xff));
+            }
+        }
+
+        uint64_t readLittleEndian(const char *data, const std::size_t size) noexcept
+        {
+            uint64_t value{0};
+            for (std::size_t i{0}; i < size; ++i)
+            {
+                value |= static_cast<uint64_t>(static_cast<uint8_t>(data[i])) << (i * 8);
+            }
+
+            return value;
+        }
+    }
+
+    std::shared_ptr<StreamCaptureWriter> StreamCaptureWriter::create(const std::string &path)
+    {
+        const auto file = std::fopen(path.c_str(), "wb");
+        if (!file)
+        {
+            portal_log_stderr("Could not create capture file %s", path.c_str());
+            return nullptr;
+        }
+
+        std::vector<char> header(kCaptureMagic, kCaptureMagic + sizeof(kCaptureMagic));
+        appendLittleEndian(header, kCaptureVersion, 4);
+        appendLittleEndian(header, 0, 4);
+        std::fwrite(header.data(), 1, header.size(), file);
+
+        return std::shared_ptr<StreamCaptureWriter>(new StreamCaptureWriter(file));
+    }
+
+    StreamCaptureWriter::StreamCaptureWriter(std::FILE *file)
+        :
+        m_file{file}
+    {
+        m_chunk.reserve(kChunkSize);
+        m_thread = std::thread(&StreamCaptureWriter::run, this);
+    }
+
+    StreamCaptureWriter::~StreamCaptureWriter()
+    {
+        {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            m_shouldStop = true;
+        }
+
+        m_cv.notify_one();
+        m_thread.join();
+
+        std::fclose(m_file);
+
+        if (m_droppedBytes > 0)
+        {
+            portal_log_stdout("Stream capture fell behind, the last %zu bytes were not captured",
+                              m_droppedBytes.load());
+        }
+    }
+
+    void StreamCaptureWriter::write(const char *data, const std::size_t length, const uint64_t receivedTime)
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+
+        // Once a read is missing the rest of the stream can't be parsed, so
+        // the file ends at the first one that didn't fit.
+        if (m_droppedBytes > 0)
+        {
+            m_droppedBytes += length;
+            return;
+        }
+
+        if (m_startTime == 0)
+        {
+            m_startTime = receivedTime;
+        }
+
+        if (!m_chunk.empty() && (m_chunk.size() + kCaptureRecordHeaderSize + length > kChunkSize))
+        {
+            if (m_queuedChunks.size() >= kMaxQueuedChunks)
+            {
+                m_droppedBytes += length;
+                return;
+            }
+
+            m_queuedChunks.push_back(std::move(m_chunk));
+            m_cv.notify_one();
+
+            if (m_freeChunks.empty())
+            {
+                m_chunk = std::vector<char>{};
+                m_chunk.reserve(kChunkSize);
+            }
+            else
+            {
+                m_chunk = std::move(m_freeChunks.back());
+                m_freeChunks.pop_back();
+            }
+        }
+
+        appendLittleEndian(m_chunk, receivedTime - m_startTime, 8);
+        appendLittleEndian(m_chunk, length, 4);
+        m_chunk.insert(m_chunk.end(), data, data + length);
+    }
+
+    void StreamCaptureWriter::run()
+    {
+        std::unique_lock<std::mutex> lock{m_mutex};
+
+        for (;;)
+        {
+            m_cv.wait_for(lock, std::chrono::seconds(1), [&]() { return m_shouldStop || !m_queuedChunks.empty(); });
+
+            // Write out a partial chunk when the stream goes quiet or stops
+            if (!m_chunk.empty() && (m_queuedChunks.empty() || m_shouldStop))
+            {
+                m_queuedChunks.push_back(std::move(m_chunk));
+                m_chunk = std::vector<char>{};
+                m_chunk.reserve(kChunkSize);
+            }
+
+            while (!m_queuedChunks.empty())
+            {
+                auto chunk = std::move(m_queuedChunks.front());
+                m_queuedChunks.pop_front();
+
+                lock.unlock();
+                std::fwrite(chunk.data(), 1, chunk.size(), m_file);
+                std::fflush(m_file);
+                lock.lock();
+
+                chunk.clear();
+                m_freeChunks.push_back(std::move(chunk));
+            }
+
+            if (m_shouldStop)
+            {
+                return;
+            }
+        }
+    }
+
+    MappedFile::~MappedFile()
+    {
+#ifdef WIN32
+        if (m_data)
+        {
+            UnmapViewOfFile(m_data);
+        }
+
+        if (m_mapping)
+        {
+            CloseHandle(m_mapping);
+        }
+
+        if (m_file)
+        {
+            CloseHandle(m_file);
+        }
+#else
+        if (m_data)
+        {
+            munmap(const_cast<char *>(m_data), m_size);
+        }
+#endif
+    }
+
+    bool MappedFile::open(const std::string &path)
+    {
+#ifdef WIN32
+        m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                             FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE)
+        {
+            m_file = nullptr;
+            return false;
+        }
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_file, &size) || (size.QuadPart == 0))
+        {
+            return false;
+        }
+
+        m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!m_mapping)
+        {
+            return false;
+        }
+
+        m_data = static_cast<const char *>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+        m_size = m_data ? static_cast<std::size_t>(size.QuadPart) : 0;
+#else
+        const auto fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat info;
+        if ((fstat(fd, &info) != 0) || (info.st_size == 0))
+        {
+            ::close(fd);
+            return false;
+        }
+
+        const auto mapping = mmap(nullptr, static_cast<std::size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+
+        if (mapping == MAP_FAILED)
+        {
+            return false;
+        }
+
+        // Replay reads front to back
+        madvise(mapping, static_cast<std::size_t>(info.st_size), MADV_SEQUENTIAL);
+
+        m_data = static_cast<const char *>(mapping);
+        m_size = static_cast<std::size_t>(info.st_size);
+#endif
+
+        return (m_data != nullptr);
+    }
+
+    bool ReplayChannelBackend::isCapture(const char *data, const std::size_t size) noexcept
+    {
+        return (size >= kCaptureHeaderSize) &&
+               (std::memcmp(data, kCaptureMagic, sizeof(kCaptureMagic)) == 0) &&
+               (readLittleEndian(data + sizeof(kCaptureMagic), 4) == kCaptureVersion);
+    }
+
+    std::unique_ptr<ReplayChannelBackend> ReplayChannelBackend::open(const std::string &path, const Pacing pacing)
+    {
+        std::unique_ptr<ReplayChannelBackend> backend{new ReplayChannelBackend(pacing)};
+
+        if (!backend->m_file.open(path) || !isCapture(backend->m_file.data(), backend->m_file.size()))
+        {
+            portal_log_stderr("%s is not a capture file", path.c_str());
+            return nullptr;
+        }
+
+        return backend;
+    }
+
+    bool ReplayChannelBackend::nextRecord()
+    {
+        const auto data = m_file.data();
+        const auto size = m_file.size();
+
+        while (m_offset + kCaptureRecordHeaderSize <= size)
+        {
+            const auto time = readLittleEndian(data + m_offset, 8);
+            const auto length = static_cast<std::size_t>(readLittleEndian(data + m_offset + 8, 4));
+
+            const auto start = m_offset + kCaptureRecordHeaderSize;
+            if (length > size - start)
+            {
+                // Truncated, e.g. the capture was cut short
+                return false;
+            }
+
+            m_offset = start + length;
+
+            if (length > 0)
+            {
+                m_record = data + start;
+                m_recordRemaining = length;
+                m_recordTime = time;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    int ReplayChannelBackend::receive(char *buffer, const std::size_t size, std::size_t &received)
+    {
+        received = 0;
+
+        if (m_closed)
+        {
+            return -1;
+        }
+
+        if (m_throttle)
+        {
+            m_throttle();
+        }
+
+        if ((m_recordRemaining == 0) && !nextRecord())
+        {
+            // End of the capture, as if the device had disconnected
+            return -1;
+        }
+
+        if (m_pacing == Pacing::Original)
+        {
+            auto now = monotonicNanoseconds();
+            if (m_replayStartTime == 0)
+            {
+                m_replayStartTime = now - m_recordTime;
+            }
+
+            // Wait at most as long as a device read would, so that closing
+            // the Channel isn't held up by a long gap in the capture
+            const auto due = m_replayStartTime + m_recordTime;
+            if (due > now)
+            {
+                std::this_thread::sleep_for(std::chrono::nanoseconds(std::min(due - now, kMaxWait)));
+
+                now = monotonicNanoseconds();
+                if (due > now)
+                {
+                    return 0;
+                }
+            }
+        }
+
+        const auto length = std::min(size, m_recordRemaining);
+        std::memcpy(buffer, m_record, length);
+
+        m_record += length;
+        m_recordRemaining -= length;
+        received = length;
+
+        return 0;
+    }
+} // namespace portal
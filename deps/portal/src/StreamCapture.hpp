@@ -0,0 +1,163 @@
+/*
+ portal
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef PORTAL_STREAM_CAPTURE_H
+#define PORTAL_STREAM_CAPTURE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ChannelBackend.hpp"
+
+namespace portal
+{
+    // Capture files record the bytes a Channel received, read by read:
+    //
+    //   file header:   char magic[8] = "PRTLCAP\0", u32 version (1), u32 reserved
+    //   each record:   u64 receive time (ns since the first record), u32 length,
+    //                  followed by length bytes
+    //
+    // All integers are little-endian.
+    constexpr char kCaptureMagic[8] = {'P', 'R', 'T', 'L', 'C', 'A', 'P', '\0'};
+    constexpr uint32_t kCaptureVersion{1};
+    constexpr std::size_t kCaptureHeaderSize{16};
+    constexpr std::size_t kCaptureRecordHeaderSize{12};
+
+    // Appends reads to a capture file. write() only copies into an in-memory
+    // chunk; full chunks are written to disk by a background thread, so the
+    // receiving thread never waits on the file system. If the disk can't
+    // keep up, reads are dropped (and counted) rather than queued forever.
+    class StreamCaptureWriter final
+    {
+    public:
+        // Returns nullptr if the file can't be created
+        static std::shared_ptr<StreamCaptureWriter> create(const std::string &path);
+
+        ~StreamCaptureWriter();
+
+        StreamCaptureWriter(const StreamCaptureWriter &other) = delete;
+        StreamCaptureWriter &operator=(const StreamCaptureWriter &other) = delete;
+
+        // receivedTime as monotonicNanoseconds()
+        void write(const char *data, const std::size_t length, const uint64_t receivedTime);
+
+        std::size_t droppedBytes() const noexcept { return m_droppedBytes.load(); }
+
+    private:
+        static constexpr std::size_t kChunkSize{1 << 20};
+        static constexpr std::size_t kMaxQueuedChunks{64};
+
+        explicit StreamCaptureWriter(std::FILE *file);
+
+        void run();
+
+        std::FILE*                      m_file{nullptr};
+        uint64_t                        m_startTime{0};
+
+        std::mutex                      m_mutex{};
+        std::condition_variable         m_cv{};
+        std::vector<char>               m_chunk{};
+        std::deque<std::vector<char>>   m_queuedChunks{};
+        std::vector<std::vector<char>>  m_freeChunks{};
+        bool                            m_shouldStop{false};
+        std::atomic<std::size_t>        m_droppedBytes{0};
+
+        std::thread                     m_thread{};
+    };
+
+    // A read-only memory mapping of a whole file
+    class MappedFile final
+    {
+    public:
+        MappedFile() = default;
+        ~MappedFile();
+
+        MappedFile(const MappedFile &other) = delete;
+        MappedFile &operator=(const MappedFile &other) = delete;
+
+        bool open(const std::string &path);
+
+        const char *data() const noexcept { return m_data; }
+        std::size_t size() const noexcept { return m_size; }
+
+    private:
+        const char*     m_data{nullptr};
+        std::size_t     m_size{0};
+
+#ifdef WIN32
+        void*           m_file{nullptr};
+        void*           m_mapping{nullptr};
+#endif
+    };
+
+    // Feeds a Channel from a capture file instead of a device.
+    class ReplayChannelBackend final : public ChannelBackend
+    {
+    public:
+        enum class Pacing
+        {
+            // Hand out each read no earlier than it originally arrived
+            Original,
+
+            // Hand out reads as fast as the Channel asks for them
+            MaxSpeed
+        };
+
+        // Returns nullptr if the file can't be mapped or isn't a capture
+        static std::unique_ptr<ReplayChannelBackend> open(const std::string &path, const Pacing pacing);
+
+        static bool isCapture(const char *data, const std::size_t size) noexcept;
+
+        int receive(char *buffer, const std::size_t size, std::size_t &received) override;
+        void close() override { m_closed = true; }
+
+        // Called before every read, e.g. to hold the replay back while the
+        // consumer catches up at max speed
+        void setThrottle(std::function<void()> throttle) { m_throttle = std::move(throttle); }
+
+    private:
+        static constexpr uint64_t kMaxWait{10000000}; // Like the usbmuxd receive timeout
+
+        ReplayChannelBackend(const Pacing pacing) : m_pacing{pacing} {}
+
+        bool nextRecord();
+
+        MappedFile              m_file{};
+        Pacing                  m_pacing{Pacing::Original};
+        std::function<void()>   m_throttle{};
+        std::atomic<bool>       m_closed{false};
+
+        std::size_t             m_offset{kCaptureHeaderSize};
+        const char*             m_record{nullptr};
+        std::size_t             m_recordRemaining{0};
+        uint64_t                m_recordTime{0};
+        uint64_t                m_replayStartTime{0};
+    };
+} // namespace portal
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#include <obs.h>
+#include <util/platform.h>
+
+#include "ClockRecovery.hpp"
+#include "Protocol.hpp"
+
+ClockRecovery::ClockRecovery() :
+    m_obsOffset(measureObsOffset())
+{
+}
+
+void ClockRecovery::update(const uint64_t deviceTime, const uint64_t hostTime)
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    const auto offset = static_cast<int64_t>(hostTime - deviceTime);
+
+    // Audio and video come from encoders with different latencies, so their
+    // capture times interleave slightly out of order. Only a step back
+    // further than that means the device clock was reset.
+    const auto isBackwardJump = (deviceTime + kMaxResidual < m_lastDeviceTime);
+
+    if (m_isValid && (isBackwardJump || (std::llabs(offset - offsetAt(deviceTime)) > kMaxResidual)))
+    {
+        blog(LOG_INFO, "Device clock jumped, resynchronizing");
+        resetLocked();
+    }
+
+    if (!m_isValid)
+    {
+        m_isValid = true;
+        m_origin = deviceTime;
+        m_offset = static_cast<double>(offset);
+        m_windowStart = deviceTime;
+        m_windowMinimum = Sample{deviceTime, offset};
+        m_lastDeviceTime = deviceTime;
+        return;
+    }
+
+    m_lastDeviceTime = std::max(m_lastDeviceTime, deviceTime);
+
+    if (offset < m_windowMinimum.offset)
+    {
+        m_windowMinimum = Sample{deviceTime, offset};
+    }
+
+    if (m_minimaCount == 0)
+    {
+        // Until the first window closes, follow the quickest frame so far
+        if (offset < offsetAt(deviceTime))
+        {
+            m_origin = deviceTime;
+            m_offset = static_cast<double>(offset);
+        }
+    }
+
+    if (deviceTime >= m_windowStart + kWindowDuration)
+    {
+        m_minima[m_nextMinimum] = m_windowMinimum;
+        m_nextMinimum = (m_nextMinimum + 1) % kWindowCount;
+        m_minimaCount = std::min(m_minimaCount + 1, kWindowCount);
+
+        fit();
+
+        m_windowStart = deviceTime;
+        m_windowMinimum = Sample{deviceTime, offset};
+    }
+}
+
+uint64_t ClockRecovery::toHostTime(const uint64_t deviceTime) const
+{
+    int64_t offset{0};
+
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        if (!m_isValid)
+        {
+            return 0;
+        }
+
+        offset = offsetAt(deviceTime);
+
+        // Offsets are measured against portal's clock, OBS wants its own
+        offset += m_obsOffset;
+    }
+
+    return deviceTime + static_cast<uint64_t>(offset);
+}
+
+uint64_t ClockRecovery::toObsTime(const uint64_t hostTime) const
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+    return hostTime + static_cast<uint64_t>(m_obsOffset);
+}
+
+void ClockRecovery::reset()
+{
+    const auto obsOffset = measureObsOffset();
+
+    std::lock_guard<std::mutex> lock{m_mutex};
+    resetLocked();
+    m_obsOffset = obsOffset;
+}
+
+int64_t ClockRecovery::measureObsOffset()
+{
+    int64_t obsOffset{0};
+    uint64_t closest{UINT64_MAX};
+
+    for (int i = 0; i < kObsOffsetReads; ++i)
+    {
+        const auto before = portal::monotonicNanoseconds();
+        const auto obsTime = os_gettime_ns();
+        const auto after = portal::monotonicNanoseconds();
+
+        // The pair read closest together was the least disturbed
+        if (after - before < closest)
+        {
+            closest = after - before;
+            obsOffset = static_cast<int64_t>(obsTime - (before + closest / 2));
+        }
+    }
+
+    return obsOffset;
+}
+
+void ClockRecovery::setObsOffset(const int64_t obsOffset)
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_obsOffset = obsOffset;
+}
+
+int64_t ClockRecovery::offsetAt(const uint64_t deviceTime) const noexcept
+{
+    const auto elapsed = static_cast<double>(static_cast<int64_t>(deviceTime - m_origin));
+    return std::llround(m_offset + m_skew * elapsed);
+}
+
+void ClockRecovery::fit() noexcept
+{
+    // Least squares over the window minima, relative to the newest one to
+    // keep the numbers small
+    const auto &newest = m_minima[(m_nextMinimum + kWindowCount - 1) % kWindowCount];
+
+    double meanX{0.0};
+    double meanY{0.0};
+    for (std::size_t i = 0; i < m_minimaCount; ++i)
+    {
+        meanX += static_cast<double>(static_cast<int64_t>(m_minima[i].deviceTime - newest.deviceTime));
+        meanY += static_cast<double>(m_minima[i].offset - newest.offset);
+    }
+    meanX /= static_cast<double>(m_minimaCount);
+    meanY /= static_cast<double>(m_minimaCount);
+
+    double covariance{0.0};
+    double variance{0.0};
+    for (std::size_t i = 0; i < m_minimaCount; ++i)
+    {
+        const auto x = static_cast<double>(static_cast<int64_t>(m_minima[i].deviceTime - newest.deviceTime)) - meanX;
+        const auto y = static_cast<double>(m_minima[i].offset - newest.offset) - meanY;
+        covariance += x * y;
+        variance += x * x;
+    }
+
+    const auto skew = (variance > 0.0) ? std::clamp(covariance / variance, -kMaxSkew, kMaxSkew) : 0.0;
+
+    m_origin = newest.deviceTime;
+    m_offset = static_cast<double>(newest.offset) + (meanY - skew * meanX);
+    m_skew = skew;
+}
+
+void ClockRecovery::resetLocked() noexcept
+{
+    m_isValid = false;
+    m_lastDeviceTime = 0;
+    m_windowStart = 0;
+    m_windowMinimum = Sample{};
+    m_minimaCount = 0;
+    m_nextMinimum = 0;
+    m_origin = 0;
+    m_offset = 0.0;
+    m_skew = 0.0;
+}
@@ -0,0 +1,114 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#ifndef ClockRecovery_hpp
+#define ClockRecovery_hpp
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+// Maps capture times from the device's clock onto the host's, so frames can
+// be timestamped by when they were captured rather than by when they came
+// out of the decoder.
+//
+// The offset between the clocks is measured on every frame that arrives, and
+// the smallest offset within each half second window, i.e. the frame that
+// had the quickest trip over USB, is taken as a sample. A line fitted
+// through the last few samples follows the drift between the two clocks
+// while ignoring queueing and transfer delays.
+//
+// Host times are converted from portal's clock to OBS's with an offset
+// measured once per connection, so preemption between reading the two
+// clocks can't add jitter to every timestamp.
+class ClockRecovery final
+{
+public:
+    ClockRecovery();
+    ~ClockRecovery() = default;
+
+    ClockRecovery(const ClockRecovery &other) = delete;
+    ClockRecovery &operator=(const ClockRecovery &other) = delete;
+
+    // deviceTime is a frame's capture time on the device's clock, hostTime
+    // when it started to arrive, in portal::monotonicNanoseconds()
+    void update(const uint64_t deviceTime, const uint64_t hostTime);
+
+    // When something captured at deviceTime happened, in os_gettime_ns().
+    // Zero until the first update().
+    uint64_t toHostTime(const uint64_t deviceTime) const;
+
+    // Converts hostTime from portal::monotonicNanoseconds() to os_gettime_ns()
+    uint64_t toObsTime(const uint64_t hostTime) const;
+
+    // Forget the device clock and measure the host clocks' offset again,
+    // e.g. after reconnecting
+    void reset();
+
+    // os_gettime_ns() - portal::monotonicNanoseconds(), from the closest
+    // together of a few paired reads
+    static int64_t measureObsOffset();
+
+    // Replaces the measured offset, for simulations on a known clock
+    void setObsOffset(const int64_t obsOffset);
+
+private:
+    static constexpr uint64_t kWindowDuration{500000000};
+    static constexpr std::size_t kWindowCount{16};
+
+    // Clocks disagreeing by more than this means the device clock jumped
+    static constexpr int64_t kMaxResidual{500000000};
+
+    // Anything past this is a bad fit rather than a real crystal
+    static constexpr double kMaxSkew{0.001};
+
+    static constexpr int kObsOffsetReads{8};
+
+    struct Sample
+    {
+        uint64_t deviceTime{0};
+        int64_t offset{0};      // hostTime - deviceTime
+    };
+
+    int64_t offsetAt(const uint64_t deviceTime) const noexcept;
+    void fit() noexcept;
+    void resetLocked() noexcept;
+
+    mutable std::mutex                  m_mutex{};
+    bool                                m_isValid{false};
+    uint64_t                            m_lastDeviceTime{0};    // Newest capture time seen
+    int64_t                             m_obsOffset{0};         // OBS's clock - portal's
+
+    // Smallest offset in the current window
+    uint64_t                            m_windowStart{0};
+    Sample                              m_windowMinimum{};
+
+    // Minima of the last kWindowCount windows, oldest overwritten first
+    std::array<Sample, kWindowCount>    m_minima{};
+    std::size_t                         m_minimaCount{0};
+    std::size_t                         m_nextMinimum{0};
+
+    // offset(t) = m_offset + m_skew * (t - m_origin)
+    uint64_t                            m_origin{0};
+    double                              m_offset{0.0};
+    double                              m_skew{0.0};
+};
+
+#endif /* ClockRecovery_hpp */
@@ -0,0 +1,213 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+
+#include <algorithm>
+#include <cstdio>
+
+#include <obs.h>
+
+#include "DecodeGovernor.hpp"
+#include "Protocol.hpp"
+
+static const char *levelName(const DecodeLevel level)
+{
+    switch (level)
+    {
+    case DecodeLevel::Full:
+        return "full quality";
+    case DecodeLevel::NoLoopFilter:
+        return "no loop filter on non-reference pictures";
+    case DecodeLevel::SkipNonReference:
+        return "skipping non-reference pictures";
+    case DecodeLevel::KeyframesOnly:
+        return "keyframes only";
+    }
+
+    return "";
+}
+
+void DecodeGovernor::recordPicture()
+{
+    const auto now = portal::monotonicNanoseconds();
+    if (!m_windowStart)
+    {
+        m_windowStart = now;
+    }
+
+    ++m_windowPictures;
+
+    if (now - m_windowStart >= kWindowDuration)
+    {
+        evaluate(now);
+    }
+}
+
+void DecodeGovernor::recordDecode(const uint64_t cost)
+{
+    m_windowCost += cost;
+    ++m_windowDecoded;
+}
+
+void DecodeGovernor::reportBacklog()
+{
+    const auto now = portal::monotonicNanoseconds();
+    const auto level = m_level.load();
+
+    if ((level != DecodeLevel::KeyframesOnly) && (now - m_levelChanged >= kMinLevelDuration))
+    {
+        setLevel(static_cast<DecodeLevel>(static_cast<int>(level) + 1), now, "the decoding queue backed up");
+    }
+}
+
+bool DecodeGovernor::shouldDecode(const H264FrameType frameType) const noexcept
+{
+    switch (m_level.load())
+    {
+    case DecodeLevel::SkipNonReference:
+        return (frameType != H264FrameType::NonReference);
+
+    case DecodeLevel::KeyframesOnly:
+        return (frameType != H264FrameType::Reference) && (frameType != H264FrameType::NonReference);
+
+    default:
+        return true;
+    }
+}
+
+void DecodeGovernor::reset()
+{
+    m_windowStart = 0;
+    m_windowCost = 0;
+    m_windowPictures = 0;
+    m_windowDecoded = 0;
+    m_recoveryWindows = 0;
+    m_probeWindows = kRecoveryWindows;
+    m_isProbing = false;
+
+    if (m_level.load() != DecodeLevel::Full)
+    {
+        setLevel(DecodeLevel::Full, portal::monotonicNanoseconds(), "new stream");
+    }
+}
+
+std::string DecodeGovernor::reason() const
+{
+    std::lock_guard<std::mutex> lock{m_reasonMutex};
+    return m_reason;
+}
+
+void DecodeGovernor::evaluate(const uint64_t now)
+{
+    if (now - m_windowStart >= 2 * kWindowDuration)
+    {
+        // Decoding was paused or starved; the window says nothing
+        m_windowStart = now;
+        m_windowCost = 0;
+        m_windowPictures = 0;
+        m_windowDecoded = 0;
+        return;
+    }
+
+    const auto elapsed = static_cast<double>(now - m_windowStart);
+    const auto load = static_cast<double>(m_windowCost) / elapsed;
+
+    // Per decoded picture, and between pictures arriving
+    const auto cost = m_windowDecoded ? (static_cast<double>(m_windowCost) / m_windowDecoded) : 0.0;
+    const auto interval = elapsed / m_windowPictures;
+
+    // What the level above would take: every picture now skipped decoded
+    // at the average cost of the ones that weren't, or the loop filter back
+    // on. Priced at keyframe cost that says nothing, so from keyframes only
+    // the level above is tried once the current one leaves enough room.
+    const auto level = m_level.load();
+    auto nextLoad = load;
+    if (level == DecodeLevel::NoLoopFilter)
+    {
+        nextLoad *= kLoopFilterCost;
+    }
+    else if ((level == DecodeLevel::SkipNonReference) && m_windowDecoded)
+    {
+        nextLoad *= static_cast<double>(m_windowPictures) / m_windowDecoded;
+    }
+
+    // Held long enough to count as fitting
+    if (m_isProbing && (now - m_levelChanged >= kProbeDuration))
+    {
+        m_isProbing = false;
+        m_probeWindows = kRecoveryWindows;
+    }
+
+    m_windowStart = now;
+    m_windowCost = 0;
+    m_windowPictures = 0;
+    m_windowDecoded = 0;
+
+    const auto canChange = (now - m_levelChanged >= kMinLevelDuration);
+
+    char reason[160];
+    if (load > kMaxLoad)
+    {
+        m_recoveryWindows = 0;
+
+        if (canChange && (level != DecodeLevel::KeyframesOnly))
+        {
+            snprintf(reason, sizeof(reason), "decoding took %.0f%% of the time (%.1f ms per picture, %.1f ms apart)",
+                     load * 100.0, cost / 1000000.0, interval / 1000000.0);
+            setLevel(static_cast<DecodeLevel>(static_cast<int>(level) + 1), now, reason);
+        }
+
+        return;
+    }
+
+    if ((level == DecodeLevel::Full) || (nextLoad >= kRecoveryLoad))
+    {
+        m_recoveryWindows = 0;
+        return;
+    }
+
+    const auto isProbe = (level == DecodeLevel::KeyframesOnly);
+    if ((++m_recoveryWindows >= (isProbe ? m_probeWindows : kRecoveryWindows)) && canChange)
+    {
+        snprintf(reason, sizeof(reason), isProbe ? "trying it, decoding took %.0f%% of the time"
+                                                 : "headroom returned, decoding took %.0f%% of the time",
+                 load * 100.0);
+        setLevel(static_cast<DecodeLevel>(static_cast<int>(level) - 1), now, reason);
+        m_recoveryWindows = 0;
+        m_isProbing = isProbe;
+    }
+}
+
+void DecodeGovernor::setLevel(const DecodeLevel level, const uint64_t now, std::string reason)
+{
+    // Back to keyframes only from a level being tried, which didn't fit
+    if (m_isProbing && (level == DecodeLevel::KeyframesOnly))
+    {
+        m_isProbing = false;
+        m_probeWindows = std::min(m_probeWindows * 2, kMaxProbeWindows);
+    }
+
+    blog(LOG_INFO, "Video decoding at %s: %s", levelName(level), reason.c_str());
+
+    m_level = level;
+    m_levelChanged = now;
+
+    std::lock_guard<std::mutex> lock{m_reasonMutex};
+    m_reason = std::move(reason);
+}
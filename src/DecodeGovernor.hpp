@@ -0,0 +1,130 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+
+#ifndef DecodeGovernor_hpp
+#define DecodeGovernor_hpp
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include "H264Parser.hpp"
+
+// How much of the stream is decoded, from everything down to keyframes only
+enum class DecodeLevel
+{
+    Full,
+
+    // Skip the deblocking filter on pictures nothing predicts from
+    NoLoopFilter,
+
+    // Don't decode pictures nothing predicts from
+    SkipNonReference,
+
+    // Only decode keyframes
+    KeyframesOnly
+};
+
+// Keeps video decoding within the CPU it gets. Decode time is measured
+// against the time between pictures over one second windows; when decoding
+// takes up too much of it, or the queue backs up, the level goes down a
+// step. Once the previous level is expected to fit comfortably again for a
+// few windows in a row, it goes back up.
+//
+// Keyframes cost far more than the pictures between them, so from keyframes
+// only there is nothing to tell what the level above would take. Once
+// decoding is idle enough for long enough, that level is tried instead, and
+// each time it doesn't hold, the next try waits twice as long.
+//
+// Everything but level() and reason() is called by the decoding strand.
+class DecodeGovernor final
+{
+public:
+    DecodeGovernor() = default;
+    ~DecodeGovernor() = default;
+
+    DecodeGovernor(const DecodeGovernor &other) = delete;
+    DecodeGovernor &operator=(const DecodeGovernor &other) = delete;
+
+    // Every picture taken off the queue, decoded or not
+    void recordPicture();
+
+    // Time spent decoding one picture
+    void recordDecode(const uint64_t cost);
+
+    // The decoding queue overflowed or had to be trimmed
+    void reportBacklog();
+
+    // Whether a packet of this type is decoded at the current level
+    bool shouldDecode(const H264FrameType frameType) const noexcept;
+
+    // Back to full quality, e.g. for a new stream
+    void reset();
+
+    // Safe to call from any thread
+    DecodeLevel level() const noexcept { return m_level.load(); }
+    std::string reason() const;
+
+private:
+    static constexpr uint64_t kWindowDuration{1000000000};
+
+    // Time between two level changes, so each one can take effect
+    static constexpr uint64_t kMinLevelDuration{2000000000};
+
+    // Share of real time spent decoding above which the level goes down
+    static constexpr double kMaxLoad{0.85};
+
+    // Share of real time the previous level may be expected to take for
+    // the level to go back up, and for how many windows in a row
+    static constexpr double kRecoveryLoad{0.6};
+    static constexpr int kRecoveryWindows{3};
+
+    // About how much more a picture costs with the loop filter
+    static constexpr double kLoopFilterCost{1.25};
+
+    // How long a level tried from keyframes only has to hold, and the most
+    // windows to wait between tries
+    static constexpr uint64_t kProbeDuration{5000000000};
+    static constexpr int kMaxProbeWindows{120};
+
+    void evaluate(const uint64_t now);
+    void setLevel(const DecodeLevel level, const uint64_t now, std::string reason);
+
+    std::atomic<DecodeLevel>    m_level{DecodeLevel::Full};
+
+    mutable std::mutex          m_reasonMutex{};
+    std::string                 m_reason{};
+
+    uint64_t                    m_windowStart{0};
+    uint64_t                    m_windowCost{0};
+    std::size_t                 m_windowPictures{0};
+    std::size_t                 m_windowDecoded{0};
+    uint64_t                    m_levelChanged{0};
+    int                         m_recoveryWindows{0};
+
+    // Windows to wait before trying the level above keyframes only, and
+    // whether that is being tried now
+    int                         m_probeWindows{kRecoveryWindows};
+    bool                        m_isProbing{false};
+};
+
+#endif /* DecodeGovernor_hpp */
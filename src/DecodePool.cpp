@@ -0,0 +1,286 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#include <algorithm>
+#include <cstdlib>
+
+#include <obs.h>
+
+#include "DecodePool.hpp"
+
+// Index of the pool worker running on this thread
+static thread_local std::size_t t_workerIndex{~std::size_t{0}};
+
+void DecodeStrand::schedule()
+{
+    auto state = m_state.load();
+
+    for (;;)
+    {
+        if (state == Idle)
+        {
+            if (m_state.compare_exchange_weak(state, Scheduled))
+            {
+                DecodePool::shared().submit(this);
+                return;
+            }
+        }
+        else if (state == Running)
+        {
+            // The worker queues it again once the current slice is done
+            if (m_state.compare_exchange_weak(state, RunningAndScheduled))
+            {
+                return;
+            }
+        }
+        else
+        {
+            return;
+        }
+    }
+}
+
+void DecodeStrand::stop()
+{
+    std::unique_lock<std::mutex> lock{m_mutex};
+    m_stopping = true;
+
+    // A queued strand is taken off the pool by its worker, which finds it
+    // stopping and leaves it idle.
+    m_idleCv.wait(lock, [&]() {
+        auto state = m_state.load();
+        return (state == Stopped) || ((state == Idle) && m_state.compare_exchange_strong(state, Stopped));
+    });
+}
+
+void DecodeStrand::start()
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_stopping = false;
+
+    auto state = m_state.load();
+    if (state == Stopped)
+    {
+        m_state.compare_exchange_strong(state, Idle);
+    }
+}
+
+void DecodeStrand::run(const std::size_t budget)
+{
+    m_state.store(Running);
+
+    bool hasMoreWork{false};
+
+    {
+        std::unique_lock<std::mutex> lock{m_mutex};
+        const auto stopping = m_stopping;
+        lock.unlock();
+
+        if (!stopping)
+        {
+            hasMoreWork = m_task->decodeTask_run(budget);
+        }
+    }
+
+    // Once this lock is released the strand may be stopped and destroyed,
+    // so nothing may touch it afterwards.
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    if (m_stopping)
+    {
+        m_state.store(Idle);
+        m_idleCv.notify_all();
+        return;
+    }
+
+    auto state = m_state.load();
+    if (!hasMoreWork && (state == Running) && m_state.compare_exchange_strong(state, Idle))
+    {
+        return;
+    }
+
+    // Back of the queue, behind whatever else was scheduled meanwhile
+    m_state.store(Scheduled);
+    DecodePool::shared().submit(this);
+}
+
+DecodePool &DecodePool::shared()
+{
+    // Leaked, the workers are only joined by shutdown()
+    static auto pool = new DecodePool();
+    return *pool;
+}
+
+DecodePool::DecodePool()
+{
+    std::size_t threadCount = std::max(std::thread::hardware_concurrency(), 2u);
+
+    const auto value = std::getenv("IOS_CAMERA_DECODE_THREADS");
+    if (value && *value)
+    {
+        threadCount = std::max<std::size_t>(std::strtoul(value, nullptr, 10), 1);
+    }
+
+    threadCount = std::min(threadCount, kMaxThreadCount);
+
+    for (std::size_t i{0}; i < threadCount; ++i)
+    {
+        m_workers.push_back(std::make_unique<Worker>());
+    }
+
+    for (std::size_t i{0}; i < threadCount; ++i)
+    {
+        m_workers[i]->thread = std::thread(&DecodePool::run, this, i);
+    }
+
+    blog(LOG_INFO, "Decoding on %zu shared threads", threadCount);
+}
+
+void DecodePool::shutdown()
+{
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        m_shouldStop = true;
+        m_cv.notify_all();
+    }
+
+    for (auto &worker : m_workers)
+    {
+        if (worker->thread.joinable())
+        {
+            worker->thread.join();
+        }
+    }
+}
+
+void DecodePool::submit(DecodeStrand *strand)
+{
+    auto index = t_workerIndex;
+    if (index >= m_workers.size())
+    {
+        index = strand->m_homeWorker.load();
+        if (index >= m_workers.size())
+        {
+            // Spread strands over the workers as they first get work
+            index = m_nextWorker++ % m_workers.size();
+            strand->m_homeWorker = index;
+        }
+    }
+
+    auto &worker = *m_workers[index];
+
+    {
+        std::lock_guard<std::mutex> lock{worker.mutex};
+        worker.strands[static_cast<std::size_t>(strand->priority())].push_back(strand);
+    }
+
+    // Pairs with a worker announcing it's going to sleep before checking
+    // m_pendingCount a last time
+    m_pendingCount.fetch_add(1);
+
+    if (m_sleepingCount.load() > 0)
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        m_cv.notify_one();
+    }
+}
+
+DecodeStrand *DecodePool::takeFrom(Worker &worker, const std::size_t priority, const bool own)
+{
+    std::lock_guard<std::mutex> lock{worker.mutex};
+
+    auto &strands = worker.strands[priority];
+    if (strands.empty())
+    {
+        return nullptr;
+    }
+
+    // A worker serves its own queue in order; thieves take from the other
+    // end, where the most recently queued work is
+    DecodeStrand *strand{nullptr};
+    if (own)
+    {
+        strand = strands.front();
+        strands.pop_front();
+    }
+    else
+    {
+        strand = strands.back();
+        strands.pop_back();
+    }
+
+    m_pendingCount.fetch_sub(1);
+    return strand;
+}
+
+DecodeStrand *DecodePool::take(const std::size_t index)
+{
+    const auto count = m_workers.size();
+    auto &worker = *m_workers[index];
+
+    constexpr auto normal = static_cast<std::size_t>(DecodePriority::Normal);
+    constexpr auto high = static_cast<std::size_t>(DecodePriority::High);
+
+    // Normal strands get every kHighPriorityWeight + 1th slice
+    const auto isNormalsTurn = (worker.highStreak >= kHighPriorityWeight);
+    const std::size_t priorities[2]{isNormalsTurn ? normal : high, isNormalsTurn ? high : normal};
+
+    for (const auto priority : priorities)
+    {
+        auto strand = takeFrom(worker, priority, true);
+
+        for (std::size_t i{1}; !strand && (i < count); ++i)
+        {
+            strand = takeFrom(*m_workers[(index + i) % count], priority, false);
+        }
+
+        if (strand)
+        {
+            worker.highStreak = (priority == high) ? (worker.highStreak + 1) : 0;
+            return strand;
+        }
+    }
+
+    return nullptr;
+}
+
+void DecodePool::run(const std::size_t index)
+{
+    t_workerIndex = index;
+
+    for (;;)
+    {
+        auto strand = take(index);
+        if (strand)
+        {
+            strand->run(kSliceBudget);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock{m_mutex};
+        m_sleepingCount.fetch_add(1);
+        m_cv.wait(lock, [&]() { return m_shouldStop || (m_pendingCount.load() > 0); });
+        m_sleepingCount.fetch_sub(1);
+
+        if (m_shouldStop)
+        {
+            return;
+        }
+    }
+}
@@ -0,0 +1,159 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#ifndef DecodePool_hpp
+#define DecodePool_hpp
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+enum class DecodePriority
+{
+    Normal,
+    High        // e.g. a source that is live in the program scene
+};
+
+// Work a DecodeStrand runs on the pool
+struct DecodeTask
+{
+    // Decodes at most budget packets and returns whether more are waiting.
+    // Never called concurrently for the same task.
+    virtual bool decodeTask_run(const std::size_t budget) = 0;
+    virtual ~DecodeTask() {}
+};
+
+// Runs a DecodeTask on the shared DecodePool, one slice at a time and never
+// on two threads at once, so the task sees its packets in order without
+// owning a thread. Producers call schedule() after queueing work.
+class DecodeStrand final
+{
+public:
+    explicit DecodeStrand(DecodeTask *task) : m_task{task} {}
+    ~DecodeStrand() { stop(); }
+
+    DecodeStrand(const DecodeStrand &other) = delete;
+    DecodeStrand &operator=(const DecodeStrand &other) = delete;
+
+    // Makes sure the task runs soon. Cheap when it is already scheduled or
+    // running, safe to call from any thread.
+    void schedule();
+
+    // Waits for a slice in progress and keeps the task from running again
+    // until start(). Must not be called from the task itself.
+    void stop();
+    void start();
+
+    void setPriority(const DecodePriority priority) noexcept { m_priority = priority; }
+    DecodePriority priority() const noexcept { return m_priority.load(); }
+
+private:
+    friend class DecodePool;
+
+    enum State
+    {
+        Idle,
+        Scheduled,
+        Running,
+        RunningAndScheduled,    // Scheduled again while running
+        Stopped
+    };
+
+    void run(const std::size_t budget);
+
+    DecodeTask*                 m_task{nullptr};
+    std::atomic<int>            m_state{Idle};
+    std::atomic<DecodePriority> m_priority{DecodePriority::Normal};
+
+    // Worker whose queue the strand goes to when scheduled from outside the
+    // pool, so it tends to stay on one core
+    std::atomic<std::size_t>    m_homeWorker{kNoWorker};
+
+    // Held by a worker while it decides what happens after a slice, which
+    // is what lets stop() wait for the strand to settle
+    std::mutex                  m_mutex{};
+    std::condition_variable     m_idleCv{};
+    bool                        m_stopping{false};
+
+    static constexpr std::size_t kNoWorker{~std::size_t{0}};
+};
+
+// Process-wide pool of decoding threads shared by every source, instead of
+// each decoder owning one. Each worker has its own queue of scheduled
+// strands and steals from the others when it runs dry. A strand runs for at
+// most kSliceBudget packets before going to the back of the queue, so a busy
+// source can't starve the rest. High priority strands are taken before
+// Normal ones, but only for kHighPriorityWeight slices in a row: then a
+// worker takes a Normal strand if there is one, so preview-only sources keep
+// decoding, if more slowly, while the pool is saturated.
+//
+// The thread count defaults to the number of cores and can be set with
+// IOS_CAMERA_DECODE_THREADS.
+class DecodePool final
+{
+public:
+    static DecodePool &shared();
+
+    std::size_t threadCount() const noexcept { return m_workers.size(); }
+
+    // Stops and joins the workers. Every strand must have been stopped.
+    void shutdown();
+
+private:
+    friend class DecodeStrand;
+
+    static constexpr std::size_t kSliceBudget{4};
+    static constexpr std::size_t kHighPriorityWeight{4};
+    static constexpr std::size_t kMaxThreadCount{64};
+
+    struct Worker
+    {
+        std::mutex mutex{};
+        std::deque<DecodeStrand *> strands[2]{};    // Normal, High
+        std::thread thread{};
+
+        // High slices run since the last Normal one; only the worker's own
+        // thread touches it
+        std::size_t highStreak{0};
+    };
+
+    DecodePool();
+
+    void submit(DecodeStrand *strand);
+    DecodeStrand *take(const std::size_t index);
+    DecodeStrand *takeFrom(Worker &worker, const std::size_t priority, const bool own);
+    void run(const std::size_t index);
+
+    std::vector<std::unique_ptr<Worker>> m_workers{};
+    std::atomic<std::size_t> m_nextWorker{0};
+
+    // Strands queued across all workers, and the idle workers waiting for one
+    std::atomic<std::size_t> m_pendingCount{0};
+    std::atomic<std::size_t> m_sleepingCount{0};
+    std::mutex m_mutex{};
+    std::condition_variable m_cv{};
+    bool m_shouldStop{false};
+};
+
+#endif /* DecodePool_hpp */
@@ -20,9 +20,48 @@ Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
 #define Decoder_hpp
 
 #include <obs.h>
-#include <vector>
 
-using Packet = std::vector<char>;
+#include "H264Parser.hpp"
+#include "PacketBuffer.hpp"
+#include "Protocol.hpp"
+
+using Packet = portal::Packet;
+
+// Frame types sent by the iOS app
+enum PacketType
+{
+    PacketTypeVideo = 101,
+    PacketTypeAudio = 102
+};
+
+// How much a video packet matters to the pictures decoded after it
+inline H264FrameType classifyPacket(const Packet &packet)
+{
+    return classifyH264Packet(reinterpret_cast<const uint8_t *>(packet.data()), packet.size());
+}
+
+// The same, from the frame's flags when the device sends them
+inline H264FrameType classifyPacket(const portal::ProtocolPacket &packet)
+{
+    if (packet.version < portal::kPortalFrameVersionSequence)
+    {
+        return classifyPacket(packet.packet);
+    }
+
+    // The device already said what the frame is
+    if (packet.flags & portal::PortalFrameFlagKeyframe)
+    {
+        return H264FrameType::Keyframe;
+    }
+
+    if (packet.flags & portal::PortalFrameFlagConfig)
+    {
+        return H264FrameType::Config;
+    }
+
+    return (packet.flags & portal::PortalFrameFlagDiscardable) ? H264FrameType::NonReference
+                                                               : H264FrameType::Reference;
+}
 
 struct DecoderCallback
 {
@@ -36,7 +75,8 @@ protected:
 
 public:
     virtual void init() = 0;
-    virtual void input(const Packet packet, const int type, const int tag) = 0;
+    virtual void input(const Packet &packet, const int type, const int tag) = 0;
+    virtual void input(const portal::ProtocolPacketSpan &packets) = 0;
     virtual void flush() = 0;
     virtual void drain() = 0;
     virtual void shutdown() = 0;
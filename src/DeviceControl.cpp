@@ -0,0 +1,170 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+
+#include <cstring>
+
+#include <obs.h>
+
+#include "Channel.hpp"
+#include "DeviceControl.hpp"
+#include "Protocol.hpp"
+
+#ifdef WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+static uint32_t responseStatus(const portal::ProtocolPacket &response)
+{
+    if (response.packet.size() < sizeof(uint32_t))
+    {
+        return portal::PortalRequestStatusOk;
+    }
+
+    uint32_t status;
+    memcpy(&status, response.packet.data(), sizeof(status));
+
+    return ntohl(status);
+}
+
+DeviceControl::DeviceControl()
+    :
+    m_qualitySupported{std::make_shared<std::atomic_bool>(true)}
+{
+}
+
+void DeviceControl::setChannel(std::shared_ptr<portal::Channel> channel)
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    m_channel = channel;
+
+    // A new connection starts at the device's own quality setting
+    m_qualitySupported = std::make_shared<std::atomic_bool>(true);
+    ++m_generation;
+}
+
+bool DeviceControl::request(const uint32_t type, const char *payload, const std::size_t size)
+{
+    std::shared_ptr<portal::Channel> channel;
+    std::shared_ptr<std::atomic_bool> qualitySupported;
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        channel = m_channel.lock();
+        qualitySupported = m_qualitySupported;
+    }
+
+    if (!channel)
+    {
+        return false;
+    }
+
+    return channel->request(type, payload, size, [type, qualitySupported](const portal::ProtocolPacket &response) {
+        const auto status = responseStatus(response);
+        if (status == portal::PortalRequestStatusOk)
+        {
+            return;
+        }
+
+        blog(LOG_DEBUG, "Device declined request %u with status %u", type, status);
+
+        if ((type == portal::kPortalFrameTypeQualityRequest) && (status == portal::PortalRequestStatusUnsupported))
+        {
+            *qualitySupported = false;
+        }
+    });
+}
+
+void DeviceControl::requestKeyframe()
+{
+    const auto now = portal::monotonicNanoseconds();
+    if (m_lastKeyframeRequest && (now - m_lastKeyframeRequest < kKeyframeRequestInterval))
+    {
+        return;
+    }
+
+    if (request(portal::kPortalFrameTypeKeyframeRequest, nullptr, 0))
+    {
+        blog(LOG_DEBUG, "Requested a keyframe from the device");
+        m_lastKeyframeRequest = now;
+    }
+}
+
+void DeviceControl::reportLoad(const bool isBacklogged)
+{
+    const auto generation = m_generation.load();
+    if (generation != m_seenGeneration)
+    {
+        m_seenGeneration = generation;
+        m_lastKeyframeRequest = 0;
+        m_lastQualityStep = 0;
+        m_keptUpSince = 0;
+        m_qualitySteps = 0;
+    }
+
+    const auto now = portal::monotonicNanoseconds();
+    const auto canStep = !m_lastQualityStep || (now - m_lastQualityStep >= kQualityStepInterval);
+
+    if (isBacklogged)
+    {
+        m_keptUpSince = 0;
+
+        if (canStep && (m_qualitySteps > kMinQualitySteps))
+        {
+            stepQuality(-1, now);
+        }
+
+        return;
+    }
+
+    if (!m_keptUpSince)
+    {
+        m_keptUpSince = now;
+    }
+
+    // Only ever undo our own steps; the user picked the starting quality
+    if (canStep && (m_qualitySteps < 0) && (now - m_keptUpSince >= kHeadroomDuration))
+    {
+        stepQuality(1, now);
+        m_keptUpSince = now;
+    }
+}
+
+void DeviceControl::stepQuality(const int steps, const uint64_t now)
+{
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        if (!*m_qualitySupported)
+        {
+            return;
+        }
+    }
+
+    const auto payload = htonl(static_cast<uint32_t>(static_cast<int32_t>(steps)));
+    if (request(portal::kPortalFrameTypeQualityRequest, reinterpret_cast<const char *>(&payload), sizeof(payload)))
+    {
+        blog(LOG_INFO, "Decoding is %s, asking the device for %s quality", (steps < 0) ? "falling behind" : "keeping up",
+             (steps < 0) ? "lower" : "higher");
+
+        m_qualitySteps += steps;
+        m_lastQualityStep = now;
+    }
+}
@@ -0,0 +1,91 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+
+#ifndef DeviceControl_hpp
+#define DeviceControl_hpp
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+namespace portal
+{
+    class Channel;
+}
+
+// Talks back to the device on behalf of the video decoder: asks for a
+// keyframe when decoding can't continue without one, and steps the encoder's
+// quality down while decoding falls behind and back up once it has kept up
+// for a while. Requests are queued on the device's Channel without waiting;
+// devices that don't understand them simply never answer.
+class DeviceControl final
+{
+public:
+    DeviceControl();
+    ~DeviceControl() = default;
+
+    DeviceControl(const DeviceControl &other) = delete;
+    DeviceControl &operator=(const DeviceControl &other) = delete;
+
+    // The channel of a newly connected device, or nullptr. Safe to call
+    // from any thread.
+    void setChannel(std::shared_ptr<portal::Channel> channel);
+
+    // Called by the decoding strand. requestKeyframe() may be called on
+    // every pass while waiting; it sends at most one request per
+    // kKeyframeRequestInterval.
+    void requestKeyframe();
+    void reportLoad(const bool isBacklogged);
+
+private:
+    static constexpr uint64_t kKeyframeRequestInterval{1000000000};
+
+    // Time between quality steps, so the decoder can settle after each one
+    static constexpr uint64_t kQualityStepInterval{3000000000};
+
+    // How long decoding has to keep up before quality is raised again
+    static constexpr uint64_t kHeadroomDuration{15000000000};
+
+    // Never step further down than this
+    static constexpr int kMinQualitySteps{-4};
+
+    void stepQuality(const int steps, const uint64_t now);
+    bool request(const uint32_t type, const char *payload, const std::size_t size);
+
+    std::mutex                          m_mutex{};
+    std::weak_ptr<portal::Channel>      m_channel{};
+
+    // Bumped by setChannel() so the strand starts over with a new device
+    std::atomic<uint64_t>               m_generation{0};
+
+    // Cleared when the device turns down quality requests. Shared with the
+    // response handlers, which may outlive this object.
+    std::shared_ptr<std::atomic_bool>   m_qualitySupported{};
+
+    // Decoding strand state
+    uint64_t                            m_seenGeneration{0};
+    uint64_t                            m_lastKeyframeRequest{0};
+    uint64_t                            m_lastQualityStep{0};
+    uint64_t                            m_keptUpSince{0};
+    int                                 m_qualitySteps{0};  // Relative to where the device started
+};
+
+#endif /* DeviceControl_hpp */
@@ -0,0 +1,438 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#include <algorithm>
+
+#include "obs-iDevice-cam-source.hpp"
+#include "DeviceSession.hpp"
+
+// path with " (part 2)" and so on before its extension
+static std::string recordingPartPath(const std::string &path, const int part)
+{
+    const auto suffix = " (part " + std::to_string(part) + ")";
+
+    const auto extension = path.rfind('.');
+    if ((extension == std::string::npos) || (path.find('/', extension) != std::string::npos))
+    {
+        return path + suffix;
+    }
+
+    return path.substr(0, extension) + suffix + path.substr(extension);
+}
+
+DeviceSession::shared_ptr DeviceSession::acquire(const std::string &uuid)
+{
+    static std::mutex mutex;
+    static std::map<std::string, std::weak_ptr<DeviceSession>> sessions;
+
+    std::lock_guard<std::mutex> lock{mutex};
+
+    auto session = sessions[uuid].lock();
+    if (session)
+    {
+        return session;
+    }
+
+    // Forget devices nobody shows any more while we're here
+    for (auto it = sessions.begin(); it != sessions.end();)
+    {
+        it = it->second.expired() ? sessions.erase(it) : std::next(it);
+    }
+
+    session = std::make_shared<DeviceSession>(uuid);
+    sessions[uuid] = session;
+
+    return session;
+}
+
+DeviceSession::DeviceSession(const std::string &uuid)
+    :
+    m_uuid{uuid}
+{
+    blog(LOG_INFO, "Creating session for device %s", m_uuid.c_str());
+
+    m_jitterBuffer.m_outputs = &m_outputs;
+
+#ifdef __APPLE__
+    m_videoToolboxVideoDecoder.m_outputs = &m_outputs;
+    m_videoToolboxVideoDecoder.init();
+#endif
+
+    m_ffmpegVideoDecoder.m_outputs = &m_outputs;
+    m_ffmpegVideoDecoder.m_clock = &m_clock;
+    m_ffmpegVideoDecoder.m_jitterBuffer = &m_jitterBuffer;
+    m_ffmpegVideoDecoder.m_control = &m_deviceControl;
+    m_ffmpegVideoDecoder.init();
+
+    m_ffmpegAudioDecoder.m_outputs = &m_outputs;
+    m_ffmpegAudioDecoder.m_clock = &m_clock;
+    m_ffmpegAudioDecoder.m_jitterBuffer = &m_jitterBuffer;
+    m_ffmpegAudioDecoder.init();
+
+    m_videoDecoder = &m_ffmpegVideoDecoder;
+}
+
+DeviceSession::~DeviceSession()
+{
+    // No packets may arrive while the decoders go away
+    disconnect();
+
+    blog(LOG_INFO, "Destroyed session for device %s", m_uuid.c_str());
+}
+
+void DeviceSession::attach(obs_source_t *source, const bool active, const bool showing,
+                           const SourceSettings &settings)
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    auto state = std::find_if(m_sources.begin(), m_sources.end(),
+                              [&](const SourceState &s) { return s.source == source; });
+
+    if (state == m_sources.end())
+    {
+        m_sources.push_back(SourceState{source, active, showing, settings});
+    }
+    else
+    {
+        state->active = active;
+        state->showing = showing;
+        state->settings = settings;
+    }
+
+    m_outputs.add(source);
+
+    blog(LOG_INFO, "Device %s is shown by %zu sources", m_uuid.c_str(), m_sources.size());
+
+    applySettings();
+    updateDecoding();
+}
+
+void DeviceSession::detach(obs_source_t *source)
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    m_sources.erase(std::remove_if(m_sources.begin(), m_sources.end(),
+                                   [&](const SourceState &s) { return s.source == source; }),
+                    m_sources.end());
+
+    // Waits for a frame being output to it
+    m_outputs.remove(source);
+
+    if (m_sources.empty())
+    {
+        disconnectLocked();
+    }
+    else
+    {
+        // What the source that left asked for may no longer be needed
+        applySettings();
+    }
+
+    updateDecoding();
+}
+
+void DeviceSession::setSourceState(obs_source_t *source, const bool active, const bool showing)
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    for (auto &state : m_sources)
+    {
+        if (state.source == source)
+        {
+            state.active = active;
+            state.showing = showing;
+        }
+    }
+
+    updateDecoding();
+}
+
+void DeviceSession::setSourceSettings(obs_source_t *source, const SourceSettings &settings)
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    for (auto &state : m_sources)
+    {
+        if (state.source == source)
+        {
+            state.settings = settings;
+        }
+    }
+
+    applySettings();
+}
+
+void DeviceSession::applySettings()
+{
+    if (m_sources.empty())
+    {
+        return;
+    }
+
+    auto merged = m_sources.front().settings;
+    for (const auto &state : m_sources)
+    {
+        const auto &settings = state.settings;
+
+        merged.isUnbuffered = merged.isUnbuffered && settings.isUnbuffered;
+        merged.useHardwareDecoder = merged.useHardwareDecoder && settings.useHardwareDecoder;
+        merged.replayDuration = std::max(merged.replayDuration, settings.replayDuration);
+
+        auto &options = merged.decodeOptions;
+        options.immediateOutput = options.immediateOutput && settings.decodeOptions.immediateOutput;
+
+        if (settings.decodeOptions.threading == DecodeThreading::FrameAndSlice)
+        {
+            options.threading = DecodeThreading::FrameAndSlice;
+        }
+
+        if ((options.threadCount != 0) &&
+            ((settings.decodeOptions.threadCount == 0) || (settings.decodeOptions.threadCount > options.threadCount)))
+        {
+            options.threadCount = settings.decodeOptions.threadCount;
+        }
+    }
+
+    m_ffmpegVideoDecoder.setDecodeOptions(merged.decodeOptions);
+    m_replayBuffer.setDuration(merged.replayDuration);
+
+#ifdef __APPLE__
+    if (merged.useHardwareDecoder)
+    {
+        m_videoDecoder = &m_videoToolboxVideoDecoder;
+    }
+    else
+    {
+        m_videoDecoder = &m_ffmpegVideoDecoder;
+    }
+#endif
+
+    m_isUnbuffered = merged.isUnbuffered;
+    applyLatencyMode();
+}
+
+void DeviceSession::updateDecoding()
+{
+    const auto isActive = std::any_of(m_sources.begin(), m_sources.end(),
+                                      [](const SourceState &s) { return s.active; });
+
+    const auto isShowing = std::any_of(m_sources.begin(), m_sources.end(),
+                                       [](const SourceState &s) { return s.showing; });
+
+    // Shown on the program output, decode it ahead of preview-only sources
+    const auto priority = isActive ? DecodePriority::High : DecodePriority::Normal;
+    m_ffmpegVideoDecoder.setPriority(priority);
+    m_ffmpegAudioDecoder.setPriority(priority);
+
+    // Video nobody can see isn't decoded, only kept ready to resume.
+    // Audio is cheap and keeps going.
+    m_ffmpegVideoDecoder.setDecodingEnabled(isActive || isShowing);
+}
+
+void DeviceSession::connect(portal::Device::shared_ptr device, const bool force)
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    // Make sure that we're not already connected to the device
+    if (!force && m_device && m_device->isConnected())
+    {
+        blog(LOG_DEBUG, "Already connected to the device. Skipping.");
+        return;
+    }
+
+    const auto wasRecording = isRecording();
+
+    disconnectLocked();
+
+    blog(LOG_INFO, "Connecting to device %s", m_uuid.c_str());
+
+    m_ffmpegVideoDecoder.flush();
+
+    // A new connection may come with a restarted device clock
+    m_clock.reset();
+    m_replayBuffer.clear();
+
+    {
+        std::lock_guard<std::mutex> configLock{m_configMutex};
+        m_config = Packet{};
+    }
+
+#ifdef __APPLE__
+    m_videoToolboxVideoDecoder.flush();
+#endif
+
+    m_device = device;
+    m_device->connect(kPort, shared_from_this(), kConnectAttempts);
+
+    // Keyframe and quality requests go to whichever channel is open now
+    m_deviceControl.setChannel(m_device->channel());
+
+    // A reconnect doesn't end the recording, it carries on in a file of
+    // its own
+    if (wasRecording)
+    {
+        ++m_recordingPart;
+        startRecordingLocked(recordingPartPath(m_recordingPath, m_recordingPart));
+    }
+}
+
+void DeviceSession::disconnect()
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+    disconnectLocked();
+}
+
+void DeviceSession::disconnectLocked()
+{
+    if (!m_device)
+    {
+        return;
+    }
+
+    // Waits for packets being received
+    m_device->disconnect();
+    m_device = nullptr;
+
+    m_deviceControl.setChannel(nullptr);
+
+    // A new connection may come with a restarted device clock, which one
+    // file couldn't follow. connect() carries the recording on.
+    stopRecordingLocked();
+}
+
+bool DeviceSession::saveReplay(const std::string &path)
+{
+    return m_replayBuffer.save(path);
+}
+
+bool DeviceSession::startRecording(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    if (std::atomic_load(&m_recorder))
+    {
+        blog(LOG_WARNING, "Device %s is already being recorded", m_uuid.c_str());
+        return false;
+    }
+
+    m_recordingPath = path;
+    m_recordingPart = 1;
+
+    return startRecordingLocked(path);
+}
+
+bool DeviceSession::startRecordingLocked(const std::string &path)
+{
+    Packet config;
+    {
+        std::lock_guard<std::mutex> configLock{m_configMutex};
+        config = m_config;
+    }
+
+    auto recorder = Mp4Recorder::create(path, config);
+    if (!recorder)
+    {
+        return false;
+    }
+
+    blog(LOG_INFO, "Recording device %s to %s", m_uuid.c_str(), path.c_str());
+    std::atomic_store(&m_recorder, recorder);
+
+    return true;
+}
+
+void DeviceSession::stopRecording()
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+    stopRecordingLocked();
+}
+
+void DeviceSession::stopRecordingLocked()
+{
+    // Packets being received may still hold on to the recorder, but it has
+    // written everything and closed the file once stop() returns
+    const auto recorder = std::atomic_exchange(&m_recorder, std::shared_ptr<Mp4Recorder>{});
+    if (recorder)
+    {
+        recorder->stop();
+    }
+}
+
+void DeviceSession::applyLatencyMode()
+{
+    // In Normal mode the jitter buffer does the buffering instead of
+    // OBS, adapting to how much the stream actually jitters. The
+    // hardware decoder outputs directly and keeps OBS's buffering.
+    const auto useJitterBuffer = !m_isUnbuffered && usesSoftwareDecoder();
+
+    m_jitterBuffer.setEnabled(useJitterBuffer);
+
+    for (const auto &state : m_sources)
+    {
+        obs_source_set_async_unbuffered(state.source, m_isUnbuffered || useJitterBuffer);
+    }
+}
+
+void DeviceSession::channel_onPacketsReceive(const portal::ProtocolPacketSpan &packets)
+{
+    try
+    {
+        // Before the decoders look up the capture times of these packets
+        for (const auto &packet : packets)
+        {
+            if (packet.timing.captured)
+            {
+                m_clock.update(packet.timing.captured, packet.timing.received);
+            }
+
+            if ((packet.type == PacketTypeVideo) && (classifyPacket(packet) == H264FrameType::Config))
+            {
+                std::lock_guard<std::mutex> configLock{m_configMutex};
+                m_config = packet.packet;
+            }
+        }
+
+        m_replayBuffer.input(packets);
+
+        const auto recorder = std::atomic_load(&m_recorder);
+        if (recorder)
+        {
+            recorder->input(packets);
+        }
+
+        // Each decoder picks the packets of its own type out of the batch
+        m_videoDecoder.load()->input(packets);
+        m_ffmpegAudioDecoder.input(packets);
+    }
+    catch (...)
+    {
+        // This isn't great, but I haven't been able to figure out what is
+        // causing the exception that happens when the phone is plugged in
+        // with the app open OBS Studio is launched with the iOS Camera
+        // plugin ready. This also doesn't happen _all_ the time. Which
+        // makes this 'fun'.
+
+        blog(LOG_INFO, "Exception caught...");
+    }
+}
+
+void DeviceSession::channel_onStop()
+{
+    blog(LOG_INFO, "Device %s stopped sending", m_uuid.c_str());
+}
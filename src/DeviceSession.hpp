@@ -0,0 +1,166 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#ifndef DeviceSession_hpp
+#define DeviceSession_hpp
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Device.hpp"
+#include "ClockRecovery.hpp"
+#include "DeviceControl.hpp"
+#include "JitterBuffer.hpp"
+#include "Mp4Recorder.hpp"
+#include "ReplayBuffer.hpp"
+#include "SourceOutputs.hpp"
+#include "FFMpegVideoDecoder.hpp"
+#include "FFMpegAudioDecoder.hpp"
+#ifdef __APPLE__
+#include "VideoToolboxVideoDecoder.hpp"
+#endif
+
+// What one source asks of the device it shows
+struct SourceSettings
+{
+    DecodeOptions decodeOptions{};
+    bool isUnbuffered{false};
+    bool useHardwareDecoder{false};
+    uint64_t replayDuration{0};     // Nanoseconds, zero for none
+};
+
+// Everything one device needs once, however many OBS sources show it: the
+// connection, the decoders and what feeds them. Sources bound to the same
+// device share its session, so the stream is received and decoded once and
+// every decoded frame goes out to all of them.
+//
+// Each source keeps its own settings, and where they disagree the most
+// conservative wins: OBS buffering unless every source turns it off,
+// immediate output and the hardware decoder only if every source asks for
+// them, frame threading if any source does, the most decoding threads (with
+// automatic counting as the most) and the longest replay buffer.
+class DeviceSession final : public portal::ChannelDelegate, public std::enable_shared_from_this<DeviceSession>
+{
+public:
+    using shared_ptr = std::shared_ptr<DeviceSession>;
+
+    // The session of the device with this UDID, created on first use. It
+    // lives for as long as a source holds on to it.
+    static shared_ptr acquire(const std::string &uuid);
+
+    explicit DeviceSession(const std::string &uuid);
+    ~DeviceSession();
+
+    DeviceSession(const DeviceSession &other) = delete;
+    DeviceSession &operator=(const DeviceSession &other) = delete;
+
+    const std::string &uuid() const noexcept { return m_uuid; }
+
+    // Sources start and stop receiving frames. Once the last source has
+    // detached the device is disconnected.
+    void attach(obs_source_t *source, const bool active, const bool showing, const SourceSettings &settings);
+    void detach(obs_source_t *source);
+    void setSourceState(obs_source_t *source, const bool active, const bool showing);
+    void setSourceSettings(obs_source_t *source, const SourceSettings &settings);
+
+    // Connects through device unless already connected, or force is set
+    void connect(portal::Device::shared_ptr device, const bool force);
+    void disconnect();
+
+    bool saveReplay(const std::string &path);
+
+    // Records the stream to an MP4 file until stopped or the last source
+    // detaches. Each reconnect carries on in a new file named after path
+    // with " (part 2)" and so on. Fails if already recording.
+    bool startRecording(const std::string &path);
+    void stopRecording();
+    bool isRecording() const noexcept { return (std::atomic_load(&m_recorder) != nullptr); }
+
+    // For the source properties
+    const JitterBuffer &jitterBuffer() const noexcept { return m_jitterBuffer; }
+    const ReplayBuffer &replayBuffer() const noexcept { return m_replayBuffer; }
+    const DecodeGovernor &governor() const noexcept { return m_ffmpegVideoDecoder.governor(); }
+    bool usesSoftwareDecoder() const noexcept { return (m_videoDecoder.load() == &m_ffmpegVideoDecoder); }
+
+private:
+    static constexpr uint16_t kPort{1260};
+    static constexpr int kConnectAttempts{2000};
+
+    struct SourceState
+    {
+        obs_source_t *source;
+        bool active;
+        bool showing;
+        SourceSettings settings;
+    };
+
+    // These expect m_mutex to be held
+    void applySettings();
+    void disconnectLocked();
+    bool startRecordingLocked(const std::string &path);
+    void stopRecordingLocked();
+    void updateDecoding();
+    void applyLatencyMode();
+
+    void channel_onPacketsReceive(const portal::ProtocolPacketSpan &packets) override;
+    void channel_onStop() override;
+
+    const std::string           m_uuid;
+
+    // Guards the sources, the device and the settings below. Packets are
+    // received without it.
+    std::mutex                  m_mutex{};
+    std::vector<SourceState>    m_sources{};
+    portal::Device::shared_ptr  m_device{nullptr};
+    bool                        m_isUnbuffered{false};
+
+    // Where the recording started and which file it's in now
+    std::string                 m_recordingPath{};
+    int                         m_recordingPart{0};
+
+    // Declared before the decoders, which output through them
+    SourceOutputs               m_outputs{};
+    ClockRecovery               m_clock{};
+    DeviceControl               m_deviceControl{};
+    JitterBuffer                m_jitterBuffer{};
+    ReplayBuffer                m_replayBuffer{};
+
+    // Swapped while packets are being received
+    std::shared_ptr<Mp4Recorder> m_recorder{nullptr};
+
+    // Newest parameter sets, for recordings started mid-stream
+    std::mutex                  m_configMutex{};
+    Packet                      m_config{};
+
+#ifdef __APPLE__
+    VideoToolboxDecoder         m_videoToolboxVideoDecoder{};
+#endif
+
+    FFMpegVideoDecoder          m_ffmpegVideoDecoder{};
+    FFMpegAudioDecoder          m_ffmpegAudioDecoder{};
+
+    // Switched by the settings while packets are being received
+    std::atomic<Decoder *>      m_videoDecoder{nullptr};
+};
+
+#endif /* DeviceSession_hpp */
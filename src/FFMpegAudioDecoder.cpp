@@ -16,6 +16,7 @@ Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
  with this program. If not, see <https://www.gnu.org/licenses/>
  */
 
+#include <algorithm>
 #include <fstream>
 #include <util/platform.h>
 #include "FFMpegAudioDecoder.hpp"
@@ -28,12 +29,47 @@ FFMpegAudioDecoder::~FFMpegAudioDecoder()
 
 void FFMpegAudioDecoder::init()
 {
-    start();
+    m_items.resize(m_queue.capacity());
 }
 
-void FFMpegAudioDecoder::Input(const Packet packet, const int type, const int tag)
+void FFMpegAudioDecoder::input(const Packet &packet, const int type, const int tag)
 {
-    m_queue.add(new PacketItem(packet, type, tag));
+    const auto now = portal::monotonicNanoseconds();
+
+    FrameTiming timing{};
+    timing.received = now;
+    timing.parsed = now;
+    timing.enqueued = now;
+
+    if (m_queue.push(PacketItem(packet, type, tag, H264FrameType::Unknown, timing)))
+    {
+        m_strand.schedule();
+    }
+}
+
+void FFMpegAudioDecoder::input(const portal::ProtocolPacketSpan &packets)
+{
+    const auto enqueued = portal::monotonicNanoseconds();
+
+    for (const auto &packet : packets)
+    {
+        if (packet.type == PacketTypeAudio)
+        {
+            FrameTiming timing{packet.timing};
+            timing.enqueued = enqueued;
+
+            m_batch.emplace_back(packet.packet, packet.type, packet.tag, H264FrameType::Unknown, timing);
+        }
+    }
+
+    // Enqueue the whole read and schedule the decoder once
+    const auto pushed = m_queue.push(m_batch.data(), m_batch.size());
+    m_batch.clear();
+
+    if (pushed > 0)
+    {
+        m_strand.schedule();
+    }
 }
 
 void FFMpegAudioDecoder::flush()
@@ -47,10 +83,10 @@ void FFMpegAudioDecoder::drain()
 void FFMpegAudioDecoder::shutdown()
 {
     m_queue.stop();
-    join();
+    m_strand.stop();
 }
 
-void FFMpegAudioDecoder::processPacketItem(PacketItem *packetItem)
+void FFMpegAudioDecoder::processPacketItem(const PacketItem &packetItem)
 {
     const uint64_t cur_time = os_gettime_ns();
 
@@ -63,56 +99,77 @@ void FFMpegAudioDecoder::processPacketItem(PacketItem *packetItem)
         }
     }
 
-    const auto packet = packetItem->getPacket();
-    const auto data = static_cast<unsigned char *>(packet.data());
+    const auto &packet = packetItem.getPacket();
 
-    if (packetItem->getType() == 102)
+    if (packetItem.getType() == PacketTypeAudio)
     {
+        auto timing = packetItem.getTiming();
+        timing.decodeStarted = portal::monotonicNanoseconds();
+
         bool got_output{false};
-        const auto success = m_audioDecoder->decodeAudio(data, packet.size(), &m_audioFrame, &got_output);
+        const auto success = m_audioDecoder->decodeAudio(packet, &m_audioFrame, &got_output);
+
+        timing.decodeEnded = portal::monotonicNanoseconds();
+
         if (!success)
         {
             blog(LOG_WARNING, "Error decoding audio");
             return;
         }
 
-        if (got_output && source)
+        if (got_output && m_outputs)
         {
-            m_audioFrame.timestamp = cur_time;
-            obs_source_output_audio(source, &m_audioFrame);
+            const auto capturedHostTime = (m_clock && timing.captured) ? m_clock->toHostTime(timing.captured) : 0;
+            auto timestamp = capturedHostTime ? capturedHostTime : cur_time;
+            if (m_jitterBuffer)
+            {
+                // Video is held back by the jitter buffer, with or without a
+                // capture time, keep audio with it
+                timestamp += m_jitterBuffer->delay();
+            }
+
+            m_audioFrame.timestamp = timestamp;
+            m_outputs->outputAudio(&m_audioFrame);
+
+            timing.output = portal::monotonicNanoseconds();
+            LatencyTracer::shared().record(LatencyTrack::Audio, timing);
         }
     }
 }
 
-void *FFMpegAudioDecoder::run()
+bool FFMpegAudioDecoder::decodeTask_run(const std::size_t budget)
 {
-    while (!isStopped())
+    if (m_itemIndex == m_itemCount)
     {
-        auto item = static_cast<PacketItem *>(m_queue.remove());
-        if (item)
-        {
-            processPacketItem(item);
-            delete item;
-        }
+        const auto count = m_queue.pop(m_items.data(), m_items.size());
 
         // Check queue lengths
 
         const std::size_t queueSizeThreshold{25};
 
-        const int queueSize = m_queue.size();
-        if (queueSize > queueSizeThreshold)
+        std::size_t first{0};
+        if (count > queueSizeThreshold)
         {
-            blog(LOG_WARNING, "Audio Decoding queue overloaded. %d frames behind. Please use a lower quality setting.", queueSize);
+            blog(LOG_WARNING, "Audio Decoding queue overloaded. %zu frames behind. Please use a lower quality setting.", count);
+            first = count - 5;
+        }
 
-            if (queueSize > queueSizeThreshold)
-            {
-                while (m_queue.size() > 5)
-                {
-                    m_queue.remove();
-                }
-            }
+        // Release the skipped packets so their buffers can be recycled
+        for (std::size_t i{0}; i < first; ++i)
+        {
+            m_items[i] = PacketItem{};
         }
+
+        m_itemIndex = first;
+        m_itemCount = count;
+    }
+
+    const auto end = std::min(m_itemCount, m_itemIndex + budget);
+    for (; m_itemIndex < end; ++m_itemIndex)
+    {
+        processPacketItem(m_items[m_itemIndex]);
+        m_items[m_itemIndex] = PacketItem{};
     }
 
-    return nullptr;
+    return (m_itemIndex < m_itemCount) || (m_queue.size() > 0);
 }
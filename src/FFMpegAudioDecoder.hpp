@@ -19,9 +19,13 @@ Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
 #include <chrono>
 
 #include "obs-iDevice-cam-source.hpp"
+#include "ClockRecovery.hpp"
+#include "Decoder.hpp"
+#include "DecodePool.hpp"
 #include "FFMpegDecode.hpp"
+#include "JitterBuffer.hpp"
 #include "Queue.hpp"
-#include "Thread.hpp"
+#include "SourceOutputs.hpp"
 
 class AudioDecoder final
 {
@@ -41,31 +45,50 @@ struct FFMpegAudioDecoderCallback
     virtual ~FFMpegAudioDecoderCallback() {}
 };
 
-class FFMpegAudioDecoder : public AudioDecoder, private Thread
+class FFMpegAudioDecoder final : public Decoder, private DecodeTask
 {
 public:
-    FFMpegAudioDecoder();
+    FFMpegAudioDecoder() = default;
     ~FFMpegAudioDecoder();
 
     void init() override;
-    void input(const Packet packet, const int type, const int tag) override;
+    void input(const Packet &packet, const int type, const int tag) override;
+    void input(const portal::ProtocolPacketSpan &packets) override;
     void flush() override;
     void drain() override;
     void shutdown() override;
 
+    void setPriority(const DecodePriority priority) { m_strand.setPriority(priority); }
+
     // Public data members
 
-    obs_source_t*           m_source{nullptr};
+    // Every source showing the device
+    SourceOutputs*          m_outputs{nullptr};
+
+    // Timestamps frames by capture time when set and the device sends it
+    ClockRecovery*          m_clock{nullptr};
+
+    // Audio timestamps follow the video jitter buffer's delay when set
+    JitterBuffer*           m_jitterBuffer{nullptr};
 
 private:
     // Data members
 
-    WorkQueue<PacketItem*>  m_queue{};
+    static constexpr std::size_t kQueueCapacity{128};
+
+    SPSCQueue<PacketItem>   m_queue{kQueueCapacity, OverflowPolicy::DropNewest};
+    std::vector<PacketItem> m_batch{};      // Producer side scratch
+    std::vector<PacketItem> m_items{};      // Consumer side scratch
+    std::size_t             m_itemCount{0};
+    std::size_t             m_itemIndex{0}; // Next of m_items to decode
     obs_source_audio        m_audioFrame{};
     AudioDecoder            m_audioDecoder{};
 
+    // Declared last so it is stopped before anything it uses goes away
+    DecodeStrand            m_strand{this};
+
     // Utility functions
 
-    void *run() override;
-    void processPacketItem(PacketItem *packetItem);
+    bool decodeTask_run(const std::size_t budget) override;
+    void processPacketItem(const PacketItem &packetItem);
 };
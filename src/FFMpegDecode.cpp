@@ -18,8 +18,12 @@
 #include "FFMpegDecode.hpp"
 #include "obs-ffmpeg-compat.h"
 #include <obs-avc.h>
+#include <cstring>
 
-int FFMpegDecode::init(const AVCodecID id) noexcept
+static_assert(portal::kPacketPadding >= AV_INPUT_BUFFER_PADDING_SIZE,
+              "Portal packet padding is too small for libavcodec");
+
+int FFMpegDecode::init(const AVCodecID id, const DecodeOptions &options) noexcept
 {
     m_codec = avcodec_find_decoder(id);
     if (!m_codec)
@@ -29,6 +33,42 @@ int FFMpegDecode::init(const AVCodecID id) noexcept
 
     m_decoder = avcodec_alloc_context3(m_codec);
 
+    // Everything below has to be configured before avcodec_open2, which is
+    // when libavcodec sets up its thread pool.
+    if (m_codec->capabilities & CODEC_CAP_TRUNC)
+    {
+        m_decoder->flags |= CODEC_FLAG_TRUNC;
+    }
+
+    m_decoder->thread_count = options.threadCount;
+    m_decoder->skip_loop_filter = m_skipLoopFilter ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+
+    if (m_codec->type == AVMEDIA_TYPE_VIDEO)
+    {
+        m_framePool.attach(m_decoder);
+    }
+
+    if (options.immediateOutput)
+    {
+        // No reordering delay, and without CHUNKS a picture is complete at
+        // the end of its packet rather than when the next one shows up
+        m_decoder->thread_type = FF_THREAD_SLICE;
+        m_decoder->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        m_decoder->has_b_frames = 0;
+    }
+    else if (options.threading == DecodeThreading::Slice)
+    {
+        // Frame threading is unavailable with LOW_DELAY or CHUNKS set, so
+        // they are only used when we don't want it anyway.
+        m_decoder->thread_type = FF_THREAD_SLICE;
+        m_decoder->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        m_decoder->flags2 |= AV_CODEC_FLAG2_CHUNKS;
+    }
+    else
+    {
+        m_decoder->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    }
+
     const auto ret = avcodec_open2(m_decoder, m_codec, nullptr);
     if (ret < 0)
     {
@@ -36,13 +76,10 @@ int FFMpegDecode::init(const AVCodecID id) noexcept
         return ret;
     }
 
-    if (m_codec->capabilities & CODEC_CAP_TRUNC)
-    {
-        m_decoder->flags |= CODEC_FLAG_TRUNC;
-    }
-
-    m_decoder->flags |= AV_CODEC_FLAG_LOW_DELAY;
-    m_decoder->flags2 = AV_CODEC_FLAG2_CHUNKS;
+    blog(LOG_INFO, "Opened %s decoder with %d thread(s) (%s)%s", m_codec->name, m_decoder->thread_count,
+         (m_decoder->active_thread_type & FF_THREAD_FRAME) ? "frame" :
+         (m_decoder->active_thread_type & FF_THREAD_SLICE) ? "slice" : "none",
+         options.immediateOutput ? ", immediate output" : "");
 
     return 0;
 }
@@ -58,14 +95,49 @@ void FFMpegDecode::free() noexcept
 
     if (m_frame)
     {
-        av_free(m_frame);
-        m_frame = nullptr;
+        av_frame_free(&m_frame);
+    }
+
+    m_framePool.reset();
+
+    if (m_packet)
+    {
+        av_packet_free(&m_packet);
+    }
+
+    if (m_smallPacketPool)
+    {
+        // Buffers still held by libavcodec keep the pool alive until released
+        av_buffer_pool_uninit(&m_smallPacketPool);
+    }
+}
+
+void FFMpegDecode::setSkipLoopFilter(const bool skip) noexcept
+{
+    m_skipLoopFilter = skip;
+
+    // Frame threads pick this up with the next packet
+    if (m_decoder)
+    {
+        m_decoder->skip_loop_filter = skip ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+    }
+}
+
+void FFMpegDecode::reset() noexcept
+{
+    if (m_frame)
+    {
+        av_frame_unref(m_frame);
     }
 
-    if (m_packetBuffer)
+    if (m_packet)
+    {
+        av_packet_unref(m_packet);
+    }
+
+    if (m_decoder)
     {
-        bfree(m_packetBuffer);
-        m_packetBuffer = nullptr;
+        avcodec_flush_buffers(m_decoder);
     }
 }
 
@@ -146,32 +218,87 @@ static inline speaker_layout convertSpeakerLayout(const uint8_t channels)
     }
 }
 
-void FFMpegDecode::copyData(const uint8_t *data, const std::size_t size) noexcept
+static void releasePortalPacket(void *opaque, uint8_t *data)
 {
-    const auto newSize = size + INPUT_BUFFER_PADDING_SIZE;
+    UNUSED_PARAMETER(data);
+    delete static_cast<portal::Packet *>(opaque);
+}
 
-    if (m_packetSize < newSize)
+bool FFMpegDecode::wrapPacket(const portal::Packet &packet) noexcept
+{
+    if (!m_packet)
     {
-        m_packetBuffer = brealloc(m_packetBuffer, newSize);
-        m_packetSize = newSize;
+        m_packet = av_packet_alloc();
+        if (!m_packet)
+        {
+            return false;
+        }
     }
 
-    memset(m_packetBuffer + size, 0, INPUT_BUFFER_PADDING_SIZE);
-    memcpy(m_packetBuffer, data, size);
+    av_packet_unref(m_packet);
+
+    const auto size = packet.size();
+
+    if (packet.isPadded())
+    {
+        // The padding is already in place behind the payload, so hand
+        // libavcodec a reference to the portal buffer itself. The copy of the
+        // Packet keeps the buffer alive for as long as libavcodec (or one of
+        // its frame threads) holds on to it.
+        const auto data = reinterpret_cast<uint8_t *>(const_cast<char *>(packet.data()));
+        const auto reference = new portal::Packet(packet);
+
+        m_packet->buf = av_buffer_create(data, size + AV_INPUT_BUFFER_PADDING_SIZE,
+                                         releasePortalPacket, reference, AV_BUFFER_FLAG_READONLY);
+        if (!m_packet->buf)
+        {
+            delete reference;
+            return false;
+        }
+    }
+    else
+    {
+        // Small packets that shared a read with the next frame have its
+        // header right behind them, so they get copied into a padded buffer.
+        if (size <= kSmallPacketSize)
+        {
+            if (!m_smallPacketPool)
+            {
+                m_smallPacketPool = av_buffer_pool_init(kSmallPacketSize + AV_INPUT_BUFFER_PADDING_SIZE, nullptr);
+            }
+
+            m_packet->buf = m_smallPacketPool ? av_buffer_pool_get(m_smallPacketPool) : nullptr;
+        }
+        else
+        {
+            m_packet->buf = av_buffer_alloc(size + AV_INPUT_BUFFER_PADDING_SIZE);
+        }
+
+        if (!m_packet->buf)
+        {
+            return false;
+        }
+
+        memcpy(m_packet->buf->data, packet.data(), size);
+        memset(m_packet->buf->data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    }
+
+    m_packet->data = m_packet->buf->data;
+    m_packet->size = (int)size;
+
+    return true;
 }
 
-bool FFMpegDecode::decodeAudio(const uint8_t* data, const std::size_t size,
+bool FFMpegDecode::decodeAudio(const portal::Packet &packet,
                                obs_source_audio* audio,
                                bool* got_output) noexcept
 {
     *got_output = false;
 
-    copyData(data, size);
-
-    AVPacket packet = {0};
-    av_init_packet(&packet);
-    packet.data = m_packetBuffer;
-    packet.size = (int)size;
+    if (!packet.empty() && !wrapPacket(packet))
+    {
+        return false;
+    }
 
     if (!m_frame)
     {
@@ -184,9 +311,11 @@ bool FFMpegDecode::decodeAudio(const uint8_t* data, const std::size_t size,
 
     int ret{0};
 
-    if (data && size)
+    if (!packet.empty())
     {
-        ret = avcodec_send_packet(m_decoder, &packet);
+        // libavcodec takes its own reference to the packet buffer
+        ret = avcodec_send_packet(m_decoder, m_packet);
+        av_packet_unref(m_packet);
     }
 
     if (ret == 0)
@@ -231,24 +360,24 @@ bool FFMpegDecode::decodeAudio(const uint8_t* data, const std::size_t size,
     return true;
 }
 
-bool FFMpegDecode::decodeVideo(uint8_t* data, const std::size_t size,
+bool FFMpegDecode::decodeVideo(const portal::Packet &packet,
                                long long* ts,
                                obs_source_frame* frame,
                                bool* got_output) noexcept
 {
     *got_output = false;
 
-    copyData(data, size);
+    if (!wrapPacket(packet))
+    {
+        return false;
+    }
 
-    AVPacket packet = {0};
-    av_init_packet(&packet);
-    packet.data = m_packetBuffer;
-    packet.size = (int)size;
-    packet.pts = *ts;
+    m_packet->pts = *ts;
 
-    if (m_codec->id == AV_CODEC_ID_H264 && obs_avc_keyframe(data, size))
+    const auto data = reinterpret_cast<const uint8_t *>(packet.data());
+    if (m_codec->id == AV_CODEC_ID_H264 && obs_avc_keyframe(data, packet.size()))
     {
-        packet.flags |= AV_PKT_FLAG_KEY;
+        m_packet->flags |= AV_PKT_FLAG_KEY;
     }
 
     if (!m_frame)
@@ -260,7 +389,14 @@ bool FFMpegDecode::decodeVideo(uint8_t* data, const std::size_t size,
         }
     }
 
-    auto ret = avcodec_send_packet(m_decoder, &packet);
+    // Normally released by the caller already, but never decode into a
+    // frame that is still holding on to the previous picture.
+    av_frame_unref(m_frame);
+
+    // libavcodec takes its own reference to the packet buffer
+    auto ret = avcodec_send_packet(m_decoder, m_packet);
+    av_packet_unref(m_packet);
+
     if (ret == 0)
     {
         ret = avcodec_receive_frame(m_decoder, m_frame);
@@ -324,3 +460,16 @@ bool FFMpegDecode::decodeVideo(uint8_t* data, const std::size_t size,
     *got_output = true;
     return true;
 }
+
+AVFrame *FFMpegDecode::referenceVideoFrame() noexcept
+{
+    return m_frame ? av_frame_clone(m_frame) : nullptr;
+}
+
+void FFMpegDecode::releaseVideoFrame() noexcept
+{
+    if (m_frame)
+    {
+        av_frame_unref(m_frame);
+    }
+}
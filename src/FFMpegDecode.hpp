@@ -33,34 +33,91 @@
 #pragma warning(pop)
 #endif
 
+#include "PacketBuffer.hpp"
+#include "VideoFramePool.hpp"
+
+// How libavcodec spreads decoding of a stream across threads. See
+// "Decoder threading" in README.md for the latency/throughput tradeoff.
+enum class DecodeThreading
+{
+    // Frame and slice threading. Highest throughput, but every extra thread
+    // holds back one more frame before it is output.
+    FrameAndSlice,
+
+    // Slice threading only. Adds no latency, but only helps when the encoder
+    // splits pictures into several slices.
+    Slice
+};
+
+struct DecodeOptions final
+{
+    // Number of decoding threads, 0 lets libavcodec pick one per core
+    int threadCount{0};
+    DecodeThreading threading{DecodeThreading::FrameAndSlice};
+
+    // Output every picture as soon as the packet holding it is decoded.
+    // Assumes each packet is one whole picture and the stream has no
+    // B-frames, as with the streams phones send. Implies Slice threading.
+    bool immediateOutput{false};
+
+    bool operator==(const DecodeOptions &other) const noexcept
+    {
+        return (threadCount == other.threadCount) && (threading == other.threading) &&
+               (immediateOutput == other.immediateOutput);
+    }
+    bool operator!=(const DecodeOptions &other) const noexcept { return !(*this == other); }
+};
+
 class FFMpegDecode final
 {
 public:
     FFMpegDecode() = default;
     ~FFMpegDecode() { free(); }
 
-    int init(const AVCodecID id) noexcept;
+    int init(const AVCodecID id, const DecodeOptions &options = DecodeOptions{}) noexcept;
     void free() noexcept;
 
-    bool decodeAudio(const uint8_t* data, const std::size_t size,
+    // Discards buffered pictures and reference state so decoding can start
+    // over from the next keyframe, keeping the context, its thread pool and
+    // the frame pool alive.
+    void reset() noexcept;
+
+    bool decodeAudio(const portal::Packet &packet,
                      obs_source_audio* audio,
                      bool* got_output) noexcept;
 
-    bool decodeVideo(const uint8_t* data, const std::size_t size,
+    bool decodeVideo(const portal::Packet &packet,
                      long long* ts,
                      obs_source_frame* frame,
                      bool* got_output) noexcept;
 
+    // Lets go of the picture the last decodeVideo output, returning its
+    // buffers to the pool. Call once the frame has been handed to OBS.
+    void releaseVideoFrame() noexcept;
+
+    // A new reference to the picture the last decodeVideo output, for
+    // holding on to it past the next decode. Free with av_frame_free.
+    AVFrame *referenceVideoFrame() noexcept;
+
     bool isValid() const noexcept { return (m_decoder != nullptr); }
 
+    // Skips the deblocking filter on non-reference pictures. Takes effect
+    // from the next packet and carries over when the decoder is reopened.
+    void setSkipLoopFilter(const bool skip) noexcept;
+
 private:
+    // Unpadded packets up to this size are copied into pooled buffers
+    static constexpr std::size_t kSmallPacketSize{1 << 16};
+
     AVCodecContext*     m_decoder{nullptr};
     AVCodec*            m_codec{nullptr};
     AVFrame*            m_frame{nullptr};
-    uint8_t*            m_packetBuffer{nullptr};
-    std::size_t         m_packetSize{0};
+    AVPacket*           m_packet{nullptr};
+    AVBufferPool*       m_smallPacketPool{nullptr};
+    VideoFramePool      m_framePool{};
+    bool                m_skipLoopFilter{false};
 
     // Utility functions
 
-    void copyData(const uint8_t *data, const std::size_t size) noexcept;
+    bool wrapPacket(const portal::Packet &packet) noexcept;
 };
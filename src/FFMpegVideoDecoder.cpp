@@ -19,6 +19,8 @@ Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
 #include "FFMpegVideoDecoder.hpp"
 #include <util/platform.h>
 
+#include <algorithm>
+
 FFMpegVideoDecoder::~FFMpegVideoDecoder()
 {
     shutdown();
@@ -27,25 +29,66 @@ FFMpegVideoDecoder::~FFMpegVideoDecoder()
 
 void FFMpegVideoDecoder::init()
 {
-    start();
+    m_items.resize(m_queue.capacity());
 }
 
-void FFMpegVideoDecoder::input(const Packet packet, const int type, const int tag)
+void FFMpegVideoDecoder::input(const Packet &packet, const int type, const int tag)
 {
-    m_queue.add(new PacketItem(packet, type, tag));
+    const auto now = portal::monotonicNanoseconds();
+
+    FrameTiming timing{};
+    timing.received = now;
+    timing.parsed = now;
+    timing.enqueued = now;
+
+    if (m_queue.push(PacketItem(packet, type, tag, classifyPacket(packet), timing)))
+    {
+        m_strand.schedule();
+    }
+}
+
+void FFMpegVideoDecoder::input(const portal::ProtocolPacketSpan &packets)
+{
+    const auto enqueued = portal::monotonicNanoseconds();
+
+    for (const auto &packet : packets)
+    {
+        if (packet.type == PacketTypeVideo)
+        {
+            FrameTiming timing{packet.timing};
+            timing.enqueued = enqueued;
+
+            if (packet.lostBefore > 0)
+            {
+                m_lostCount += packet.lostBefore;
+            }
+
+            m_batch.emplace_back(packet.packet, packet.type, packet.tag, classifyPacket(packet), timing);
+        }
+    }
+
+    // Enqueue the whole read and schedule the decoder once
+    const auto pushed = m_queue.push(m_batch.data(), m_batch.size());
+    m_batch.clear();
+
+    if (pushed > 0)
+    {
+        m_strand.schedule();
+    }
 }
 
 void FFMpegVideoDecoder::flush()
 {
-    while (m_queue.size() > 0)
+    std::unique_lock<std::mutex> lock{m_mutex};
+    if (m_stopped)
     {
-        m_queue.remove();
+        return;
     }
 
-    m_mutex.lock();
-    // Re-initialize the decoder
-    m_videoDecoder->free();
-    m_mutex.unlock();
+    m_flushRequested = true;
+    m_strand.schedule();
+
+    m_flushCv.wait(lock, [&]() { return !m_flushRequested || m_stopped; });
 }
 
 void FFMpegVideoDecoder::drain()
@@ -55,77 +98,581 @@ void FFMpegVideoDecoder::drain()
 void FFMpegVideoDecoder::shutdown()
 {
     m_queue.stop();
-    join();
+    m_strand.stop();
+
+    // Release anyone still waiting for a flush
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_stopped = true;
+    m_flushRequested = false;
+    m_flushCv.notify_all();
+}
+
+void FFMpegVideoDecoder::setDecodeOptions(const DecodeOptions &options)
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_requestedOptions = options;
+}
+
+void FFMpegVideoDecoder::setDecodingEnabled(const bool enabled)
+{
+    m_decodingEnabled = enabled;
+
+    // Let the strand notice, a resume shows the cached picture right away
+    m_strand.schedule();
+}
+
+void FFMpegVideoDecoder::processFlushRequest()
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    if (m_requestedOptions != m_decodeOptions)
+    {
+        // The thread setup is fixed once the codec is open, so reopen it and
+        // resume from the next keyframe.
+        m_decodeOptions = m_requestedOptions;
+
+        if (m_videoDecoder->isValid())
+        {
+            m_videoDecoder->free();
+            m_waitingForKeyframe = true;
+        }
+    }
+
+    if (!m_flushRequested)
+    {
+        return;
+    }
+
+    m_queue.clear();
+
+    for (auto i = m_itemIndex; i < m_itemCount; ++i)
+    {
+        m_items[i] = PacketItem{};
+    }
+    m_itemIndex = 0;
+    m_itemCount = 0;
+
+    clearCache();
+    m_catchUp.clear();
+    m_catchUpIndex = 0;
+
+    if (m_jitterBuffer)
+    {
+        m_jitterBuffer->clear();
+    }
+
+    // Drop whatever the previous connection left in the decoder, but keep
+    // it open. The new stream starts with parameter sets and a keyframe, and
+    // only reopens the decoder if those differ from the current ones.
+    if (m_videoDecoder->isValid())
+    {
+        m_videoDecoder->reset();
+        m_waitingForKeyframe = true;
+    }
+
+    m_flushTime = os_gettime_ns();
+
+    // The new stream may well be lighter
+    m_governor.reset();
+
+    m_flushRequested = false;
+    m_flushCv.notify_all();
+}
+
+void FFMpegVideoDecoder::processParameterSets(const Packet &packet)
+{
+    constexpr uint8_t kNalUnitTypeSps{7};
+
+    const auto data = reinterpret_cast<const uint8_t *>(packet.data());
+    forEachH264Nal(data, packet.size(), [&](const uint8_t *nal, const std::size_t nalSize) {
+        if ((nalSize == 0) || ((nal[0] & 0x1f) != kNalUnitTypeSps))
+        {
+            return true;
+        }
+
+        if (std::equal(nal, nal + nalSize, m_spsData.begin(), m_spsData.end()))
+        {
+            return false;
+        }
+
+        if (m_videoDecoder->isValid() && !m_spsData.empty())
+        {
+            blog(LOG_INFO, "Video stream configuration changed, reopening the decoder");
+            m_videoDecoder->free();
+        }
+
+        m_spsData.assign(nal, nal + nalSize);
+        return false;
+    });
+}
+
+void FFMpegVideoDecoder::cachePacketItem(PacketItem &&packetItem)
+{
+    const auto frameType = packetItem.getFrameType();
+
+    switch (frameType)
+    {
+    case H264FrameType::Config:
+        // A new run of parameter sets replaces the previous one
+        if (m_cachedConfigComplete)
+        {
+            m_cachedConfig.clear();
+            m_cachedConfigComplete = false;
+        }
+
+        m_cachedConfig.push_back(std::move(packetItem));
+        break;
+
+    case H264FrameType::Keyframe:
+        m_cachedConfigComplete = true;
+        m_cachedGop.clear();
+        m_cachedGopTruncated = false;
+        m_cachedGop.push_back(std::move(packetItem));
+        break;
+
+    case H264FrameType::Reference:
+    case H264FrameType::NonReference:
+        m_cachedConfigComplete = true;
+
+        if (m_cachedGop.empty() || m_cachedGopTruncated)
+        {
+            m_skippedPictures = true;
+            break;
+        }
+
+        // Nothing predicts from a non-reference picture, so only the newest
+        // one is worth keeping
+        if (m_cachedGop.back().getFrameType() == H264FrameType::NonReference)
+        {
+            m_cachedGop.pop_back();
+        }
+
+        if (m_cachedGop.size() == kMaxCachedFrames)
+        {
+            // Keep just the keyframe, and let the next one catch up instead
+            m_cachedGop.resize(1);
+            m_cachedGopTruncated = true;
+            m_skippedPictures = true;
+            break;
+        }
+
+        m_cachedGop.push_back(std::move(packetItem));
+        break;
+
+    default:
+        break;
+    }
+}
+
+void FFMpegVideoDecoder::clearCache()
+{
+    m_cachedConfig.clear();
+    m_cachedGop.clear();
+    m_cachedGopTruncated = false;
+    m_cachedConfigComplete = false;
+    m_skippedPictures = false;
 }
 
-void FFMpegVideoDecoder::processPacketItem(PacketItem *packetItem)
+void FFMpegVideoDecoder::resume()
+{
+    m_suspended = false;
+
+    m_catchUp.clear();
+    m_catchUpIndex = 0;
+
+    for (auto &item : m_cachedConfig)
+    {
+        m_catchUp.push_back(std::move(item));
+    }
+
+    if (!m_cachedGop.empty())
+    {
+        for (auto &item : m_cachedGop)
+        {
+            m_catchUp.push_back(std::move(item));
+        }
+
+        // With only the keyframe cached it stays on screen until the next
+        // keyframe, later pictures predict from ones that weren't kept
+        m_waitingForKeyframe = m_cachedGopTruncated;
+
+        blog(LOG_INFO, "Resuming video decoding from %zu cached packets", m_catchUp.size());
+    }
+    else if (m_skippedPictures)
+    {
+        // No keyframe arrived while paused, and what follows predicts from
+        // pictures the decoder never saw
+        m_waitingForKeyframe = true;
+    }
+
+    clearCache();
+}
+
+void FFMpegVideoDecoder::applyDecodeLevel()
+{
+    const auto level = m_governor.level();
+    if (level == m_appliedLevel)
+    {
+        return;
+    }
+
+    m_videoDecoder->setSkipLoopFilter(level >= DecodeLevel::NoLoopFilter);
+
+    if ((m_appliedLevel == DecodeLevel::KeyframesOnly) && (level < DecodeLevel::KeyframesOnly))
+    {
+        // The pictures that follow predict from ones that weren't decoded
+        m_skipToKeyframe = true;
+
+        if (m_control)
+        {
+            m_control->requestKeyframe();
+        }
+    }
+
+    m_appliedLevel = level;
+}
+
+void FFMpegVideoDecoder::processPacketItem(const PacketItem &packetItem, const bool isCatchUp, const bool showPicture)
 {
-    mMutex.lock();
     const uint64_t cur_time = os_gettime_ns();
+    const auto frameType = packetItem.getFrameType();
+
+    // Replayed packets are needed to rebuild the picture and always decoded
+    if (!isCatchUp && (packetItem.getType() == PacketTypeVideo) && (frameType != H264FrameType::Config))
+    {
+        m_governor.recordPicture();
+        applyDecodeLevel();
+
+        if (frameType == H264FrameType::Keyframe)
+        {
+            m_skipToKeyframe = false;
+        }
+
+        const auto isPicture = (frameType == H264FrameType::Reference) || (frameType == H264FrameType::NonReference);
+        if ((m_skipToKeyframe && isPicture) || !m_governor.shouldDecode(frameType))
+        {
+            return;
+        }
+    }
+
+    if (frameType == H264FrameType::Config)
+    {
+        processParameterSets(packetItem.getPacket());
+    }
+
     if (!m_videoDecoder->isValid())
     {
-        if (m_videoDecoder->init(AV_CODEC_ID_H264) < 0)
+        if (m_videoDecoder->init(AV_CODEC_ID_H264, m_decodeOptions) < 0)
         {
             blog(LOG_WARNING, "Could not initialize video decoder");
             return;
         }
     }
 
-    const auto packet = packetItem->getPacket();
-    const auto data = static_cast<unsigned char *>(packet.data());
+    const auto &packet = packetItem.getPacket();
 
-    const auto ts = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    // Passed through the decoder as the pts, so with frame threading the
+    // picture still gets the timestamp of the packet it came from
+    const auto captured = packetItem.getTiming().captured;
+    const auto capturedHostTime = (m_clock && captured) ? m_clock->toHostTime(captured) : 0;
+    long long ts = static_cast<long long>(capturedHostTime ? capturedHostTime : cur_time);
 
-    if (packetItem->getType() == 101)
+    const auto received = packetItem.getTiming().received;
+    if (m_decodeOptions.immediateOutput && received && m_clock)
     {
+        // When the packet started to arrive over USB, in os_gettime_ns(),
+        // with the same clock offset audio is stamped with
+        ts = static_cast<long long>(m_clock->toObsTime(received));
+    }
+
+    if (packetItem.getType() == PacketTypeVideo)
+    {
+        auto timing = packetItem.getTiming();
+        timing.decodeStarted = portal::monotonicNanoseconds();
+
         bool got_output{false};
-        const auto success = m_videoDecoder->decodeVideo(data, packet.size(), &ts,
-                                                         &m_videoFrame, &got_output);
+        const auto success = m_videoDecoder->decodeVideo(packet, &ts, &m_videoFrame, &got_output);
+
+        timing.decodeEnded = portal::monotonicNanoseconds();
+
+        if (!isCatchUp)
+        {
+            m_governor.recordDecode(timing.decodeEnded - timing.decodeStarted);
+        }
+
         if (!success)
         {
             blog(LOG_WARNING, "Error decoding video");
-            m_mutex.unlock();
             return;
         }
 
-        if (got_output && source)
+        if (got_output && m_outputs && showPicture)
+        {
+            m_videoFrame.timestamp = static_cast<uint64_t>(ts);
+
+            // Replayed pictures are long overdue and would only inflate the
+            // jitter buffer's delay
+            if (m_jitterBuffer && m_jitterBuffer->isEnabled() && !isCatchUp)
+            {
+                const auto frame = m_videoDecoder->referenceVideoFrame();
+                if (frame)
+                {
+                    m_jitterBuffer->push(frame, m_videoFrame, capturedHostTime ? m_videoFrame.timestamp : 0);
+                }
+            }
+            else
+            {
+                m_outputs->outputVideo(&m_videoFrame);
+            }
+
+            // With frame threading the picture output here may belong to an
+            // earlier packet; the timing is still that of the one just sent.
+            // Replayed packets would only skew the statistics.
+            if (!isCatchUp)
+            {
+                timing.output = portal::monotonicNanoseconds();
+                LatencyTracer::shared().record(LatencyTrack::Video, timing);
+            }
+        }
+
+        if (got_output && m_flushTime)
         {
-            m_videoFrame.timestamp = cur_time;
-            obs_source_output_video(source, &m_videoFrame);
+            blog(LOG_INFO, "First video frame %.1f ms after reconnecting",
+                 static_cast<double>(os_gettime_ns() - m_flushTime) / 1000000.0);
+            m_flushTime = 0;
         }
+
+        // OBS has copied the picture into its own frame cache by now, and
+        // the jitter buffer holds a reference of its own
+        m_videoDecoder->releaseVideoFrame();
     }
-    m_mutex.unlock();
 }
 
-void *FFMpegVideoDecoder::run()
+std::size_t FFMpegVideoDecoder::trimBacklog(const std::size_t count)
 {
-    while (!isStopped())
+    // Packets were rejected because the queue was full. Whatever reference
+    // frames were among them are gone, so nothing decodes cleanly until the
+    // next keyframe.
+    const auto droppedCount = m_queue.droppedCount();
+    if (droppedCount != m_lastDroppedCount)
+    {
+        blog(LOG_WARNING, "Video Decoding queue full, %zu packets lost. Waiting for the next keyframe.",
+             droppedCount - m_lastDroppedCount);
+
+        m_lastDroppedCount = droppedCount;
+        m_waitingForKeyframe = true;
+        m_governor.reportBacklog();
+    }
+
+    // The device's sequence numbers skipped frames it never sent, with the
+    // same consequence
+    const auto lostCount = m_lostCount.load();
+    if (lostCount != m_lastLostCount)
     {
-        auto item = static_cast<PacketItem *>(m_queue.remove());
-        if (item)
+        blog(LOG_WARNING, "%llu video frames lost on the device. Waiting for the next keyframe.",
+             static_cast<unsigned long long>(lostCount - m_lastLostCount));
+
+        m_lastLostCount = lostCount;
+        m_waitingForKeyframe = true;
+    }
+
+    const auto isOverloaded = (count > kBacklogThreshold);
+
+    // With immediate output only the newest picture is shown, so anything
+    // ahead of it that can be dropped, is
+    const auto isBacklogged = isOverloaded || (m_decodeOptions.immediateOutput && (count > 1));
+
+    // Find the newest keyframe; everything before it can be skipped
+    std::size_t keyframeIndex{count};
+    if (isBacklogged || m_waitingForKeyframe)
+    {
+        for (std::size_t i{count}; i > 0; --i)
         {
-            processPacketItem(item);
-            delete item;
+            if (m_items[i - 1].getFrameType() == H264FrameType::Keyframe)
+            {
+                keyframeIndex = i - 1;
+                break;
+            }
         }
+    }
 
-        // Check queue lengths
+    if (m_control)
+    {
+        m_control->reportLoad(isOverloaded);
 
-        const std::size_t queueSizeThreshold{25};
+        if (m_waitingForKeyframe && (keyframeIndex == count))
+        {
+            // Rather than wait out the rest of the GOP
+            m_control->requestKeyframe();
+        }
+    }
 
-        const auto queueSize = m_queue.size();
-        if (queueSize > queueSizeThreshold)
+    if (!isBacklogged && !m_waitingForKeyframe)
+    {
+        return count;
+    }
+
+    if (isOverloaded)
+    {
+        blog(LOG_WARNING, "Video Decoding queue overloaded. %zu frames behind. Please use a lower quality setting.", count);
+        m_governor.reportBacklog();
+    }
+
+    std::size_t kept{0};
+    for (std::size_t i{0}; i < count; ++i)
+    {
+        const auto frameType = m_items[i].getFrameType();
+
+        bool keep{false};
+        if (i >= keyframeIndex)
+        {
+            // From the newest keyframe on, drop only what nothing refers to
+            keep = !isBacklogged || (frameType != H264FrameType::NonReference) ||
+                   (m_decodeOptions.immediateOutput && (i + 1 == count));
+        }
+        else if (frameType == H264FrameType::Config)
+        {
+            // Parameter sets are always kept, the keyframe may need them
+            keep = true;
+        }
+        else if (keyframeIndex == count)
         {
-            blog(LOG_WARNING, "Video Decoding queue overloaded. %d frames behind. Please use a lower quality setting.", queueSize);
+            // No keyframe queued. Unless the stream is already broken, keep
+            // every picture that later pictures predict from.
+            keep = !m_waitingForKeyframe && ((frameType != H264FrameType::NonReference) ||
+                                             (m_decodeOptions.immediateOutput && (i + 1 == count)));
+        }
 
-            if (queueSize > queueSizeThreshold)
+        if (keep)
+        {
+            if (kept != i)
             {
-                while (m_queue.size() > 5)
+                m_items[kept] = std::move(m_items[i]);
+            }
+            ++kept;
+        }
+    }
+
+    if (keyframeIndex < count)
+    {
+        m_waitingForKeyframe = false;
+    }
+
+    // Release the dropped packets so their buffers can be recycled
+    for (auto i = kept; i < count; ++i)
+    {
+        m_items[i] = PacketItem{};
+    }
+
+    return kept;
+}
+
+bool FFMpegVideoDecoder::decodeTask_run(const std::size_t budget)
+{
+    processFlushRequest();
+
+    if (!m_decodingEnabled.load())
+    {
+        if (!m_suspended)
+        {
+            m_suspended = true;
+
+            // Whatever was being replayed, and whatever was already popped,
+            // still comes before what is queued
+            for (auto &item : m_catchUp)
+            {
+                cachePacketItem(std::move(item));
+            }
+            m_catchUp.clear();
+            m_catchUpIndex = 0;
+
+            for (; m_itemIndex < m_itemCount; ++m_itemIndex)
+            {
+                cachePacketItem(std::move(m_items[m_itemIndex]));
+                m_items[m_itemIndex] = PacketItem{};
+            }
+        }
+
+        const auto droppedCount = m_queue.droppedCount();
+        if (droppedCount != m_lastDroppedCount)
+        {
+            m_lastDroppedCount = droppedCount;
+            m_cachedGop.clear();
+            m_cachedGopTruncated = false;
+            m_skippedPictures = true;
+        }
+
+        const auto count = m_queue.pop(m_items.data(), m_items.size());
+        for (std::size_t i{0}; i < count; ++i)
+        {
+            cachePacketItem(std::move(m_items[i]));
+            m_items[i] = PacketItem{};
+        }
+
+        m_itemIndex = 0;
+        m_itemCount = 0;
+
+        return (m_queue.size() > 0);
+    }
+
+    if (m_suspended)
+    {
+        resume();
+    }
+
+    if (m_catchUpIndex < m_catchUp.size())
+    {
+        const auto end = std::min(m_catchUp.size(), m_catchUpIndex + budget);
+        for (; m_catchUpIndex < end; ++m_catchUpIndex)
+        {
+            // Show the keyframe at once, then only the newest picture
+            const auto &item = m_catchUp[m_catchUpIndex];
+            const auto showPicture = (item.getFrameType() == H264FrameType::Keyframe) ||
+                                     (m_catchUpIndex + 1 == m_catchUp.size());
+
+            processPacketItem(item, true, showPicture);
+        }
+
+        if (m_catchUpIndex == m_catchUp.size())
+        {
+            m_catchUp.clear();
+            m_catchUpIndex = 0;
+        }
+
+        return true;
+    }
+
+    // Take everything queued at once so the backlog can be judged as a
+    // whole, then decode it over as many slices as it takes
+    if (m_itemIndex == m_itemCount)
+    {
+        m_itemIndex = 0;
+        m_itemCount = trimBacklog(m_queue.pop(m_items.data(), m_items.size()));
+
+        // With immediate output, pictures a newer one already follows are
+        // decoded for reference but never shown
+        m_shownFromIndex = 0;
+        if (m_decodeOptions.immediateOutput)
+        {
+            for (auto i = m_itemCount; i > 0; --i)
+            {
+                if (m_items[i - 1].getFrameType() != H264FrameType::Config)
                 {
-                    m_queue.remove();
+                    m_shownFromIndex = i - 1;
+                    break;
                 }
             }
         }
     }
 
-    return nullptr;
+    const auto end = std::min(m_itemCount, m_itemIndex + budget);
+    for (; m_itemIndex < end; ++m_itemIndex)
+    {
+        processPacketItem(m_items[m_itemIndex], false, m_itemIndex >= m_shownFromIndex);
+
+        // Release the packet so its buffer can be recycled
+        m_items[m_itemIndex] = PacketItem{};
+    }
+
+    return (m_itemIndex < m_itemCount) || (m_queue.size() > 0);
 }
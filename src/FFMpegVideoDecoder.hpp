@@ -19,9 +19,15 @@ Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
 #include <chrono>
 
 #include "obs-iDevice-cam-source.hpp"
+#include "ClockRecovery.hpp"
+#include "Decoder.hpp"
+#include "DecodeGovernor.hpp"
+#include "DecodePool.hpp"
+#include "DeviceControl.hpp"
 #include "FFMpegDecode.hpp"
+#include "JitterBuffer.hpp"
 #include "Queue.hpp"
-#include "Thread.hpp"
+#include "SourceOutputs.hpp"
 
 class VideoDecoder final
 {
@@ -41,32 +47,121 @@ struct FFMpegVideoDecoderCallback
     virtual ~FFMpegVideoDecoderCallback() {}
 };
 
-class FFMpegVideoDecoder final : public VideoDecoder, private Thread
+class FFMpegVideoDecoder final : public Decoder, private DecodeTask
 {
 public:
-    FFMpegVideoDecoder();
+    FFMpegVideoDecoder() = default;
     ~FFMpegVideoDecoder();
 
     void init() override;
-    void input(const Packet packet, const int type, const int tag) override;
+    void input(const Packet &packet, const int type, const int tag) override;
+    void input(const portal::ProtocolPacketSpan &packets) override;
     void flush() override;
     void drain() override;
     void shutdown() override;
 
+    // Takes effect from the next keyframe; safe to call from any thread.
+    void setDecodeOptions(const DecodeOptions &options);
+
+    void setPriority(const DecodePriority priority) { m_strand.setPriority(priority); }
+
+    // While disabled, packets are still received but not decoded. Only the
+    // latest parameter sets and the GOP since the last keyframe are kept, so
+    // a picture can be shown as soon as decoding is enabled again. Safe to
+    // call from any thread.
+    void setDecodingEnabled(const bool enabled);
+
+    // How much of the stream is decoded under the current load, and why
+    const DecodeGovernor &governor() const noexcept { return m_governor; }
+
     // Public data members
 
-    obs_source_t*           m_source{nullptr};
+    // Every source showing the device
+    SourceOutputs*          m_outputs{nullptr};
+
+    // Timestamps frames by capture time when set and the device sends it
+    ClockRecovery*          m_clock{nullptr};
+
+    // Paces video when set and enabled
+    JitterBuffer*           m_jitterBuffer{nullptr};
+
+    // Asks the device for keyframes and lower quality when set
+    DeviceControl*          m_control{nullptr};
 
 private:
     // Data members
 
-    WorkQueue<PacketItem*>  m_queue{};
+    static constexpr std::size_t kQueueCapacity{64};
+
+    // More than this many packets waiting at once means decoding has fallen
+    // behind by several frame intervals.
+    static constexpr std::size_t kBacklogThreshold{8};
+
+    // Longest GOP replayed when decoding resumes. Past that, catching up
+    // would take longer than waiting for the next keyframe.
+    static constexpr std::size_t kMaxCachedFrames{32};
+
+    SPSCQueue<PacketItem>   m_queue{kQueueCapacity, OverflowPolicy::DropNewest};
+    std::vector<PacketItem> m_batch{};      // Producer side scratch
+    std::atomic<uint64_t>   m_lostCount{0}; // Skipped by the device's sequence
+    std::vector<PacketItem> m_items{};      // Consumer side scratch
+    std::size_t             m_itemCount{0};
+    std::size_t             m_itemIndex{0}; // Next of m_items to decode
+    std::size_t             m_shownFromIndex{0};
     obs_source_frame        m_videoFrame{};
     VideoDecoder            m_videoDecoder{};
+
+    // Backlog state, only touched by the decoding strand
+    std::size_t             m_lastDroppedCount{0};
+    uint64_t                m_lastLostCount{0};
+    bool                    m_waitingForKeyframe{false};
+
+    // Degradation under load, only touched by the decoding strand
+    DecodeGovernor          m_governor{};
+    DecodeLevel             m_appliedLevel{DecodeLevel::Full};
+    bool                    m_skipToKeyframe{false};    // References were skipped
+
+    // Paused decoding state, only touched by the decoding strand
+    std::atomic_bool        m_decodingEnabled{true};
+    bool                    m_suspended{false};
+    bool                    m_skippedPictures{false};   // Some weren't cached
+    bool                    m_cachedGopTruncated{false};
+    bool                    m_cachedConfigComplete{false}; // A picture followed
+    std::vector<PacketItem> m_cachedConfig{};
+    std::vector<PacketItem> m_cachedGop{};              // Keyframe first
+    std::vector<PacketItem> m_catchUp{};                // Replayed on resume
+    std::size_t             m_catchUpIndex{0};
+
+    // flush() hands the work to the decoding strand, which is the only one
+    // allowed to consume from m_queue or touch m_videoDecoder.
     std::mutex              m_mutex{};
+    std::condition_variable m_flushCv{};
+    bool                    m_flushRequested{false};
+    bool                    m_stopped{false};
+    DecodeOptions           m_requestedOptions{};
+
+    // Options the current decoder was opened with
+    DecodeOptions           m_decodeOptions{};
+
+    // SPS the current decoder was fed. A different one means a new stream
+    // configuration, which gets a freshly opened decoder.
+    std::vector<uint8_t>    m_spsData{};
+
+    // When the last flush happened, until the first frame after it is output
+    uint64_t                m_flushTime{0};
+
+    // Declared last so it is stopped before anything it uses goes away
+    DecodeStrand            m_strand{this};
 
     // Utility functions
 
-    void *run() override;
-    void processPacketItem(PacketItem *packetItem);
+    bool decodeTask_run(const std::size_t budget) override;
+    void processPacketItem(const PacketItem &packetItem, const bool isCatchUp = false, const bool showPicture = true);
+    void processFlushRequest();
+    void applyDecodeLevel();
+    void cachePacketItem(PacketItem &&packetItem);
+    void clearCache();
+    void resume();
+    void processParameterSets(const Packet &packet);
+    std::size_t trimBacklog(const std::size_t count);
 };
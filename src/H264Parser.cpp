@@ -0,0 +1,292 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include "H264Parser.hpp"
+
+namespace
+{
+    // Reads the bits of a NAL unit's payload, leaving out the emulation
+    // prevention bytes. Reading past the end yields zeros and sets
+    // isOverrun().
+    class RbspReader final
+    {
+    public:
+        RbspReader(const uint8_t *data, const std::size_t size) noexcept
+            :
+            m_data{data},
+            m_size{size}
+        {
+        }
+
+        uint32_t bit() noexcept
+        {
+            if (m_bitsLeft == 0)
+            {
+                if (!loadByte())
+                {
+                    m_isOverrun = true;
+                    return 0;
+                }
+            }
+
+            --m_bitsLeft;
+            return (m_byte >> m_bitsLeft) & 1;
+        }
+
+        uint32_t bits(const int count) noexcept
+        {
+            uint32_t value{0};
+            for (int i{0}; i < count; ++i)
+            {
+                value = (value << 1) | bit();
+            }
+
+            return value;
+        }
+
+        // Exp-Golomb coded unsigned value
+        uint32_t ue() noexcept
+        {
+            int leadingZeros{0};
+            while ((bit() == 0) && !m_isOverrun && (leadingZeros < 31))
+            {
+                ++leadingZeros;
+            }
+
+            return ((1u << leadingZeros) - 1) + bits(leadingZeros);
+        }
+
+        int32_t se() noexcept
+        {
+            const auto value = ue();
+            return (value & 1) ? static_cast<int32_t>((value + 1) / 2) : -static_cast<int32_t>(value / 2);
+        }
+
+        bool isOverrun() const noexcept { return m_isOverrun; }
+
+    private:
+        bool loadByte() noexcept
+        {
+            if (m_offset >= m_size)
+            {
+                return false;
+            }
+
+            auto byte = m_data[m_offset++];
+            if ((m_zeroCount >= 2) && (byte == 3))
+            {
+                m_zeroCount = 0;
+
+                if (m_offset >= m_size)
+                {
+                    return false;
+                }
+
+                byte = m_data[m_offset++];
+            }
+
+            m_zeroCount = (byte == 0) ? m_zeroCount + 1 : 0;
+            m_byte = byte;
+            m_bitsLeft = 8;
+
+            return true;
+        }
+
+        const uint8_t*  m_data{nullptr};
+        std::size_t     m_size{0};
+        std::size_t     m_offset{0};
+        int             m_zeroCount{0};
+        uint8_t         m_byte{0};
+        int             m_bitsLeft{0};
+        bool            m_isOverrun{false};
+    };
+
+    void skipScalingList(RbspReader &reader, const int size) noexcept
+    {
+        int32_t last{8};
+        int32_t next{8};
+
+        for (int i{0}; i < size; ++i)
+        {
+            if (next != 0)
+            {
+                next = (last + reader.se() + 256) % 256;
+            }
+
+            last = (next == 0) ? last : next;
+        }
+    }
+
+    bool hasChromaFormat(const uint32_t profile) noexcept
+    {
+        switch (profile)
+        {
+        case 44: case 83: case 86: case 100: case 110: case 118:
+        case 122: case 128: case 134: case 135: case 138: case 139: case 244:
+            return true;
+
+        default:
+            return false;
+        }
+    }
+}
+
+H264FrameType classifyH264Packet(const uint8_t *data, const std::size_t size) noexcept
+{
+    auto frameType = H264FrameType::Unknown;
+
+    forEachH264Nal(data, size, [&](const uint8_t *nal, const std::size_t nalSize) {
+        if (nalSize == 0)
+        {
+            return true;
+        }
+
+        const auto nalRefIdc = (nal[0] >> 5) & 0x3;
+        const auto nalUnitType = nal[0] & 0x1F;
+
+        switch (nalUnitType)
+        {
+        case NalUnitTypeIdrSlice:
+            frameType = H264FrameType::Keyframe;
+            return false;
+
+        case NalUnitTypeSlice:
+            frameType = (nalRefIdc != 0) ? H264FrameType::Reference : H264FrameType::NonReference;
+            return false;
+
+        case NalUnitTypeSps:
+        case NalUnitTypePps:
+            frameType = H264FrameType::Config;
+            return true;
+
+        default:
+            return true;
+        }
+    });
+
+    return frameType;
+}
+
+bool parseH264Sps(const uint8_t *nal, const std::size_t size, H264SpsInfo &info) noexcept
+{
+    if ((size < 4) || ((nal[0] & 0x1F) != NalUnitTypeSps))
+    {
+        return false;
+    }
+
+    info.profile = nal[1];
+    info.constraints = nal[2];
+    info.level = nal[3];
+
+    RbspReader reader{nal + 4, size - 4};
+
+    reader.ue(); // seq_parameter_set_id
+
+    info.chromaFormat = 1;
+    info.bitDepthLuma = 8;
+    info.bitDepthChroma = 8;
+
+    auto hasSeparateColourPlanes = false;
+
+    if (hasChromaFormat(info.profile))
+    {
+        info.chromaFormat = reader.ue();
+        if (info.chromaFormat == 3)
+        {
+            hasSeparateColourPlanes = (reader.bit() != 0);
+        }
+
+        info.bitDepthLuma = reader.ue() + 8;
+        info.bitDepthChroma = reader.ue() + 8;
+        reader.bit(); // qpprime_y_zero_transform_bypass_flag
+
+        if (reader.bit()) // seq_scaling_matrix_present_flag
+        {
+            const auto listCount = (info.chromaFormat != 3) ? 8 : 12;
+            for (int i{0}; i < listCount; ++i)
+            {
+                if (reader.bit())
+                {
+                    skipScalingList(reader, (i < 6) ? 16 : 64);
+                }
+            }
+        }
+    }
+
+    reader.ue(); // log2_max_frame_num_minus4
+
+    const auto pictureOrderCountType = reader.ue();
+    if (pictureOrderCountType == 0)
+    {
+        reader.ue(); // log2_max_pic_order_cnt_lsb_minus4
+    }
+    else if (pictureOrderCountType == 1)
+    {
+        reader.bit();
+        reader.se();
+        reader.se();
+
+        const auto cycleLength = reader.ue();
+        for (uint32_t i{0}; (i < cycleLength) && !reader.isOverrun(); ++i)
+        {
+            reader.se();
+        }
+    }
+
+    reader.ue(); // max_num_ref_frames
+    reader.bit(); // gaps_in_frame_num_value_allowed_flag
+
+    const auto widthInMacroblocks = reader.ue() + 1;
+    const auto heightInMapUnits = reader.ue() + 1;
+    const auto isFrameMacroblocksOnly = (reader.bit() != 0);
+
+    if (!isFrameMacroblocksOnly)
+    {
+        reader.bit(); // mb_adaptive_frame_field_flag
+    }
+
+    reader.bit(); // direct_8x8_inference_flag
+
+    uint32_t cropLeft{0};
+    uint32_t cropRight{0};
+    uint32_t cropTop{0};
+    uint32_t cropBottom{0};
+
+    if (reader.bit()) // frame_cropping_flag
+    {
+        cropLeft = reader.ue();
+        cropRight = reader.ue();
+        cropTop = reader.ue();
+        cropBottom = reader.ue();
+    }
+
+    if (reader.isOverrun())
+    {
+        return false;
+    }
+
+    // Cropping is in chroma samples, and in field pairs for interlaced video
+    const auto isMonochrome = (info.chromaFormat == 0) || hasSeparateColourPlanes;
+    const auto cropUnitX = isMonochrome ? 1 : ((info.chromaFormat == 3) ? 1 : 2);
+    const auto cropUnitY = (isMonochrome ? 1 : ((info.chromaFormat == 1) ? 2 : 1)) * (isFrameMacroblocksOnly ? 1 : 2);
+
+    info.width = widthInMacroblocks * 16 - cropUnitX * (cropLeft + cropRight);
+    info.height = heightInMapUnits * 16 * (isFrameMacroblocksOnly ? 1 : 2) - cropUnitY * (cropTop + cropBottom);
+
+    return true;
+}
@@ -0,0 +1,118 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef H264Parser_hpp
+#define H264Parser_hpp
+
+#include <cstddef>
+#include <cstdint>
+
+enum H264NalUnitType
+{
+    NalUnitTypeSlice = 1,
+    NalUnitTypeIdrSlice = 5,
+    NalUnitTypeSps = 7,
+    NalUnitTypePps = 8,
+    NalUnitTypeAccessUnitDelimiter = 9
+};
+
+// How much a video packet matters to the pictures decoded after it.
+enum class H264FrameType
+{
+    Unknown,
+
+    // SPS/PPS only. Tiny, and nothing decodes without them.
+    Config,
+
+    // Contains an IDR slice; decoding can (re)start here.
+    Keyframe,
+
+    // Non-IDR slice with nal_ref_idc != 0. Later pictures predict from it,
+    // so dropping it corrupts the picture until the next keyframe.
+    Reference,
+
+    // Non-IDR slice with nal_ref_idc == 0. Safe to drop.
+    NonReference
+};
+
+// Classifies an Annex B packet (one or more start code prefixed NAL units)
+// by the most important NAL unit it contains.
+H264FrameType classifyH264Packet(const uint8_t *data, const std::size_t size) noexcept;
+
+// What a container needs to know about a sequence parameter set
+struct H264SpsInfo
+{
+    uint8_t profile{0};
+    uint8_t constraints{0};
+    uint8_t level{0};
+    uint32_t chromaFormat{1};
+    uint32_t bitDepthLuma{8};
+    uint32_t bitDepthChroma{8};
+
+    // Displayed size, after cropping
+    uint32_t width{0};
+    uint32_t height{0};
+};
+
+// Parses an SPS NAL unit, header byte included. Returns false if it isn't
+// one or is cut short.
+bool parseH264Sps(const uint8_t *nal, const std::size_t size, H264SpsInfo &info) noexcept;
+
+// Calls onNal(nal, nalSize) for each NAL unit in an Annex B buffer, with the
+// start code stripped. Stops early if onNal returns false.
+template <typename Callback>
+void forEachH264Nal(const uint8_t *data, const std::size_t size, Callback onNal)
+{
+    const uint8_t *nal{nullptr};
+
+    std::size_t i{0};
+    while (i + 3 <= size)
+    {
+        if ((data[i] == 0) && (data[i + 1] == 0) && (data[i + 2] == 1))
+        {
+            if (nal)
+            {
+                // Trailing zero belongs to a 4 byte start code
+                auto end = data + i;
+                if ((end > nal) && (end[-1] == 0))
+                {
+                    --end;
+                }
+
+                if (!onNal(nal, static_cast<std::size_t>(end - nal)))
+                {
+                    return;
+                }
+            }
+
+            i += 3;
+            nal = data + i;
+        }
+        else
+        {
+            ++i;
+        }
+    }
+
+    if (nal && (nal < data + size))
+    {
+        onNal(nal, static_cast<std::size_t>(data + size - nal));
+    }
+}
+
+#endif // H264Parser_hpp
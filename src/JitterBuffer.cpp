@@ -0,0 +1,209 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#ifdef _MSC_VER
+#pragma warning(push)
+#pragma warning(disable : 4244)
+#pragma warning(disable : 4204)
+#endif
+
+#include <libavcodec/avcodec.h>
+
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
+
+#include <algorithm>
+#include <chrono>
+
+#include <util/platform.h>
+
+#include "JitterBuffer.hpp"
+
+JitterBuffer::~JitterBuffer()
+{
+    setEnabled(false);
+}
+
+void JitterBuffer::setEnabled(const bool enabled)
+{
+    if (enabled == m_isEnabled.load())
+    {
+        return;
+    }
+
+    if (enabled)
+    {
+        {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            m_shouldStop = false;
+            m_isEnabled = true;
+        }
+
+        m_thread = std::thread(&JitterBuffer::run, this);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        m_isEnabled = false;
+        m_shouldStop = true;
+        m_cv.notify_all();
+    }
+
+    if (m_thread.joinable())
+    {
+        m_thread.join();
+    }
+
+    std::lock_guard<std::mutex> lock{m_mutex};
+    clearLocked();
+}
+
+void JitterBuffer::push(AVFrame *frame, const obs_source_frame &info, const uint64_t mediaTime)
+{
+    const auto now = os_gettime_ns();
+
+    std::unique_lock<std::mutex> lock{m_mutex};
+
+    if (!m_isEnabled.load())
+    {
+        // Disabled since the decoder checked, pass it straight through
+        lock.unlock();
+        m_outputs->outputVideo(&info);
+        av_frame_free(&frame);
+        return;
+    }
+
+    const auto media = mediaTime ? mediaTime : smoothedMediaTime(now);
+
+    m_delays[m_nextDelay] = static_cast<int64_t>(now - media);
+    m_nextDelay = (m_nextDelay + 1) % kWindowSize;
+    m_delayCount = std::min(m_delayCount + 1, kWindowSize);
+
+    const auto [minimum, maximum] = std::minmax_element(m_delays.begin(), m_delays.begin() + m_delayCount);
+    const auto target = std::max<int64_t>(std::min(*maximum + kMargin, *minimum + kMaxDepth), 0);
+
+    // Grow at once, but shrink by a little per picture so the pictures
+    // around the change are still output evenly spaced
+    const auto delay = std::max(target, static_cast<int64_t>(m_delay.load()) - kMaxShrink);
+
+    m_delay = static_cast<uint64_t>(delay);
+    m_depth = static_cast<uint64_t>(std::max<int64_t>(delay - *minimum, 0));
+
+    // A picture must never be due before the one ahead of it
+    const auto dueTime = std::max(media + static_cast<uint64_t>(delay), m_lastDueTime);
+    m_lastDueTime = dueTime;
+
+    if (m_frames.size() >= kMaxFrames)
+    {
+        av_frame_free(&m_frames.front().frame);
+        m_frames.pop_front();
+    }
+
+    Entry entry{frame, info, dueTime};
+    entry.info.timestamp = dueTime;
+    m_frames.push_back(entry);
+
+    m_cv.notify_one();
+}
+
+void JitterBuffer::clear()
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+    clearLocked();
+}
+
+void JitterBuffer::clearLocked()
+{
+    for (auto &entry : m_frames)
+    {
+        av_frame_free(&entry.frame);
+    }
+    m_frames.clear();
+
+    m_delayCount = 0;
+    m_nextDelay = 0;
+    m_lastDueTime = 0;
+
+    m_lastArrival = 0;
+    m_lastMediaTime = 0;
+    m_frameInterval = 0.0;
+
+    m_delay = 0;
+    m_depth = 0;
+}
+
+uint64_t JitterBuffer::smoothedMediaTime(const uint64_t now)
+{
+    constexpr uint64_t kMaxGap{1000000000};
+
+    if (!m_lastArrival || (now - m_lastArrival > kMaxGap))
+    {
+        m_lastArrival = now;
+        m_lastMediaTime = now;
+        m_frameInterval = 0.0;
+        return now;
+    }
+
+    const auto interval = static_cast<double>(now - m_lastArrival);
+    m_lastArrival = now;
+
+    m_frameInterval = (m_frameInterval > 0.0) ? (m_frameInterval + (interval - m_frameInterval) / 16.0) : interval;
+
+    // Advance by the average interval, pulled slightly towards the actual
+    // arrival so the clock can't wander off
+    auto media = static_cast<int64_t>(m_lastMediaTime + static_cast<uint64_t>(m_frameInterval));
+    media += (static_cast<int64_t>(now) - media) / 32;
+
+    m_lastMediaTime = static_cast<uint64_t>(media);
+    return m_lastMediaTime;
+}
+
+void JitterBuffer::run()
+{
+    std::unique_lock<std::mutex> lock{m_mutex};
+
+    while (!m_shouldStop)
+    {
+        if (m_frames.empty())
+        {
+            m_cv.wait(lock);
+            continue;
+        }
+
+        const auto now = os_gettime_ns();
+        const auto dueTime = m_frames.front().dueTime;
+        if (dueTime > now)
+        {
+            m_cv.wait_for(lock, std::chrono::nanoseconds(dueTime - now));
+            continue;
+        }
+
+        auto entry = m_frames.front();
+        m_frames.pop_front();
+
+        lock.unlock();
+
+        m_outputs->outputVideo(&entry.info);
+        av_frame_free(&entry.frame);
+
+        lock.lock();
+    }
+}
@@ -0,0 +1,121 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#ifndef JitterBuffer_hpp
+#define JitterBuffer_hpp
+
+#include <obs.h>
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "SourceOutputs.hpp"
+
+struct AVFrame;
+
+// Holds decoded pictures back just long enough to hand them to OBS evenly
+// spaced, in place of OBS's own fixed async buffering.
+//
+// Each picture is due at its media time plus a target delay. The delay is
+// the longest one measured from media time to the end of decoding over the
+// last few seconds, so it grows at once when frames start arriving late and
+// shrinks by at most kMaxShrink per picture once they no longer do. A pacing
+// thread outputs pictures as they become due.
+//
+// Media time is the capture time when the device sends it. Otherwise it is
+// a smoothed clock following the arrival of pictures, which at least evens
+// out the bursts.
+class JitterBuffer final
+{
+public:
+    JitterBuffer() = default;
+    ~JitterBuffer();
+
+    JitterBuffer(const JitterBuffer &other) = delete;
+    JitterBuffer &operator=(const JitterBuffer &other) = delete;
+
+    // Starts or stops the pacing thread. Pictures still held when disabled
+    // are dropped.
+    void setEnabled(const bool enabled);
+    bool isEnabled() const noexcept { return m_isEnabled.load(); }
+
+    // Takes ownership of frame, which info's planes point into. mediaTime is
+    // in os_gettime_ns(), zero if the picture has no capture time.
+    void push(AVFrame *frame, const obs_source_frame &info, const uint64_t mediaTime);
+
+    // Drops everything held, e.g. when the stream restarts
+    void clear();
+
+    // How far behind media time pictures are output, in nanoseconds. Audio
+    // timestamps add this to stay in sync.
+    uint64_t delay() const noexcept { return m_delay.load(); }
+
+    // How much of that is buffering to absorb jitter, in nanoseconds
+    uint64_t depth() const noexcept { return m_depth.load(); }
+
+    // Public data members
+
+    SourceOutputs*          m_outputs{nullptr};
+
+private:
+    static constexpr std::size_t kWindowSize{300};          // ~5s at 60fps
+    static constexpr std::size_t kMaxFrames{32};
+    static constexpr int64_t kMaxDepth{500000000};
+    static constexpr int64_t kMargin{2000000};
+    static constexpr int64_t kMaxShrink{500000};            // 30ms/s at 60fps
+
+    struct Entry
+    {
+        AVFrame *frame{nullptr};
+        obs_source_frame info{};
+        uint64_t dueTime{0};
+    };
+
+    void run();
+    uint64_t smoothedMediaTime(const uint64_t now);
+    void clearLocked();
+
+    std::mutex              m_mutex{};
+    std::condition_variable m_cv{};
+    std::deque<Entry>       m_frames{};
+    std::thread             m_thread{};
+    std::atomic_bool        m_isEnabled{false};
+    bool                    m_shouldStop{false};
+
+    // Delay of each of the last kWindowSize pictures
+    std::array<int64_t, kWindowSize> m_delays{};
+    std::size_t             m_delayCount{0};
+    std::size_t             m_nextDelay{0};
+    uint64_t                m_lastDueTime{0};
+
+    // Media clock for pictures without a capture time
+    uint64_t                m_lastArrival{0};
+    uint64_t                m_lastMediaTime{0};
+    double                  m_frameInterval{0.0};
+
+    std::atomic<uint64_t>   m_delay{0};
+    std::atomic<uint64_t>   m_depth{0};
+};
+
+#endif /* JitterBuffer_hpp */
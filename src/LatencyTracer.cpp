@@ -0,0 +1,357 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include "LatencyTracer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <obs.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace
+{
+    const char *const kTrackNames[] = {"video", "audio"};
+    const char *const kStageNames[] = {"transfer", "dispatch", "queue", "decode", "output", "total"};
+
+    inline std::size_t mostSignificantBit(const uint64_t value) noexcept
+    {
+#ifdef _MSC_VER
+        unsigned long index{0};
+        _BitScanReverse64(&index, value);
+        return index;
+#else
+        return 63 - static_cast<std::size_t>(__builtin_clzll(value));
+#endif
+    }
+
+    inline double milliseconds(const uint64_t nanoseconds) noexcept
+    {
+        return static_cast<double>(nanoseconds) / 1000000.0;
+    }
+
+    inline std::size_t traceThreadId(const std::size_t track, const std::size_t stage) noexcept
+    {
+        return (track + 1) * 10 + stage;
+    }
+
+    inline uint64_t interval(const uint64_t from, const uint64_t to) noexcept
+    {
+        return (from && to && (to > from)) ? (to - from) : 0;
+    }
+}
+
+std::size_t LatencyHistogram::bucketIndex(const uint64_t duration) noexcept
+{
+    constexpr uint64_t kLinearLimit{1 << kSubBucketBits};
+    if (duration < kLinearLimit)
+    {
+        return static_cast<std::size_t>(duration);
+    }
+
+    const auto msb = mostSignificantBit(duration);
+    const auto subBucket = (duration >> (msb - kSubBucketBits)) & (kLinearLimit - 1);
+
+    return ((msb - kSubBucketBits + 1) << kSubBucketBits) + static_cast<std::size_t>(subBucket);
+}
+
+uint64_t LatencyHistogram::bucketValue(const std::size_t index) noexcept
+{
+    constexpr std::size_t kLinearLimit{1 << kSubBucketBits};
+    if (index < kLinearLimit)
+    {
+        return index;
+    }
+
+    const auto shift = (index >> kSubBucketBits) - 1;
+    const auto lower = static_cast<uint64_t>(kLinearLimit + (index & (kLinearLimit - 1))) << shift;
+
+    // Middle of the bucket
+    return lower + ((uint64_t{1} << shift) >> 1);
+}
+
+void LatencyHistogram::add(const uint64_t duration) noexcept
+{
+    m_buckets[bucketIndex(duration)].fetch_add(1, std::memory_order_relaxed);
+
+    auto max = m_max.load(std::memory_order_relaxed);
+    while ((duration > max) && !m_max.compare_exchange_weak(max, duration, std::memory_order_relaxed))
+    {
+    }
+}
+
+LatencyHistogram::Summary LatencyHistogram::takeSummary() noexcept
+{
+    std::array<uint64_t, kBucketCount> counts{};
+
+    Summary summary{};
+    for (std::size_t i{0}; i < kBucketCount; ++i)
+    {
+        counts[i] = m_buckets[i].exchange(0, std::memory_order_relaxed);
+        summary.count += counts[i];
+    }
+
+    summary.max = m_max.exchange(0, std::memory_order_relaxed);
+
+    if (summary.count == 0)
+    {
+        return summary;
+    }
+
+    const auto p50Rank = (summary.count * 50 + 99) / 100;
+    const auto p99Rank = (summary.count * 99 + 99) / 100;
+
+    uint64_t seen{0};
+    for (std::size_t i{0}; i < kBucketCount; ++i)
+    {
+        const auto previous = seen;
+        seen += counts[i];
+
+        if ((previous < p50Rank) && (seen >= p50Rank))
+        {
+            summary.p50 = bucketValue(i);
+        }
+
+        if ((previous < p99Rank) && (seen >= p99Rank))
+        {
+            summary.p99 = bucketValue(i);
+            break;
+        }
+    }
+
+    // A bucket's midpoint can overshoot the largest sample in it
+    summary.p50 = std::min(summary.p50, summary.max);
+    summary.p99 = std::min(summary.p99, summary.max);
+
+    return summary;
+}
+
+LatencyTracer &LatencyTracer::shared()
+{
+    // Intentionally leaked, decoding threads may still record during exit
+    static auto tracer = new LatencyTracer();
+    return *tracer;
+}
+
+LatencyTracer::LatencyTracer()
+{
+    const auto stats = std::getenv("IOS_CAMERA_LATENCY_STATS");
+    const auto tracePath = std::getenv("IOS_CAMERA_LATENCY_TRACE");
+
+    m_logStatistics = (stats && (std::strcmp(stats, "0") != 0)) || (tracePath && *tracePath);
+    m_enabled = m_logStatistics;
+
+    if (tracePath && *tracePath)
+    {
+        m_traceFile = std::fopen(tracePath, "w");
+        if (m_traceFile)
+        {
+            // JSON array format; the closing bracket is optional, so the file
+            // stays loadable even if OBS never gets to shutdown().
+            std::fputs("[\n", m_traceFile);
+
+            for (std::size_t track{0}; track < kTrackCount; ++track)
+            {
+                for (std::size_t stage{0}; stage + 1 < kStageCount; ++stage)
+                {
+                    std::fprintf(m_traceFile,
+                                 "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,"
+                                 "\"args\":{\"name\":\"%s %s\"}},\n",
+                                 traceThreadId(track, stage), kTrackNames[track], kStageNames[stage]);
+                }
+            }
+
+            m_tracing = true;
+            m_pendingTraceEvents.reserve(kMaxPendingTraceEvents);
+            m_writingTraceEvents.reserve(kMaxPendingTraceEvents);
+
+            blog(LOG_INFO, "Writing latency trace to %s", tracePath);
+        }
+        else
+        {
+            blog(LOG_WARNING, "Could not open latency trace file %s", tracePath);
+        }
+    }
+
+    if (m_logStatistics)
+    {
+        m_reportThread = std::thread(&LatencyTracer::run, this);
+    }
+}
+
+void LatencyTracer::record(const LatencyTrack track, const FrameTiming &timing) noexcept
+{
+    if (!m_enabled.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+
+    const uint64_t durations[kStageCount] = {
+        interval(timing.received, timing.parsed),
+        interval(timing.parsed, timing.enqueued),
+        interval(timing.enqueued, timing.decodeStarted),
+        interval(timing.decodeStarted, timing.decodeEnded),
+        interval(timing.decodeEnded, timing.output),
+        interval(timing.received, timing.output)
+    };
+
+    auto &histograms = m_histograms[static_cast<std::size_t>(track)];
+    for (std::size_t i{0}; i < kStageCount; ++i)
+    {
+        histograms[i].add(durations[i]);
+    }
+
+    if (m_tracing.load(std::memory_order_relaxed))
+    {
+        std::lock_guard<std::mutex> lock{m_traceMutex};
+
+        // Drop events rather than allocate if the writer can't keep up
+        if (m_pendingTraceEvents.size() < kMaxPendingTraceEvents)
+        {
+            m_pendingTraceEvents.push_back(TraceEvent{track, timing});
+        }
+    }
+}
+
+void LatencyTracer::run()
+{
+    std::unique_lock<std::mutex> lock{m_reportMutex};
+
+    while (!m_shouldStop)
+    {
+        m_reportCv.wait_for(lock, std::chrono::nanoseconds(kReportInterval), [this] { return m_shouldStop; });
+        if (m_shouldStop)
+        {
+            break;
+        }
+
+        lock.unlock();
+        report();
+        lock.lock();
+    }
+}
+
+void LatencyTracer::report() noexcept
+{
+    for (std::size_t track{0}; track < kTrackCount; ++track)
+    {
+        char line[512];
+        int length{0};
+        uint64_t count{0};
+
+        for (std::size_t stage{0}; stage < kStageCount; ++stage)
+        {
+            const auto summary = m_histograms[track][stage].takeSummary();
+            count = std::max(count, summary.count);
+
+            if (length < static_cast<int>(sizeof(line)))
+            {
+                length += std::snprintf(line + length, sizeof(line) - length, " | %s %.2f/%.2f/%.2f",
+                                        kStageNames[stage], milliseconds(summary.p50),
+                                        milliseconds(summary.p99), milliseconds(summary.max));
+            }
+        }
+
+        if (count > 0)
+        {
+            blog(LOG_INFO, "Latency %s (%llu packets, p50/p99/max ms)%s", kTrackNames[track],
+                 static_cast<unsigned long long>(count), line);
+        }
+    }
+
+    if (m_tracing.load(std::memory_order_relaxed))
+    {
+        takeTraceEvents();
+        writeTraceEvents(m_writingTraceEvents);
+    }
+}
+
+void LatencyTracer::takeTraceEvents() noexcept
+{
+    std::lock_guard<std::mutex> lock{m_traceMutex};
+    m_writingTraceEvents.swap(m_pendingTraceEvents);
+}
+
+void LatencyTracer::writeTraceEvents(std::vector<TraceEvent> &events) noexcept
+{
+    if (!m_traceFile)
+    {
+        events.clear();
+        return;
+    }
+
+    for (const auto &event : events)
+    {
+        const auto &timing = event.timing;
+        const uint64_t stamps[] = {timing.received, timing.parsed, timing.enqueued,
+                                   timing.decodeStarted, timing.decodeEnded, timing.output};
+
+        const auto track = static_cast<std::size_t>(event.track);
+
+        // One trace "thread" per stage keeps the overlapping packets of a
+        // stage from having to nest
+        for (std::size_t stage{0}; stage + 1 < kStageCount; ++stage)
+        {
+            if (!stamps[stage] || !stamps[stage + 1])
+            {
+                continue;
+            }
+
+            std::fprintf(m_traceFile,
+                         "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,"
+                         "\"ts\":%.3f,\"dur\":%.3f},\n",
+                         kStageNames[stage], kTrackNames[track], traceThreadId(track, stage),
+                         static_cast<double>(stamps[stage]) / 1000.0,
+                         static_cast<double>(interval(stamps[stage], stamps[stage + 1])) / 1000.0);
+        }
+    }
+
+    std::fflush(m_traceFile);
+    events.clear();
+}
+
+void LatencyTracer::shutdown() noexcept
+{
+    {
+        std::lock_guard<std::mutex> lock{m_reportMutex};
+        m_shouldStop = true;
+    }
+
+    m_reportCv.notify_all();
+
+    if (m_reportThread.joinable())
+    {
+        m_reportThread.join();
+    }
+
+    if (!m_tracing.exchange(false))
+    {
+        return;
+    }
+
+    takeTraceEvents();
+    writeTraceEvents(m_writingTraceEvents);
+
+    std::fputs("{}]\n", m_traceFile);
+    std::fclose(m_traceFile);
+    m_traceFile = nullptr;
+}
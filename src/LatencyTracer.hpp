@@ -0,0 +1,185 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef LatencyTracer_hpp
+#define LatencyTracer_hpp
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Protocol.hpp"
+
+// Where a packet was at each step on its way from the USB read to OBS, in
+// portal::monotonicNanoseconds(). Zero means the step hasn't happened.
+struct FrameTiming final
+{
+    uint64_t received{0};
+    uint64_t parsed{0};
+    uint64_t enqueued{0};
+    uint64_t decodeStarted{0};
+    uint64_t decodeEnded{0};
+    uint64_t output{0};
+
+    // Capture time on the device's clock, zero if the device doesn't send it
+    uint64_t captured{0};
+
+    FrameTiming() = default;
+    explicit FrameTiming(const portal::PacketTiming &timing) noexcept
+        :
+        received{timing.received},
+        parsed{timing.parsed},
+        captured{timing.captured}
+    {
+    }
+};
+
+enum class LatencyTrack
+{
+    Video,
+    Audio,
+    Count
+};
+
+// The interval between two consecutive FrameTiming stamps
+enum class LatencyStage
+{
+    Transfer,   // received -> parsed: USB transfer of the frame
+    Dispatch,   // parsed -> enqueued: delegate chain up to the decoder queue
+    Queue,      // enqueued -> decodeStarted: waiting for the decoding thread
+    Decode,     // decodeStarted -> decodeEnded
+    Output,     // decodeEnded -> output: handing the frame to OBS
+    Total,      // received -> output
+    Count
+};
+
+// Log-linear histogram of durations in nanoseconds. Each power of two is
+// split into four buckets, so percentiles are accurate to within 25%.
+// Recording is a few relaxed atomic operations and never blocks.
+class LatencyHistogram final
+{
+public:
+    struct Summary
+    {
+        uint64_t count{0};
+        uint64_t p50{0};
+        uint64_t p99{0};
+        uint64_t max{0};
+    };
+
+    LatencyHistogram() = default;
+
+    LatencyHistogram(const LatencyHistogram &other) = delete;
+    LatencyHistogram &operator=(const LatencyHistogram &other) = delete;
+
+    void add(const uint64_t duration) noexcept;
+
+    // Summarizes what was recorded since the last call and starts over.
+    // Samples recorded concurrently may land in either period.
+    Summary takeSummary() noexcept;
+
+private:
+    static constexpr std::size_t kSubBucketBits{2};
+    static constexpr std::size_t kBucketCount{64 << kSubBucketBits};
+
+    static std::size_t bucketIndex(const uint64_t duration) noexcept;
+    static uint64_t bucketValue(const std::size_t index) noexcept;
+
+    std::array<std::atomic<uint64_t>, kBucketCount> m_buckets{};
+    std::atomic<uint64_t>                           m_max{0};
+};
+
+// Collects per-stage latency of every packet that makes it to OBS.
+//
+// Enabled through the environment, so it costs nothing unless asked for:
+//   IOS_CAMERA_LATENCY_STATS=1          log p50/p99/max per stage every 10s
+//   IOS_CAMERA_LATENCY_TRACE=<file>     also write a Chrome trace-event file
+//                                       (load it in chrome://tracing)
+//
+// Reports and trace writes happen on a thread of their own, never on the
+// decoding threads that record.
+class LatencyTracer final
+{
+public:
+    static LatencyTracer &shared();
+
+    bool isEnabled() const noexcept { return m_enabled.load(std::memory_order_relaxed); }
+
+    // Starts collecting without logging, for tools that read the histograms
+    // themselves through takeSummary().
+    void enable() noexcept { m_enabled.store(true, std::memory_order_relaxed); }
+
+    // Called from the decoding threads once a packet has been output
+    void record(const LatencyTrack track, const FrameTiming &timing) noexcept;
+
+    LatencyHistogram::Summary takeSummary(const LatencyTrack track, const LatencyStage stage) noexcept
+    {
+        return m_histograms[static_cast<std::size_t>(track)][static_cast<std::size_t>(stage)].takeSummary();
+    }
+
+    // Stops reporting, writes out pending trace events and closes the trace
+    // file
+    void shutdown() noexcept;
+
+private:
+    static constexpr uint64_t kReportInterval{10000000000ULL};
+    static constexpr std::size_t kMaxPendingTraceEvents{1 << 14};
+    static constexpr std::size_t kTrackCount{static_cast<std::size_t>(LatencyTrack::Count)};
+    static constexpr std::size_t kStageCount{static_cast<std::size_t>(LatencyStage::Count)};
+
+    struct TraceEvent
+    {
+        LatencyTrack track;
+        FrameTiming timing;
+    };
+
+    LatencyTracer();
+
+    void run();
+    void report() noexcept;
+    void takeTraceEvents() noexcept;
+    void writeTraceEvents(std::vector<TraceEvent> &events) noexcept;
+
+    std::atomic<bool>                   m_enabled{false};
+    bool                                m_logStatistics{false};
+    std::array<std::array<LatencyHistogram, kStageCount>, kTrackCount> m_histograms{};
+
+    // Reporting thread, woken every kReportInterval or to stop
+    std::mutex                          m_reportMutex{};
+    std::condition_variable             m_reportCv{};
+    std::thread                         m_reportThread{};
+    bool                                m_shouldStop{false};
+
+    // Trace events are buffered and written out when a report is due.
+    // m_traceMutex guards the pending events; the file and the events being
+    // written belong to the reporting thread, and to shutdown() once it
+    // has stopped.
+    std::atomic<bool>                   m_tracing{false};
+    std::mutex                          m_traceMutex{};
+    std::FILE*                          m_traceFile{nullptr};
+    std::vector<TraceEvent>             m_pendingTraceEvents{};
+    std::vector<TraceEvent>             m_writingTraceEvents{};
+};
+
+#endif // LatencyTracer_hpp
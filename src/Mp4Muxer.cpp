@@ -0,0 +1,660 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#include <algorithm>
+#include <cstring>
+
+#include "obs-iDevice-cam-source.hpp"
+#include "Mp4Muxer.hpp"
+
+namespace
+{
+    // Sample flags of a sample decoding can start at, and of one that
+    // depends on others
+    constexpr uint32_t kSyncSampleFlags{0x02000000};
+    constexpr uint32_t kNonSyncSampleFlags{0x01010000};
+
+    constexpr uint32_t kUnityMatrix[9]{0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000};
+
+    constexpr uint32_t kAdtsSampleRates[16]{96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050,
+                                            16000, 12000, 11025, 8000,  7350,  0,     0,     0};
+
+    void writeU8(std::vector<uint8_t> &out, const uint32_t value)
+    {
+        out.push_back(static_cast<uint8_t>(value));
+    }
+
+    void writeU16(std::vector<uint8_t> &out, const uint32_t value)
+    {
+        writeU8(out, value >> 8);
+        writeU8(out, value);
+    }
+
+    void writeU32(std::vector<uint8_t> &out, const uint32_t value)
+    {
+        writeU16(out, value >> 16);
+        writeU16(out, value);
+    }
+
+    void writeU64(std::vector<uint8_t> &out, const uint64_t value)
+    {
+        writeU32(out, static_cast<uint32_t>(value >> 32));
+        writeU32(out, static_cast<uint32_t>(value));
+    }
+
+    void writeZeros(std::vector<uint8_t> &out, const std::size_t count)
+    {
+        out.insert(out.end(), count, 0);
+    }
+
+    void writeBytes(std::vector<uint8_t> &out, const void *data, const std::size_t size)
+    {
+        const auto bytes = static_cast<const uint8_t *>(data);
+        out.insert(out.end(), bytes, bytes + size);
+    }
+
+    void patchU32(std::vector<uint8_t> &out, const std::size_t offset, const uint32_t value)
+    {
+        out[offset] = static_cast<uint8_t>(value >> 24);
+        out[offset + 1] = static_cast<uint8_t>(value >> 16);
+        out[offset + 2] = static_cast<uint8_t>(value >> 8);
+        out[offset + 3] = static_cast<uint8_t>(value);
+    }
+
+    // Boxes are written with a placeholder size, which endBox() fills in
+    std::size_t beginBox(std::vector<uint8_t> &out, const char *type)
+    {
+        const auto start = out.size();
+        writeU32(out, 0);
+        writeBytes(out, type, 4);
+        return start;
+    }
+
+    std::size_t beginFullBox(std::vector<uint8_t> &out, const char *type, const uint32_t version,
+                             const uint32_t flags)
+    {
+        const auto start = beginBox(out, type);
+        writeU32(out, (version << 24) | flags);
+        return start;
+    }
+
+    void endBox(std::vector<uint8_t> &out, const std::size_t start)
+    {
+        patchU32(out, start, static_cast<uint32_t>(out.size() - start));
+    }
+
+    void writeMatrix(std::vector<uint8_t> &out)
+    {
+        for (const auto value : kUnityMatrix)
+        {
+            writeU32(out, value);
+        }
+    }
+
+    void writeTrackHeader(std::vector<uint8_t> &out, const uint32_t trackId, const bool isAudio,
+                          const uint32_t width, const uint32_t height)
+    {
+        // Enabled and in the movie
+        const auto tkhd = beginFullBox(out, "tkhd", 0, 0x000003);
+        writeU32(out, 0);                       // creation_time
+        writeU32(out, 0);                       // modification_time
+        writeU32(out, trackId);
+        writeU32(out, 0);                       // reserved
+        writeU32(out, 0);                       // duration, given by the fragments
+        writeZeros(out, 8);                     // reserved
+        writeU16(out, 0);                       // layer
+        writeU16(out, 0);                       // alternate_group
+        writeU16(out, isAudio ? 0x0100 : 0);    // volume
+        writeU16(out, 0);                       // reserved
+        writeMatrix(out);
+        writeU32(out, width << 16);
+        writeU32(out, height << 16);
+        endBox(out, tkhd);
+    }
+
+    void writeMediaHeader(std::vector<uint8_t> &out, const uint32_t timescale, const char *handlerType,
+                          const char *handlerName)
+    {
+        const auto mdhd = beginFullBox(out, "mdhd", 0, 0);
+        writeU32(out, 0);           // creation_time
+        writeU32(out, 0);           // modification_time
+        writeU32(out, timescale);
+        writeU32(out, 0);           // duration
+        writeU16(out, 0x55C4);      // "und"
+        writeU16(out, 0);
+        endBox(out, mdhd);
+
+        const auto hdlr = beginFullBox(out, "hdlr", 0, 0);
+        writeU32(out, 0);
+        writeBytes(out, handlerType, 4);
+        writeZeros(out, 12);
+        writeBytes(out, handlerName, strlen(handlerName) + 1);
+        endBox(out, hdlr);
+    }
+
+    void writeDataInformation(std::vector<uint8_t> &out)
+    {
+        const auto dinf = beginBox(out, "dinf");
+        const auto dref = beginFullBox(out, "dref", 0, 0);
+        writeU32(out, 1);
+
+        // The media is in this file
+        const auto url = beginFullBox(out, "url ", 0, 0x000001);
+        endBox(out, url);
+
+        endBox(out, dref);
+        endBox(out, dinf);
+    }
+
+    // Every sample is described by the fragments, so the tables are empty
+    void writeEmptySampleTables(std::vector<uint8_t> &out)
+    {
+        const auto stts = beginFullBox(out, "stts", 0, 0);
+        writeU32(out, 0);
+        endBox(out, stts);
+
+        const auto stsc = beginFullBox(out, "stsc", 0, 0);
+        writeU32(out, 0);
+        endBox(out, stsc);
+
+        const auto stsz = beginFullBox(out, "stsz", 0, 0);
+        writeU32(out, 0);
+        writeU32(out, 0);
+        endBox(out, stsz);
+
+        const auto stco = beginFullBox(out, "stco", 0, 0);
+        writeU32(out, 0);
+        endBox(out, stco);
+    }
+}
+
+Mp4Muxer::Mp4Muxer()
+{
+    // Room for a few seconds of a high bitrate stream, so that recording
+    // doesn't have to allocate as it goes
+    m_output.reserve(kOutputCapacity);
+    m_videoData.reserve(kOutputCapacity);
+    m_audioData.reserve(kOutputCapacity / 16);
+}
+
+uint64_t Mp4Muxer::videoTicks(const uint64_t timestamp) const noexcept
+{
+    const auto elapsed = (timestamp > m_startTime) ? (timestamp - m_startTime) : 0;
+    return elapsed * kVideoTimescale / 1000000000;
+}
+
+uint64_t Mp4Muxer::duration() const noexcept
+{
+    return m_videoTime * 1000000000 / kVideoTimescale;
+}
+
+void Mp4Muxer::updateParameterSets(const uint8_t *nal, const std::size_t size)
+{
+    const auto isSps = ((nal[0] & 0x1F) == NalUnitTypeSps);
+    auto &parameterSet = isSps ? m_sps : m_pps;
+
+    if ((parameterSet.size() == size) && std::equal(nal, nal + size, parameterSet.begin()))
+    {
+        return;
+    }
+
+    if (m_isInitWritten)
+    {
+        // The header is already on disk, so the file can only keep the old
+        // ones; pictures from here on may not play back
+        if (!m_hasWarnedAboutParameterSets)
+        {
+            blog(LOG_WARNING, "The device changed its video format while recording");
+            m_hasWarnedAboutParameterSets = true;
+        }
+
+        return;
+    }
+
+    if (isSps)
+    {
+        H264SpsInfo info;
+        if (!parseH264Sps(nal, size, info))
+        {
+            return;
+        }
+
+        m_spsInfo = info;
+    }
+
+    parameterSet.assign(nal, nal + size);
+}
+
+void Mp4Muxer::addVideo(const uint8_t *data, const std::size_t size, const uint64_t timestamp,
+                        const H264FrameType frameType)
+{
+    const auto isKeyframe = (frameType == H264FrameType::Keyframe);
+
+    // Parameter sets come in packets of their own or in front of keyframes
+    if ((frameType == H264FrameType::Config) || isKeyframe)
+    {
+        forEachH264Nal(data, size, [&](const uint8_t *nal, const std::size_t nalSize) {
+            const auto nalUnitType = (nalSize > 0) ? (nal[0] & 0x1F) : 0;
+            if ((nalUnitType == NalUnitTypeSps) || (nalUnitType == NalUnitTypePps))
+            {
+                updateParameterSets(nal, nalSize);
+            }
+
+            return true;
+        });
+    }
+
+    if (!m_isStarted)
+    {
+        if (!isKeyframe || m_sps.empty() || m_pps.empty())
+        {
+            return;
+        }
+
+        m_isStarted = true;
+        m_startTime = timestamp;
+    }
+
+    if (!m_videoSamples.empty() &&
+        (isKeyframe || (timestamp >= m_videoSamples.front().timestamp + kMaxFragmentDuration)))
+    {
+        flushFragment(timestamp);
+    }
+
+    // Length prefixed NAL units, without what the header already has
+    Sample sample{m_videoData.size(), 0, timestamp, isKeyframe};
+
+    forEachH264Nal(data, size, [&](const uint8_t *nal, const std::size_t nalSize) {
+        const auto nalUnitType = (nalSize > 0) ? (nal[0] & 0x1F) : 0;
+        if ((nalSize == 0) || (nalUnitType == NalUnitTypeSps) || (nalUnitType == NalUnitTypePps) ||
+            (nalUnitType == NalUnitTypeAccessUnitDelimiter))
+        {
+            return true;
+        }
+
+        writeU32(m_videoData, static_cast<uint32_t>(nalSize));
+        writeBytes(m_videoData, nal, nalSize);
+        return true;
+    });
+
+    sample.size = static_cast<uint32_t>(m_videoData.size() - sample.offset);
+    if (sample.size > 0)
+    {
+        m_videoSamples.push_back(sample);
+    }
+}
+
+void Mp4Muxer::addAudio(const uint8_t *data, const std::size_t size, const uint64_t timestamp)
+{
+    // Audio starts along with the video, there's nothing to sync it to before
+    if (!m_isStarted || (timestamp < m_startTime))
+    {
+        return;
+    }
+
+    std::size_t offset{0};
+    while (offset + 7 <= size)
+    {
+        const auto header = data + offset;
+        if ((header[0] != 0xFF) || ((header[1] & 0xF0) != 0xF0))
+        {
+            return;
+        }
+
+        const std::size_t headerSize = (header[1] & 0x01) ? 7 : 9;
+        const std::size_t frameSize = ((header[3] & 0x03) << 11) | (header[4] << 3) | (header[5] >> 5);
+        if ((frameSize <= headerSize) || (offset + frameSize > size))
+        {
+            return;
+        }
+
+        AudioConfig config;
+        config.objectType = (header[2] >> 6) + 1;
+        config.sampleRateIndex = (header[2] >> 2) & 0x0F;
+        config.channels = ((header[2] & 0x01) << 2) | (header[3] >> 6);
+        config.sampleRate = kAdtsSampleRates[config.sampleRateIndex];
+
+        // The audio track is only there if audio came before the header
+        // was written
+        if (!m_hasAudio && !m_isInitWritten && config.sampleRate)
+        {
+            m_audioConfig = config;
+            m_hasAudio = true;
+        }
+
+        if (m_hasAudio && (config.sampleRateIndex == m_audioConfig.sampleRateIndex) &&
+            (config.channels == m_audioConfig.channels))
+        {
+            // Audio is timed by counting frames, except after a gap, such
+            // as packets the recorder had to drop, which starts it over
+            const auto time = (timestamp - m_startTime) * m_audioConfig.sampleRate / 1000000000;
+            if (!m_hasAudioTime || (m_audioSamples.empty() && (time > m_audioTime + m_audioConfig.sampleRate / 2)))
+            {
+                m_audioTime = time;
+                m_hasAudioTime = true;
+            }
+
+            m_audioSamples.push_back(Sample{m_audioData.size(), static_cast<uint32_t>(frameSize - headerSize),
+                                            timestamp, true});
+            writeBytes(m_audioData, header + headerSize, frameSize - headerSize);
+        }
+
+        offset += frameSize;
+    }
+}
+
+void Mp4Muxer::finish()
+{
+    if (m_isStarted && (!m_videoSamples.empty() || !m_audioSamples.empty()))
+    {
+        flushFragment(0);
+    }
+}
+
+void Mp4Muxer::flushFragment(const uint64_t nextTimestamp)
+{
+    if (!m_isInitWritten)
+    {
+        writeInitSegment();
+        m_isInitWritten = true;
+    }
+
+    if (!m_videoSamples.empty())
+    {
+        // Each sample lasts until the next one starts; the last one until
+        // the sample that starts the next fragment
+        m_durations.clear();
+
+        auto time = m_videoTime;
+        for (std::size_t i{0}; i < m_videoSamples.size(); ++i)
+        {
+            uint64_t next;
+            if (i + 1 < m_videoSamples.size())
+            {
+                next = videoTicks(m_videoSamples[i + 1].timestamp);
+            }
+            else
+            {
+                next = nextTimestamp ? videoTicks(nextTimestamp) : (time + m_lastVideoDuration);
+            }
+
+            const auto duration = (next > time) ? static_cast<uint32_t>(next - time) : 1;
+            m_durations.push_back(duration);
+            time += duration;
+        }
+
+        m_lastVideoDuration = m_durations.back();
+
+        writeFragment(kVideoTrackId, m_videoSamples, m_videoData, m_durations, m_videoTime);
+
+        m_videoTime = time;
+        m_videoSamples.clear();
+        m_videoData.clear();
+    }
+
+    if (!m_audioSamples.empty())
+    {
+        m_durations.assign(m_audioSamples.size(), kAacFrameSamples);
+
+        writeFragment(kAudioTrackId, m_audioSamples, m_audioData, m_durations, m_audioTime);
+
+        m_audioTime += m_audioSamples.size() * kAacFrameSamples;
+        m_audioSamples.clear();
+        m_audioData.clear();
+    }
+}
+
+void Mp4Muxer::writeInitSegment()
+{
+    auto &out = m_output;
+
+    const auto ftyp = beginBox(out, "ftyp");
+    writeBytes(out, "isom", 4);
+    writeU32(out, 0x200);
+    writeBytes(out, "isomiso6avc1mp41", 16);
+    endBox(out, ftyp);
+
+    const auto moov = beginBox(out, "moov");
+
+    const auto mvhd = beginFullBox(out, "mvhd", 0, 0);
+    writeU32(out, 0);               // creation_time
+    writeU32(out, 0);               // modification_time
+    writeU32(out, 1000);            // timescale
+    writeU32(out, 0);               // duration, given by the fragments
+    writeU32(out, 0x00010000);      // rate
+    writeU16(out, 0x0100);          // volume
+    writeZeros(out, 10);            // reserved
+    writeMatrix(out);
+    writeZeros(out, 24);            // pre_defined
+    writeU32(out, kAudioTrackId + 1);
+    endBox(out, mvhd);
+
+    writeVideoTrack();
+
+    if (m_hasAudio)
+    {
+        writeAudioTrack();
+    }
+
+    const auto mvex = beginBox(out, "mvex");
+    for (const auto trackId : {kVideoTrackId, kAudioTrackId})
+    {
+        if ((trackId == kAudioTrackId) && !m_hasAudio)
+        {
+            continue;
+        }
+
+        const auto trex = beginFullBox(out, "trex", 0, 0);
+        writeU32(out, trackId);
+        writeU32(out, 1);           // default_sample_description_index
+        writeU32(out, 0);
+        writeU32(out, 0);
+        writeU32(out, 0);
+        endBox(out, trex);
+    }
+    endBox(out, mvex);
+
+    endBox(out, moov);
+}
+
+void Mp4Muxer::writeVideoTrack()
+{
+    auto &out = m_output;
+
+    const auto trak = beginBox(out, "trak");
+    writeTrackHeader(out, kVideoTrackId, false, m_spsInfo.width, m_spsInfo.height);
+
+    const auto mdia = beginBox(out, "mdia");
+    writeMediaHeader(out, kVideoTimescale, "vide", "VideoHandler");
+
+    const auto minf = beginBox(out, "minf");
+
+    const auto vmhd = beginFullBox(out, "vmhd", 0, 0x000001);
+    writeZeros(out, 8);
+    endBox(out, vmhd);
+
+    writeDataInformation(out);
+
+    const auto stbl = beginBox(out, "stbl");
+    const auto stsd = beginFullBox(out, "stsd", 0, 0);
+    writeU32(out, 1);
+
+    const auto avc1 = beginBox(out, "avc1");
+    writeZeros(out, 6);
+    writeU16(out, 1);               // data_reference_index
+    writeZeros(out, 16);
+    writeU16(out, m_spsInfo.width);
+    writeU16(out, m_spsInfo.height);
+    writeU32(out, 0x00480000);      // 72 dpi
+    writeU32(out, 0x00480000);
+    writeU32(out, 0);
+    writeU16(out, 1);               // frame_count
+    writeZeros(out, 32);            // compressorname
+    writeU16(out, 0x0018);          // depth
+    writeU16(out, 0xFFFF);
+
+    const auto avcC = beginBox(out, "avcC");
+    writeU8(out, 1);
+    writeU8(out, m_spsInfo.profile);
+    writeU8(out, m_spsInfo.constraints);
+    writeU8(out, m_spsInfo.level);
+    writeU8(out, 0xFF);             // 4 byte lengths
+    writeU8(out, 0xE1);             // One SPS
+    writeU16(out, static_cast<uint32_t>(m_sps.size()));
+    writeBytes(out, m_sps.data(), m_sps.size());
+    writeU8(out, 1);                // One PPS
+    writeU16(out, static_cast<uint32_t>(m_pps.size()));
+    writeBytes(out, m_pps.data(), m_pps.size());
+
+    if ((m_spsInfo.profile == 100) || (m_spsInfo.profile == 110) || (m_spsInfo.profile == 122) ||
+        (m_spsInfo.profile == 144))
+    {
+        writeU8(out, 0xFC | m_spsInfo.chromaFormat);
+        writeU8(out, 0xF8 | (m_spsInfo.bitDepthLuma - 8));
+        writeU8(out, 0xF8 | (m_spsInfo.bitDepthChroma - 8));
+        writeU8(out, 0);
+    }
+
+    endBox(out, avcC);
+    endBox(out, avc1);
+    endBox(out, stsd);
+
+    writeEmptySampleTables(out);
+
+    endBox(out, stbl);
+    endBox(out, minf);
+    endBox(out, mdia);
+    endBox(out, trak);
+}
+
+void Mp4Muxer::writeAudioTrack()
+{
+    auto &out = m_output;
+
+    const auto trak = beginBox(out, "trak");
+    writeTrackHeader(out, kAudioTrackId, true, 0, 0);
+
+    const auto mdia = beginBox(out, "mdia");
+    writeMediaHeader(out, m_audioConfig.sampleRate, "soun", "SoundHandler");
+
+    const auto minf = beginBox(out, "minf");
+
+    const auto smhd = beginFullBox(out, "smhd", 0, 0);
+    writeU32(out, 0);
+    endBox(out, smhd);
+
+    writeDataInformation(out);
+
+    const auto stbl = beginBox(out, "stbl");
+    const auto stsd = beginFullBox(out, "stsd", 0, 0);
+    writeU32(out, 1);
+
+    const auto mp4a = beginBox(out, "mp4a");
+    writeZeros(out, 6);
+    writeU16(out, 1);               // data_reference_index
+    writeZeros(out, 8);
+    writeU16(out, m_audioConfig.channels);
+    writeU16(out, 16);              // samplesize
+    writeU32(out, 0);
+    writeU32(out, m_audioConfig.sampleRate << 16);
+
+    // An MPEG-4 elementary stream descriptor carrying the AudioSpecificConfig
+    const auto audioSpecificConfig = (m_audioConfig.objectType << 11) | (m_audioConfig.sampleRateIndex << 7) |
+                                     (m_audioConfig.channels << 3);
+
+    const auto esds = beginFullBox(out, "esds", 0, 0);
+    writeU8(out, 0x03);             // ES_Descriptor
+    writeU8(out, 25);
+    writeU16(out, kAudioTrackId);
+    writeU8(out, 0);
+    writeU8(out, 0x04);             // DecoderConfigDescriptor
+    writeU8(out, 17);
+    writeU8(out, 0x40);             // MPEG-4 audio
+    writeU8(out, 0x15);             // Audio stream
+    writeU8(out, 0);                // bufferSizeDB
+    writeU16(out, 0);
+    writeU32(out, 0);               // maxBitrate
+    writeU32(out, 0);               // avgBitrate
+    writeU8(out, 0x05);             // DecoderSpecificInfo
+    writeU8(out, 2);
+    writeU16(out, audioSpecificConfig);
+    writeU8(out, 0x06);             // SLConfigDescriptor
+    writeU8(out, 1);
+    writeU8(out, 0x02);
+    endBox(out, esds);
+
+    endBox(out, mp4a);
+    endBox(out, stsd);
+
+    writeEmptySampleTables(out);
+
+    endBox(out, stbl);
+    endBox(out, minf);
+    endBox(out, mdia);
+    endBox(out, trak);
+}
+
+void Mp4Muxer::writeFragment(const uint32_t trackId, const std::vector<Sample> &samples,
+                             const std::vector<uint8_t> &data, const std::vector<uint32_t> &durations,
+                             const uint64_t baseTime)
+{
+    auto &out = m_output;
+
+    const auto moof = beginBox(out, "moof");
+
+    const auto mfhd = beginFullBox(out, "mfhd", 0, 0);
+    writeU32(out, ++m_sequence);
+    endBox(out, mfhd);
+
+    const auto traf = beginBox(out, "traf");
+
+    // Offsets count from the start of the moof
+    const auto tfhd = beginFullBox(out, "tfhd", 0, 0x020000);
+    writeU32(out, trackId);
+    endBox(out, tfhd);
+
+    const auto tfdt = beginFullBox(out, "tfdt", 1, 0);
+    writeU64(out, baseTime);
+    endBox(out, tfdt);
+
+    // Data offset, and a duration, size and flags for every sample
+    const auto trun = beginFullBox(out, "trun", 0, 0x000701);
+    writeU32(out, static_cast<uint32_t>(samples.size()));
+
+    const auto dataOffset = out.size();
+    writeU32(out, 0);
+
+    for (std::size_t i{0}; i < samples.size(); ++i)
+    {
+        writeU32(out, durations[i]);
+        writeU32(out, samples[i].size);
+        writeU32(out, samples[i].isKeyframe ? kSyncSampleFlags : kNonSyncSampleFlags);
+    }
+
+    endBox(out, trun);
+    endBox(out, traf);
+    endBox(out, moof);
+
+    // The samples follow the mdat header right after the moof
+    patchU32(out, dataOffset, static_cast<uint32_t>(out.size() - moof + 8));
+
+    writeU32(out, static_cast<uint32_t>(data.size() + 8));
+    writeBytes(out, "mdat", 4);
+    writeBytes(out, data.data(), data.size());
+}
@@ -0,0 +1,125 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#ifndef Mp4Muxer_hpp
+#define Mp4Muxer_hpp
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "H264Parser.hpp"
+
+// Writes H.264 (Annex B) and AAC (ADTS) packets into a fragmented MP4 as
+// they come, without any codec work: parameter sets go into the header,
+// start codes become length prefixes and ADTS headers are dropped.
+//
+// The file starts at the first keyframe. Each group of pictures becomes a
+// fragment of its own, and so does the audio that arrived along with it, so
+// a file cut short by a crash still plays up to its last whole fragment.
+// Bytes ready to be written collect in output(), which the caller empties.
+class Mp4Muxer final
+{
+public:
+    Mp4Muxer();
+    ~Mp4Muxer() = default;
+
+    Mp4Muxer(const Mp4Muxer &other) = delete;
+    Mp4Muxer &operator=(const Mp4Muxer &other) = delete;
+
+    // timestamp in nanoseconds, on the same clock for audio and video
+    void addVideo(const uint8_t *data, const std::size_t size, const uint64_t timestamp, const H264FrameType frameType);
+    void addAudio(const uint8_t *data, const std::size_t size, const uint64_t timestamp);
+
+    // Writes out what is still pending, at the end of the recording
+    void finish();
+
+    std::vector<uint8_t> &output() noexcept { return m_output; }
+
+    // Nanoseconds of video muxed so far
+    uint64_t duration() const noexcept;
+
+private:
+    static constexpr uint32_t kVideoTimescale{90000};
+    static constexpr uint32_t kVideoTrackId{1};
+    static constexpr uint32_t kAudioTrackId{2};
+    static constexpr uint32_t kAacFrameSamples{1024};
+
+    // Groups of pictures longer than this are split over several fragments
+    static constexpr uint64_t kMaxFragmentDuration{2000000000};
+
+    static constexpr std::size_t kOutputCapacity{8 << 20};
+
+    struct Sample
+    {
+        std::size_t offset;
+        uint32_t size;
+        uint64_t timestamp;
+        bool isKeyframe;
+    };
+
+    struct AudioConfig
+    {
+        uint32_t objectType{0};
+        uint32_t sampleRateIndex{0};
+        uint32_t channels{0};
+        uint32_t sampleRate{0};
+    };
+
+    void updateParameterSets(const uint8_t *nal, const std::size_t size);
+    void flushFragment(const uint64_t nextTimestamp);
+    uint64_t videoTicks(const uint64_t timestamp) const noexcept;
+
+    void writeInitSegment();
+    void writeVideoTrack();
+    void writeAudioTrack();
+    void writeFragment(const uint32_t trackId, const std::vector<Sample> &samples,
+                       const std::vector<uint8_t> &data, const std::vector<uint32_t> &durations,
+                       const uint64_t baseTime);
+
+    std::vector<uint8_t>    m_output{};
+
+    std::vector<uint8_t>    m_sps{};
+    std::vector<uint8_t>    m_pps{};
+    H264SpsInfo             m_spsInfo{};
+    bool                    m_hasWarnedAboutParameterSets{false};
+
+    AudioConfig             m_audioConfig{};
+    bool                    m_hasAudio{false};
+
+    bool                    m_isStarted{false};
+    bool                    m_isInitWritten{false};
+    uint64_t                m_startTime{0};
+    uint32_t                m_sequence{0};
+
+    // The fragment being collected, with the samples' data back to back
+    std::vector<Sample>     m_videoSamples{};
+    std::vector<uint8_t>    m_videoData{};
+    std::vector<Sample>     m_audioSamples{};
+    std::vector<uint8_t>    m_audioData{};
+    std::vector<uint32_t>   m_durations{};
+
+    // Decode time of the next fragment of each track, in its timescale
+    uint64_t                m_videoTime{0};
+    uint64_t                m_audioTime{0};
+    bool                    m_hasAudioTime{false};
+    uint32_t                m_lastVideoDuration{kVideoTimescale / 30};
+};
+
+#endif /* Mp4Muxer_hpp */
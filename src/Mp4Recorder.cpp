@@ -0,0 +1,209 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+
+#include <util/platform.h>
+
+#include "obs-iDevice-cam-source.hpp"
+#include "Mp4Recorder.hpp"
+
+std::shared_ptr<Mp4Recorder> Mp4Recorder::create(const std::string &path, const Packet &config)
+{
+    const auto file = os_fopen(path.c_str(), "wb");
+    if (!file)
+    {
+        blog(LOG_WARNING, "Could not create recording %s", path.c_str());
+        return nullptr;
+    }
+
+    auto recorder = std::shared_ptr<Mp4Recorder>(new Mp4Recorder(file, path));
+
+    // Nothing receives into it yet, so this can stand in for the receiving
+    // thread
+    if (!config.empty())
+    {
+        recorder->m_queue.push(PacketItem{config, PacketTypeVideo, 0, H264FrameType::Config});
+    }
+
+    return recorder;
+}
+
+Mp4Recorder::Mp4Recorder(std::FILE *file, const std::string &path)
+    :
+    m_file{file},
+    m_path{path}
+{
+    m_pending.reserve(kBatchSize);
+    m_thread = std::thread(&Mp4Recorder::run, this);
+}
+
+Mp4Recorder::~Mp4Recorder()
+{
+    stop();
+}
+
+void Mp4Recorder::stop()
+{
+    m_queue.stop();
+
+    if (m_thread.joinable())
+    {
+        m_thread.join();
+    }
+}
+
+void Mp4Recorder::input(const portal::ProtocolPacketSpan &packets)
+{
+    for (const auto &packet : packets)
+    {
+        if ((packet.type != PacketTypeVideo) && (packet.type != PacketTypeAudio))
+        {
+            continue;
+        }
+
+        auto frameType = H264FrameType::Unknown;
+        if (packet.type == PacketTypeVideo)
+        {
+            frameType = classifyPacket(packet);
+
+            // Pictures after a dropped one can't be decoded until the next
+            // keyframe. Parameter sets are always worth keeping.
+            if (m_isWaitingForKeyframe && (frameType == H264FrameType::Keyframe))
+            {
+                m_isWaitingForKeyframe = false;
+            }
+            else if (m_isWaitingForKeyframe && (frameType != H264FrameType::Config))
+            {
+                ++m_droppedCount;
+                continue;
+            }
+        }
+        else if (m_isWaitingForKeyframe)
+        {
+            // The muxer picks the audio up again after the gap
+            ++m_droppedCount;
+            continue;
+        }
+
+        m_pending.emplace_back(packet.packet, packet.type, packet.tag, frameType, FrameTiming{packet.timing});
+    }
+
+    if (m_pending.empty())
+    {
+        return;
+    }
+
+    const auto pushed = m_queue.push(m_pending.data(), m_pending.size());
+    if (pushed < m_pending.size())
+    {
+        m_droppedCount += (m_pending.size() - pushed);
+        m_isWaitingForKeyframe = true;
+    }
+
+    m_pending.clear();
+}
+
+void Mp4Recorder::run()
+{
+    std::vector<PacketItem> items(kBatchSize);
+
+    // Whatever is still queued once stopped is written out too
+    auto isRunning = true;
+    while (isRunning)
+    {
+        isRunning = m_queue.wait();
+
+        std::size_t count;
+        while ((count = m_queue.pop(items.data(), items.size())) > 0)
+        {
+            for (std::size_t i{0}; i < count; ++i)
+            {
+                mux(items[i]);
+
+                // Let go of the receive buffer
+                items[i] = PacketItem{};
+            }
+
+            writeOutput();
+        }
+    }
+
+    m_muxer.finish();
+    writeOutput();
+
+    if (std::fclose(m_file) != 0)
+    {
+        m_hasFailed = true;
+    }
+
+    if (m_hasFailed)
+    {
+        blog(LOG_WARNING, "Could not write the whole recording to %s", m_path.c_str());
+    }
+    else
+    {
+        blog(LOG_INFO, "Recorded %.1f seconds to %s", static_cast<double>(m_duration.load()) / 1000000000.0,
+             m_path.c_str());
+    }
+
+    if (m_droppedCount > 0)
+    {
+        blog(LOG_WARNING, "The disk fell behind, %zu packets were not recorded", m_droppedCount.load());
+    }
+}
+
+void Mp4Recorder::mux(const PacketItem &item)
+{
+    const auto &packet = item.getPacket();
+    const auto data = reinterpret_cast<const uint8_t *>(packet.data());
+
+    // Audio and video are only in sync on the device's clock, when it
+    // sends one
+    const auto &timing = item.getTiming();
+    const auto timestamp = timing.captured ? timing.captured : timing.received;
+
+    if (item.getType() == PacketTypeVideo)
+    {
+        m_muxer.addVideo(data, packet.size(), timestamp, item.getFrameType());
+    }
+    else
+    {
+        m_muxer.addAudio(data, packet.size(), timestamp);
+    }
+}
+
+void Mp4Recorder::writeOutput()
+{
+    auto &output = m_muxer.output();
+    if (output.empty())
+    {
+        return;
+    }
+
+    // Fragments are only written whole, so flushing each one keeps the
+    // file playable should OBS go away mid-recording
+    if (!m_hasFailed)
+    {
+        m_hasFailed = (std::fwrite(output.data(), 1, output.size(), m_file) != output.size()) ||
+                      (std::fflush(m_file) != 0);
+    }
+
+    output.clear();
+    m_duration = m_muxer.duration();
+}
@@ -0,0 +1,96 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+
+#ifndef Mp4Recorder_hpp
+#define Mp4Recorder_hpp
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Decoder.hpp"
+#include "Mp4Muxer.hpp"
+#include "Queue.hpp"
+
+// Records a device's stream to an MP4 file as it arrives, without decoding
+// or encoding anything. input() only queues views of the received packets;
+// muxing and writing happen on a thread of its own, so the receiving thread
+// never waits on the disk. If the disk can't keep up, packets are dropped
+// (and counted) and the recording picks up again at the next keyframe.
+class Mp4Recorder final
+{
+public:
+    // Returns nullptr if the file can't be created. config is the stream's
+    // newest parameter sets, if any, which a recording started mid-stream
+    // can't begin without.
+    static std::shared_ptr<Mp4Recorder> create(const std::string &path, const Packet &config);
+
+    ~Mp4Recorder();
+
+    Mp4Recorder(const Mp4Recorder &other) = delete;
+    Mp4Recorder &operator=(const Mp4Recorder &other) = delete;
+
+    // Called with every batch received from the device
+    void input(const portal::ProtocolPacketSpan &packets);
+
+    // Writes out what is queued and closes the file. Packets that come in
+    // afterwards are ignored.
+    void stop();
+
+    const std::string &path() const noexcept { return m_path; }
+
+    // Nanoseconds of video written so far
+    uint64_t duration() const noexcept { return m_duration.load(); }
+
+private:
+    // About ten seconds of a 60 fps stream with its audio
+    static constexpr std::size_t kQueueCapacity{1024};
+    static constexpr std::size_t kBatchSize{64};
+
+    Mp4Recorder(std::FILE *file, const std::string &path);
+
+    void run();
+    void mux(const PacketItem &item);
+    void writeOutput();
+
+    std::FILE*                  m_file{nullptr};
+    const std::string           m_path;
+
+    SPSCQueue<PacketItem>       m_queue{kQueueCapacity, OverflowPolicy::DropNewest};
+
+    // Receiving thread only
+    std::vector<PacketItem>     m_pending{};
+    bool                        m_isWaitingForKeyframe{false};
+
+    // Writer thread only
+    Mp4Muxer                    m_muxer{};
+    bool                        m_hasFailed{false};
+
+    std::atomic<uint64_t>       m_duration{0};
+    std::atomic<std::size_t>    m_droppedCount{0};
+
+    std::thread                 m_thread{};
+};
+
+#endif /* Mp4Recorder_hpp */
@@ -19,97 +19,301 @@
 #ifndef Queue_hpp
 #define Queue_hpp
 
-#include <list>
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
-#include <cstdio>
+#include <cstddef>
+#include <vector>
+
+#include "PacketBuffer.hpp"
+#include "H264Parser.hpp"
+#include "LatencyTracer.hpp"
 
 class PacketItem
 {
 public:
-    PacketItem(const std::vector<char> packet, const int type, const int tag)
+    PacketItem() = default;
+    PacketItem(const portal::Packet &packet, const int type, const int tag,
+               const H264FrameType frameType = H264FrameType::Unknown,
+               const FrameTiming &timing = FrameTiming{})
         :
         m_packet{packet},
         m_type{type},
-        m_tag{tag}
+        m_tag{tag},
+        m_frameType{frameType},
+        m_timing{timing}
     {
     }
 
-    std::vector<char> getPacket() const noexcept { return m_packet; }
+    const portal::Packet &getPacket() const noexcept { return m_packet; }
     int getType() const noexcept { return m_type; }
     int getTag() const noexcept { return m_tag; }
+    H264FrameType getFrameType() const noexcept { return m_frameType; }
+    const FrameTiming &getTiming() const noexcept { return m_timing; }
 
 private:
-    std::vector<char> m_packet;
-    int m_type;
-    int m_tag;
+    portal::Packet m_packet{};
+    int m_type{0};
+    int m_tag{0};
+    H264FrameType m_frameType{H264FrameType::Unknown};
+    FrameTiming m_timing{};
+};
+
+// What SPSCQueue::push does when the queue is full.
+enum class OverflowPolicy
+{
+    // Reject the incoming item and count it as dropped.
+    DropNewest,
+
+    // Wait for the consumer to make room (or for the queue to stop).
+    Block
 };
 
+// Bounded single-producer/single-consumer ring queue.
+//
+// Items live in a preallocated ring, so pushing and popping never allocates.
+// The producer only writes m_tail and the consumer only writes m_head; each
+// index sits on its own cache line together with the side's cached copy of
+// the other index, so the two threads don't false-share. The mutex and
+// condition variable are only touched when one side actually has to sleep,
+// which makes the uncontended path a couple of atomic operations.
 template <typename T>
-class WorkQueue
+class SPSCQueue
 {
 public:
-    WorkQueue() = default;
-    ~WorkQueue() = default;
+    explicit SPSCQueue(const std::size_t capacity, const OverflowPolicy policy = OverflowPolicy::DropNewest)
+        :
+        m_slots(roundUpToPowerOfTwo(capacity)),
+        m_mask{m_slots.size() - 1},
+        m_policy{policy}
+    {
+    }
+
+    ~SPSCQueue() = default;
+
+    SPSCQueue(const SPSCQueue &other) = delete;
+    SPSCQueue &operator=(const SPSCQueue &other) = delete;
 
-    void add(T item)
+    // Producer side
+
+    bool push(T item)
     {
-        m_mutex.lock();
-        m_queue.push_back(item);
-        m_cv.notify_all();
-        m_mutex.unlock();
+        return push(&item, 1) == 1;
+    }
+
+    // Pushes up to count items, waking the consumer at most once. Returns the
+    // number of items that were queued; the rest were dropped.
+    std::size_t push(T *items, const std::size_t count)
+    {
+        std::size_t pushed{0};
+        auto tail = m_producer.tail.load(std::memory_order_relaxed);
+
+        while (pushed < count)
+        {
+            if (tail - m_producer.cachedHead == m_slots.size())
+            {
+                m_producer.cachedHead = m_consumer.head.load(std::memory_order_acquire);
+                if (tail - m_producer.cachedHead == m_slots.size())
+                {
+                    if (pushed > 0)
+                    {
+                        // Let the consumer see what we have so far before
+                        // deciding what to do with the rest.
+                        publish(tail);
+                    }
+
+                    if ((m_policy == OverflowPolicy::DropNewest) || !waitForSpace(tail))
+                    {
+                        m_droppedCount += (count - pushed);
+                        break;
+                    }
+
+                    continue;
+                }
+            }
+
+            m_slots[tail & m_mask] = std::move(items[pushed]);
+            ++tail;
+            ++pushed;
+        }
+
+        if (pushed > 0)
+        {
+            publish(tail);
+        }
+
+        return pushed;
     }
 
-    T remove()
+    // Consumer side
+
+    // Blocks until there is at least one item, wake() is called or the queue
+    // is stopped. Returns false once the queue has been stopped.
+    bool wait()
     {
+        if (!isEmpty() || m_shouldStop.load())
+        {
+            return !m_shouldStop.load();
+        }
+
         std::unique_lock<std::mutex> lock{m_mutex};
-        m_cv.wait(lock, [&](){ return m_shouldStop || !m_queue.empty(); });
+        m_consumerWaiting.store(true);
+        m_cv.wait(lock, [&]() { return m_shouldStop.load() || m_wakeRequested.load() || !isEmpty(); });
+        m_consumerWaiting.store(false);
+        m_wakeRequested.store(false);
+
+        return !m_shouldStop.load();
+    }
+
+    bool pop(T &item)
+    {
+        return pop(&item, 1) == 1;
+    }
+
+    // Moves up to maxCount items into items. Returns how many were moved.
+    std::size_t pop(T *items, const std::size_t maxCount)
+    {
+        const auto head = m_consumer.head.load(std::memory_order_relaxed);
 
-        if (m_queue.size() > 0)
+        if (m_consumer.cachedTail - head < maxCount)
         {
-            auto item = m_queue.front();
-            m_queue.pop_front();
-            lock.unlock();
-            return item;
+            m_consumer.cachedTail = m_producer.tail.load(std::memory_order_acquire);
         }
-        else
+
+        const auto available = m_consumer.cachedTail - head;
+        const auto count = (available < maxCount) ? available : maxCount;
+
+        for (std::size_t i{0}; i < count; ++i)
         {
-            lock.unlock();
-            printf("No item to remove. item count: %d\n", this->size());
-            return nullptr;
+            items[i] = std::move(m_slots[(head + i) & m_mask]);
         }
+
+        if (count > 0)
+        {
+            m_consumer.head.store(head + count, std::memory_order_seq_cst);
+
+            if (m_producerWaiting.load())
+            {
+                std::lock_guard<std::mutex> lock{m_mutex};
+                m_cv.notify_all();
+            }
+        }
+
+        return count;
+    }
+
+    // Drops everything currently queued.
+    void clear()
+    {
+        T item{};
+        while (pop(item))
+        {
+        }
+    }
+
+    // Either side
+
+    // Approximate number of queued items; exact when called by the consumer.
+    std::size_t size() const noexcept
+    {
+        return m_producer.tail.load(std::memory_order_acquire) - m_consumer.head.load(std::memory_order_acquire);
     }
 
-    std::size_t size()
+    std::size_t capacity() const noexcept { return m_slots.size(); }
+    std::size_t droppedCount() const noexcept { return m_droppedCount.load(); }
+
+    // Makes a pending wait() return even if the queue is empty.
+    void wake()
     {
-        m_mutex.lock();
-        const auto size = m_queue.size();
-        m_mutex.unlock();
-        return size;
+        std::lock_guard<std::mutex> lock{m_mutex};
+        m_wakeRequested.store(true);
+        m_cv.notify_all();
     }
 
     void stop()
     {
-        m_shouldStop = true;
+        std::lock_guard<std::mutex> lock{m_mutex};
+        m_shouldStop.store(true);
         m_cv.notify_all();
     }
 
 private:
-    // The Queue that will contain the work items
-    std::list<T> m_queue;
+    static constexpr std::size_t kCacheLineSize{64};
+
+    struct alignas(kCacheLineSize) ProducerState
+    {
+        std::atomic<std::size_t> tail{0};
+        std::size_t cachedHead{0};
+    };
+
+    struct alignas(kCacheLineSize) ConsumerState
+    {
+        std::atomic<std::size_t> head{0};
+        std::size_t cachedTail{0};
+    };
+
+    static std::size_t roundUpToPowerOfTwo(const std::size_t value) noexcept
+    {
+        std::size_t result{1};
+        while (result < value)
+        {
+            result <<= 1;
+        }
+        return result;
+    }
+
+    bool isEmpty() const noexcept
+    {
+        return m_producer.tail.load(std::memory_order_seq_cst) == m_consumer.head.load(std::memory_order_relaxed);
+    }
+
+    void publish(const std::size_t tail)
+    {
+        // seq_cst pairs with the consumer setting m_consumerWaiting before
+        // re-checking the queue, so one of the two always sees the other.
+        m_producer.tail.store(tail, std::memory_order_seq_cst);
+
+        if (m_consumerWaiting.load())
+        {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            m_cv.notify_all();
+        }
+    }
+
+    bool waitForSpace(const std::size_t tail)
+    {
+        std::unique_lock<std::mutex> lock{m_mutex};
+        m_producerWaiting.store(true);
+        m_cv.wait(lock, [&]() {
+            return m_shouldStop.load() || (tail - m_consumer.head.load() < m_slots.size());
+        });
+        m_producerWaiting.store(false);
+
+        m_producer.cachedHead = m_consumer.head.load(std::memory_order_acquire);
+        return !m_shouldStop.load();
+    }
+
+    ProducerState               m_producer{};
+    ConsumerState               m_consumer{};
+
+    std::vector<T>              m_slots;
+    const std::size_t           m_mask;
+    const OverflowPolicy        m_policy;
 
-    // The mutext that we'll use to lock access to the queue
-    std::mutex m_mutex;
+    std::atomic<std::size_t>    m_droppedCount{0};
 
-    // The Condition variable that determines when remove() can stop waiting
-    // because there is either a new item in the queue or the queue should stop.
-    std::condition_variable m_cv;
+    // Slow path used only when one side has to sleep
+    std::mutex                  m_mutex{};
+    std::condition_variable     m_cv{};
+    std::atomic_bool            m_consumerWaiting{false};
+    std::atomic_bool            m_producerWaiting{false};
+    std::atomic_bool            m_wakeRequested{false};
 
     // Whether the queue should stop. This is required becuase there was an
     // deadlock issue where trying to stop an std::thread that is waiting on a
     // std::condition_variable to return. This stackoverflow question explains
     // in more detail https://stackoverflow.com/q/21757124
-    bool m_shouldStop{false};
+    std::atomic_bool            m_shouldStop{false};
 };
 
 #endif
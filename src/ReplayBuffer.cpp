@@ -0,0 +1,238 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#include <cstdio>
+
+#include <util/platform.h>
+
+#include "obs-iDevice-cam-source.hpp"
+#include "ReplayBuffer.hpp"
+
+ReplayBuffer::~ReplayBuffer()
+{
+    std::lock_guard<std::mutex> lock{m_writerMutex};
+
+    if (m_writer.joinable())
+    {
+        m_writer.join();
+    }
+}
+
+void ReplayBuffer::setDuration(const uint64_t duration)
+{
+    m_duration = duration;
+
+    if (duration == 0)
+    {
+        clear();
+    }
+}
+
+void ReplayBuffer::clear()
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    m_firstIndex += m_entries.size();
+    m_entries.clear();
+    m_keyframes.clear();
+    m_size = 0;
+    m_config = Packet{};
+}
+
+void ReplayBuffer::input(const portal::ProtocolPacketSpan &packets)
+{
+    if (!isEnabled())
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    uint64_t newest{0};
+    for (const auto &packet : packets)
+    {
+        if ((packet.type != PacketTypeVideo) && (packet.type != PacketTypeAudio))
+        {
+            continue;
+        }
+
+        if (packet.type == PacketTypeVideo)
+        {
+            const auto frameType = classifyPacket(packet);
+            if (frameType == H264FrameType::Config)
+            {
+                m_config = packet.packet;
+            }
+            else if (frameType == H264FrameType::Keyframe)
+            {
+                m_keyframes.push_back(Keyframe{m_firstIndex + m_entries.size(), packet.timing.received, m_config});
+            }
+        }
+
+        // Nothing before the first keyframe could be played back
+        if (m_keyframes.empty())
+        {
+            continue;
+        }
+
+        m_entries.push_back(Entry{packet.packet, packet.type, packet.timing.received});
+        m_size += packet.packet.size();
+        newest = packet.timing.received;
+    }
+
+    if (newest)
+    {
+        trim(newest);
+    }
+}
+
+void ReplayBuffer::trim(const uint64_t now)
+{
+    const auto duration = m_duration.load();
+
+    // The oldest group of pictures goes once the ones after it cover the
+    // whole duration on their own
+    while ((m_keyframes.size() >= 2) &&
+           ((m_keyframes[1].received + duration <= now) || (m_size > kMaxSize)))
+    {
+        const auto end = m_keyframes[1].index;
+        while (m_firstIndex < end)
+        {
+            m_size -= m_entries.front().packet.size();
+            m_entries.pop_front();
+            ++m_firstIndex;
+        }
+
+        m_keyframes.pop_front();
+    }
+
+    // A single group of pictures can outgrow the cap too when keyframes are
+    // far apart. It has to go as a whole, and the ring starts over at the
+    // next keyframe.
+    if (m_size > kMaxSize)
+    {
+        blog(LOG_WARNING, "Keyframes are too far apart for the replay buffer, starting it over");
+
+        m_firstIndex += m_entries.size();
+        m_entries.clear();
+        m_keyframes.clear();
+        m_size = 0;
+    }
+}
+
+uint64_t ReplayBuffer::heldDuration() const
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    if (m_entries.empty())
+    {
+        return 0;
+    }
+
+    return m_entries.back().received - m_entries.front().received;
+}
+
+bool ReplayBuffer::save(const std::string &path)
+{
+    std::lock_guard<std::mutex> writerLock{m_writerMutex};
+
+    if (m_isWriting.load())
+    {
+        blog(LOG_WARNING, "Still saving the previous replay");
+        return false;
+    }
+
+    // Copying the views only bumps reference counts, so the receiving
+    // thread is held up for as short as possible
+    std::vector<Entry> entries;
+    Packet config;
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+
+        if (m_keyframes.empty())
+        {
+            blog(LOG_WARNING, "Nothing to save in the replay buffer yet");
+            return false;
+        }
+
+        entries.assign(m_entries.begin(), m_entries.end());
+        config = m_keyframes.front().config;
+    }
+
+    // Done writing the previous replay, the thread only has to be joined
+    if (m_writer.joinable())
+    {
+        m_writer.join();
+    }
+
+    m_isWriting = true;
+    m_writer = std::thread(&ReplayBuffer::write, this, std::move(entries), std::move(config), path);
+
+    return true;
+}
+
+void ReplayBuffer::write(std::vector<Entry> entries, Packet config, std::string path)
+{
+    const auto videoPath = path + ".h264";
+    const auto audioPath = path + ".aac";
+
+    auto video = os_fopen(videoPath.c_str(), "wb");
+    auto audio = os_fopen(audioPath.c_str(), "wb");
+
+    auto isWritten = (video && audio);
+
+    if (isWritten && !config.empty())
+    {
+        isWritten = (fwrite(config.data(), 1, config.size(), video) == config.size());
+    }
+
+    for (const auto &entry : entries)
+    {
+        if (!isWritten)
+        {
+            break;
+        }
+
+        const auto file = (entry.type == PacketTypeVideo) ? video : audio;
+        isWritten = (fwrite(entry.packet.data(), 1, entry.packet.size(), file) == entry.packet.size());
+    }
+
+    if (video && (fclose(video) != 0))
+    {
+        isWritten = false;
+    }
+
+    if (audio && (fclose(audio) != 0))
+    {
+        isWritten = false;
+    }
+
+    if (isWritten)
+    {
+        const auto duration = entries.back().received - entries.front().received;
+        blog(LOG_INFO, "Saved %.1f seconds of replay to %s", static_cast<double>(duration) / 1000000000.0,
+             path.c_str());
+    }
+    else
+    {
+        blog(LOG_WARNING, "Could not save the replay to %s", path.c_str());
+    }
+
+    m_isWriting = false;
+}
@@ -0,0 +1,109 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#ifndef ReplayBuffer_hpp
+#define ReplayBuffer_hpp
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Decoder.hpp"
+
+// Keeps the last few seconds of a device's stream the way it arrived, so
+// they can be saved without decoding or encoding anything. Packets are held
+// as views into the receive buffers, which costs no copies; the buffers go
+// back to the PacketBufferPool once every packet in them has left the ring.
+//
+// Whole groups of pictures leave the ring at a time, so it always starts at
+// a keyframe and a saved replay plays from its first frame. Should a single
+// group outgrow kMaxSize, everything goes and the ring waits for the next
+// keyframe. The video's
+// parameter sets are kept aside and written in front of it.
+class ReplayBuffer final
+{
+public:
+    ReplayBuffer() = default;
+    ~ReplayBuffer();
+
+    ReplayBuffer(const ReplayBuffer &other) = delete;
+    ReplayBuffer &operator=(const ReplayBuffer &other) = delete;
+
+    // How much of the stream to keep, in nanoseconds. Zero turns the
+    // buffer off and lets go of everything held.
+    void setDuration(const uint64_t duration);
+    bool isEnabled() const noexcept { return (m_duration.load() > 0); }
+
+    // Called with every batch received from the device
+    void input(const portal::ProtocolPacketSpan &packets);
+
+    // Forgets everything held, e.g. when the stream restarts
+    void clear();
+
+    // Nanoseconds of stream held right now
+    uint64_t heldDuration() const;
+
+    // Writes the video to path.h264 and the audio to path.aac, as raw
+    // Annex B and ADTS, on a thread of its own. Fails when nothing is held
+    // or the previous replay is still being written.
+    bool save(const std::string &path);
+
+private:
+    // However long the duration, a high bitrate stream can't take more
+    static constexpr std::size_t kMaxSize{256 << 20};
+
+    struct Entry
+    {
+        Packet packet;
+        int type;
+        uint64_t received;
+    };
+
+    struct Keyframe
+    {
+        // Position in the stream, counting every entry ever added
+        uint64_t index;
+        uint64_t received;
+
+        // The parameter sets the group of pictures starting here uses
+        Packet config;
+    };
+
+    void trim(const uint64_t now);
+    void write(std::vector<Entry> entries, Packet config, std::string path);
+
+    std::atomic<uint64_t>   m_duration{0};
+
+    mutable std::mutex      m_mutex{};
+    std::deque<Entry>       m_entries{};
+    std::deque<Keyframe>    m_keyframes{};
+    uint64_t                m_firstIndex{0};    // Index of m_entries.front()
+    std::size_t             m_size{0};
+    Packet                  m_config{};         // Newest parameter sets
+
+    std::mutex              m_writerMutex{};
+    std::thread             m_writer{};
+    std::atomic_bool        m_isWriting{false};
+};
+
+#endif /* ReplayBuffer_hpp */
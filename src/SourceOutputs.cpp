@@ -0,0 +1,65 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#include <algorithm>
+
+#include "SourceOutputs.hpp"
+
+void SourceOutputs::add(obs_source_t *source)
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    if (std::find(m_sources.begin(), m_sources.end(), source) == m_sources.end())
+    {
+        m_sources.push_back(source);
+    }
+}
+
+void SourceOutputs::remove(obs_source_t *source)
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    m_sources.erase(std::remove(m_sources.begin(), m_sources.end(), source), m_sources.end());
+}
+
+bool SourceOutputs::empty() const
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+    return m_sources.empty();
+}
+
+void SourceOutputs::outputVideo(const obs_source_frame *frame)
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    for (const auto source : m_sources)
+    {
+        obs_source_output_video(source, frame);
+    }
+}
+
+void SourceOutputs::outputAudio(const obs_source_audio *audio)
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    for (const auto source : m_sources)
+    {
+        obs_source_output_audio(source, audio);
+    }
+}
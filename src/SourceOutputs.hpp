@@ -0,0 +1,55 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+
+#ifndef SourceOutputs_hpp
+#define SourceOutputs_hpp
+
+#include <obs.h>
+
+#include <mutex>
+#include <vector>
+
+// The OBS sources showing one device. Decoders output each frame once, here,
+// and OBS copies it into every source, so decoding costs the same however
+// many sources show the device. Sources can come and go on any thread;
+// remove() waits for an output in progress so the source can be destroyed
+// right after.
+class SourceOutputs final
+{
+public:
+    SourceOutputs() = default;
+    ~SourceOutputs() = default;
+
+    SourceOutputs(const SourceOutputs &other) = delete;
+    SourceOutputs &operator=(const SourceOutputs &other) = delete;
+
+    void add(obs_source_t *source);
+    void remove(obs_source_t *source);
+    bool empty() const;
+
+    // A null frame clears the video of every source
+    void outputVideo(const obs_source_frame *frame);
+    void outputAudio(const obs_source_audio *audio);
+
+private:
+    mutable std::mutex          m_mutex{};
+    std::vector<obs_source_t *> m_sources{};
+};
+
+#endif /* SourceOutputs_hpp */
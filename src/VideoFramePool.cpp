@@ -0,0 +1,193 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include "VideoFramePool.hpp"
+
+#include <obs.h>
+
+#ifdef _MSC_VER
+#pragma warning(push)
+#pragma warning(disable : 4244)
+#endif
+
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
+
+void VideoFramePool::attach(AVCodecContext *context) noexcept
+{
+    if (!(context->codec->capabilities & AV_CODEC_CAP_DR1))
+    {
+        return;
+    }
+
+    context->opaque = this;
+    context->get_buffer2 = &VideoFramePool::getBuffer;
+}
+
+void VideoFramePool::reset() noexcept
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for (auto &pool : m_pools)
+    {
+        if (pool)
+        {
+            av_buffer_pool_uninit(&pool);
+        }
+    }
+
+    m_format = AV_PIX_FMT_NONE;
+    m_width = 0;
+    m_height = 0;
+}
+
+int VideoFramePool::getBuffer(AVCodecContext *context, AVFrame *frame, int flags)
+{
+    auto pool = static_cast<VideoFramePool *>(context->opaque);
+
+    const auto format = static_cast<AVPixelFormat>(frame->format);
+    const auto descriptor = av_pix_fmt_desc_get(format);
+
+    // Hardware and paletted frames need more than plain planes
+    if (!pool || !descriptor || (descriptor->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL)))
+    {
+        return avcodec_default_get_buffer2(context, frame, flags);
+    }
+
+    std::lock_guard<std::mutex> lock(pool->m_mutex);
+
+    if ((format != pool->m_format) || (frame->width != pool->m_width) || (frame->height != pool->m_height))
+    {
+        if (!pool->configure(context, format, frame->width, frame->height))
+        {
+            return avcodec_default_get_buffer2(context, frame, flags);
+        }
+    }
+
+    return pool->fill(frame) ? 0 : AVERROR(ENOMEM);
+}
+
+bool VideoFramePool::configure(AVCodecContext *context, const AVPixelFormat format,
+                               const int width, const int height) noexcept
+{
+    for (auto &pool : m_pools)
+    {
+        if (pool)
+        {
+            // Frames from the old layout keep their buffers until released
+            av_buffer_pool_uninit(&pool);
+        }
+    }
+
+    m_format = AV_PIX_FMT_NONE;
+
+    // Let the codec grow the picture to what its motion compensation and
+    // edge emulation write to, then widen it until every line is aligned.
+    int alignedWidth{width};
+    int alignedHeight{height};
+    int linesizeAlign[AV_NUM_DATA_POINTERS];
+    avcodec_align_dimensions2(context, &alignedWidth, &alignedHeight, linesizeAlign);
+
+    int linesizes[kMaxPlanes]{};
+    for (;;)
+    {
+        if (av_image_fill_linesizes(linesizes, format, alignedWidth) < 0)
+        {
+            return false;
+        }
+
+        bool aligned{true};
+        for (std::size_t i{0}; i < kMaxPlanes; ++i)
+        {
+            aligned &= ((linesizes[i] % kAlignment) == 0);
+        }
+
+        if (aligned)
+        {
+            break;
+        }
+
+        // Adding the lowest set bit doubles the width's power of two factor
+        alignedWidth += alignedWidth & ~(alignedWidth - 1);
+    }
+
+    // With a null base pointer the plane pointers are the plane offsets
+    uint8_t *planes[kMaxPlanes]{};
+    const auto totalSize = av_image_fill_pointers(planes, format, alignedHeight, nullptr, linesizes);
+    if (totalSize < 0)
+    {
+        return false;
+    }
+
+    for (std::size_t i{0}; i < kMaxPlanes; ++i)
+    {
+        m_linesizes[i] = linesizes[i];
+
+        if (!linesizes[i])
+        {
+            continue;
+        }
+
+        const auto end = ((i + 1 < kMaxPlanes) && planes[i + 1]) ? planes[i + 1] - planes[0] : totalSize;
+        const auto planeSize = static_cast<std::size_t>(end - (planes[i] - planes[0]));
+
+        // Slack for SIMD loads that overrun the last line
+        m_pools[i] = av_buffer_pool_init(planeSize + 16 + kAlignment - 1, av_buffer_alloc);
+        if (!m_pools[i])
+        {
+            return false;
+        }
+    }
+
+    m_format = format;
+    m_width = width;
+    m_height = height;
+
+    blog(LOG_INFO, "Decoding %dx%d %s into pooled frames", width, height, av_get_pix_fmt_name(format));
+
+    return true;
+}
+
+bool VideoFramePool::fill(AVFrame *frame) noexcept
+{
+    for (std::size_t i{0}; i < kMaxPlanes; ++i)
+    {
+        if (!m_pools[i])
+        {
+            break;
+        }
+
+        frame->buf[i] = av_buffer_pool_get(m_pools[i]);
+        if (!frame->buf[i])
+        {
+            // libavcodec unreferences whatever was attached on failure
+            return false;
+        }
+
+        frame->data[i] = frame->buf[i]->data;
+        frame->linesize[i] = m_linesizes[i];
+    }
+
+    frame->extended_data = frame->data;
+
+    return true;
+}
@@ -0,0 +1,80 @@
+/*
+ obs-iDevice-cam-source
+Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef VideoFramePool_hpp
+#define VideoFramePool_hpp
+
+#ifdef _MSC_VER
+#pragma warning(push)
+#pragma warning(disable : 4244)
+#pragma warning(disable : 4204)
+#endif
+
+#include <libavcodec/avcodec.h>
+
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
+
+#include <array>
+#include <cstddef>
+#include <mutex>
+
+// Recycles the picture buffers libavcodec decodes into. Installed as the
+// decoder's get_buffer2 callback, it hands out one reference-counted buffer
+// per plane from pools laid out for the stream's current format and coded
+// size (i.e. whatever the SPS says). A buffer goes back to its pool once
+// the decoder and every AVFrame referencing it have let go, so a picture
+// still being read by OBS is never decoded into.
+class VideoFramePool final
+{
+public:
+    VideoFramePool() = default;
+    ~VideoFramePool() { reset(); }
+
+    VideoFramePool(const VideoFramePool &other) = delete;
+    VideoFramePool &operator=(const VideoFramePool &other) = delete;
+
+    // Points context->get_buffer2 at this pool if the codec supports it
+    void attach(AVCodecContext *context) noexcept;
+
+    // Drops the pools. Buffers still in use are freed when released.
+    void reset() noexcept;
+
+private:
+    // Linesizes are rounded up to this, which covers AVX-512 loads
+    static constexpr int kAlignment{64};
+    static constexpr std::size_t kMaxPlanes{4};
+
+    static int getBuffer(AVCodecContext *context, AVFrame *frame, int flags);
+
+    bool configure(AVCodecContext *context, const AVPixelFormat format,
+                   const int width, const int height) noexcept;
+    bool fill(AVFrame *frame) noexcept;
+
+    // get_buffer2 is called from libavcodec's frame threads
+    std::mutex                                  m_mutex{};
+
+    AVPixelFormat                               m_format{AV_PIX_FMT_NONE};
+    int                                         m_width{0};
+    int                                         m_height{0};
+    std::array<int, kMaxPlanes>                 m_linesizes{};
+    std::array<AVBufferPool *, kMaxPlanes>      m_pools{};
+};
+
+#endif // VideoFramePool_hpp
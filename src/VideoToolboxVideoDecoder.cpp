@@ -30,20 +30,55 @@ void VideoToolboxDecoder::init()
     start();
 }
 
-void VideoToolboxDecoder::input(const Packet packet, const int type, const int tag)
+void VideoToolboxDecoder::input(const Packet &packet, const int type, const int tag)
 {
-    m_queue.add(new PacketItem(packet, type, tag));
+    m_queue.push(PacketItem(packet, type, tag));
+}
+
+void VideoToolboxDecoder::input(const portal::ProtocolPacketSpan &packets)
+{
+    for (const auto &packet : packets)
+    {
+        if (packet.type == PacketTypeVideo)
+        {
+            m_batch.emplace_back(packet.packet, packet.type, packet.tag);
+        }
+    }
+
+    // Enqueue the whole read with a single wakeup
+    m_queue.push(m_batch.data(), m_batch.size());
+    m_batch.clear();
 }
 
 void VideoToolboxDecoder::flush()
 {
-    while (m_queue.size() > 0)
+    if (isStopped())
+    {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock{m_mutex};
+    m_flushRequested = true;
+    m_queue.wake();
+
+    m_flushCv.wait(lock, [&]() { return !m_flushRequested || isStopped(); });
+}
+
+void VideoToolboxDecoder::processFlushRequest()
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+    if (!m_flushRequested)
     {
-        m_queue.remove();
+        return;
     }
 
+    m_queue.clear();
+
     VTDecompressionSessionInvalidate(m_session);
     m_session = nullptr;
+
+    m_flushRequested = false;
+    m_flushCv.notify_all();
 }
 
 void VideoToolboxDecoder::drain()
@@ -61,29 +96,40 @@ void VideoToolboxDecoder::shutdown()
     }
 
     join();
+
+    // Release anyone still waiting for a flush
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_flushRequested = false;
+    m_flushCv.notify_all();
 }
 
 void *VideoToolboxDecoder::run()
 {
-    while (!isStopped())
+    m_items.resize(m_queue.capacity());
+
+    while (!isStopped() && m_queue.wait())
     {
-        auto item = (PacketItem *)m_queue.remove();
-        if (item)
+        processFlushRequest();
+
+        const auto count = m_queue.pop(m_items.data(), m_items.size());
+        for (std::size_t i{0}; i < count; ++i)
         {
-            processPacketItem(item);
-            delete item;
+            processPacketItem(m_items[i]);
+
+            // Release the packet so its buffer can be recycled
+            m_items[i] = PacketItem{};
         }
     }
 
     return nullptr;
 }
 
-void VideoToolboxDecoder::processPacketItem(PacketItem *packetItem)
+void VideoToolboxDecoder::processPacketItem(const PacketItem &packetItem)
 {
-    const auto packet = packetItem->getPacket();
+    const auto &packet = packetItem.getPacket();
     const uint32_t frameSize = packet.size();
 
-    if (frameSize < 3)
+    if (frameSize < 5)
     {
         return;
     }
@@ -96,7 +142,7 @@ void VideoToolboxDecoder::processPacketItem(PacketItem *packetItem)
         // NALU is the SPS Parameter
         if (naluType == 7)
         {
-            m_spsData = Packet(packet.begin() + 4, packet.end() + (frameSize - 4));
+            m_spsData = std::vector<char>(packet.begin() + 4, packet.end());
             m_waitingForSps = false;
             m_waitingForPps = true;
         }
@@ -104,7 +150,7 @@ void VideoToolboxDecoder::processPacketItem(PacketItem *packetItem)
         // NALU is the PPS Parameter
         if (naluType == 8)
         {
-            m_ppsData = Packet(packet.begin() + 4, packet.end() + (frameSize - 4));
+            m_ppsData = std::vector<char>(packet.begin() + 4, packet.end());
             m_waitingForPps = false;
         }
 
@@ -178,57 +224,42 @@ void VideoToolboxDecoder::processPacketItem(PacketItem *packetItem)
     // Create the sample data for the decoder
 
     CMBlockBufferRef blockBuffer{nullptr};
-    long blockLength{0};
-
-    // type 5 is an IDR frame NALU. The SPS and PPS NALUs should always be followed by an IDR (or IFrame) NALU, as far as I know
-    if (naluType == 5)
+    const long blockLength = frameSize;
+
+    // Both IDR (type 5) and non-IDR (type 1) pictures go in as one NALU.
+    // AVCC format requires the start code be replaced with the NALU's size,
+    // which is done in a block buffer of our own: the payload is shared with
+    // the replay buffer and the recorder, and must not be written to.
+    status = CMBlockBufferCreateWithMemoryBlock(kCFAllocatorDefault,
+                                                nullptr,            // allocate the block here
+                                                blockLength,        // block length of the mem block in bytes.
+                                                kCFAllocatorDefault,
+                                                nullptr,
+                                                0,           // offsetToData
+                                                blockLength, // dataLength of relevant bytes, starting at offsetToData
+                                                kCMBlockBufferAssureMemoryNowFlag,
+                                                &blockBuffer);
+
+    if (status == noErr)
     {
-        blockLength = frameSize;
-
-        // replace the start code header on this NALU with its size.
-        // AVCC format requires that you do this.
         // htonl converts the unsigned int from host to network byte order
         const uint32_t dataLength32 = htonl(blockLength - 4);
-        memcpy(packet.data(), &dataLength32, sizeof(uint32_t));
-
-        // create a block buffer from the IDR NALU
-        status = CMBlockBufferCreateWithMemoryBlock(nullptr,
-                                                    packet.data(), // memoryBlock to hold buffered data
-                                                    blockLength,         // block length of the mem block in bytes.
-                                                    kCFAllocatorNull,
-                                                    nullptr,
-                                                    0,           // offsetToData
-                                                    blockLength, // dataLength of relevant bytes, starting at offsetToData
-                                                    0,
-                                                    &blockBuffer);
+        status = CMBlockBufferReplaceDataBytes(&dataLength32, blockBuffer, 0, sizeof(uint32_t));
     }
 
-    // NALU type 1 is non-IDR (or PFrame) picture
-    if (naluType == 1)
+    if (status == noErr)
     {
-        // non-IDR frames do not have an offset due to SPS and PSS, so the approach
-        // is similar to the IDR frames just without the offset
-        blockLength = frameSize;
-
-        // again, replace the start header with the size of the NALU
-        const uint32_t dataLength32 = htonl(blockLength - 4);
-        memcpy(packet.data(), &dataLength32, sizeof(uint32_t));
-
-        status = CMBlockBufferCreateWithMemoryBlock(nullptr,
-                                                    packet.data(), // memoryBlock to hold data. If NULL, block will be alloc when needed
-                                                    blockLength,         // overall length of the mem block in bytes
-                                                    kCFAllocatorNull,
-                                                    nullptr,
-                                                    0,           // offsetToData
-                                                    blockLength, // dataLength of relevant data bytes, starting at offsetToData
-                                                    0,
-                                                    &blockBuffer);
+        status = CMBlockBufferReplaceDataBytes(packet.data() + 4, blockBuffer, 4, blockLength - 4);
     }
 
     // now create our sample buffer from the block buffer,
     if (status != noErr)
     {
         // NSLog(@"Error creating block buffer: %@", @(status));
+        if (blockBuffer)
+        {
+            CFRelease(blockBuffer);
+        }
         return;
     }
 
@@ -258,6 +289,14 @@ void VideoToolboxDecoder::processPacketItem(PacketItem *packetItem)
                                   &sampleSize,
                                   &sampleBuffer);
 
+    // The sample buffer keeps its own reference to the block
+    CFRelease(blockBuffer);
+
+    if (status != noErr)
+    {
+        return;
+    }
+
     VTDecodeFrameFlags flags{0};
     VTDecodeInfoFlags flagOut{};
 
@@ -280,20 +319,24 @@ void VideoToolboxDecoder::outputFrame(CVPixelBufferRef pixelBufferRef)
     // kCMTimeRoundingMethod_Default);
     // frame->timestamp = target_pts_nano.value;
 
-    if (!updateFrame(source, &frame, image, m_format))
+    if (!m_outputs)
+    {
+        return;
+    }
+
+    if (!updateFrame(&frame, image, m_format))
     {
         // Send blank video
-        obs_source_output_video(source, nullptr);
+        m_outputs->outputVideo(nullptr);
         return;
     }
 
-    obs_source_output_video(source, &frame);
+    m_outputs->outputVideo(&frame);
 
     CVPixelBufferUnlockBaseAddress(image, kCVPixelBufferLock_ReadOnly);
 }
 
-bool VideoToolboxDecoder::updateFrame(obs_source_t* capture,
-                                      obs_source_frame* frame,
+bool VideoToolboxDecoder::updateFrame(obs_source_frame* frame,
                                       CVImageBufferRef imageBufferRef,
                                       CMVideoFormatDescriptionRef formatDesc)
 {
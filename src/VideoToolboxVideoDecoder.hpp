@@ -28,6 +28,7 @@ Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
 #include "Queue.hpp"
 #include "Thread.hpp"
 #include "Decoder.hpp"
+#include "SourceOutputs.hpp"
 
 class VideoToolboxDecoder final : public Decoder, private Thread
 {
@@ -36,20 +37,20 @@ public:
     ~VideoToolboxDecoder();
 
     void init() override;
-    void input(const Packet packet, const int type, const int tag) override;
+    void input(const Packet &packet, const int type, const int tag) override;
+    void input(const portal::ProtocolPacketSpan &packets) override;
     void flush() override;
     void drain() override;
     void shutdown() override;
 
     void outputFrame(CVPixelBufferRef pixelBufferRef);
-    bool updateFrame(obs_source_t* capture, obs_source_frame* frame,
-                     CVImageBufferRef imageBufferRef,
+    bool updateFrame(obs_source_frame* frame, CVImageBufferRef imageBufferRef,
                      CMVideoFormatDescriptionRef formatDesc);
 
     // Public data members
 
-    // The OBS Source to update.
-    obs_source_t*                   m_source{nullptr};
+    // The OBS Sources to update.
+    SourceOutputs*                  m_outputs{nullptr};
 
 private:
     // Data members
@@ -60,16 +61,27 @@ private:
     bool                            m_waitingForSps{false};
     bool                            m_waitingForPps{false};
 
-    Packet                          m_spsData{};
-    Packet                          m_ppsData{};
+    std::vector<char>               m_spsData{};
+    std::vector<char>               m_ppsData{};
 
-    WorkQueue<PacketItem*>          m_queue{};
+    static constexpr std::size_t    kQueueCapacity{64};
+
+    SPSCQueue<PacketItem>           m_queue{kQueueCapacity, OverflowPolicy::DropNewest};
+    std::vector<PacketItem>         m_batch{};      // Producer side scratch
+    std::vector<PacketItem>         m_items{};      // Consumer side scratch
+
+    // flush() hands the work to the decoding thread, which is the only one
+    // allowed to consume from m_queue or touch m_session.
+    std::mutex                      m_mutex{};
+    std::condition_variable         m_flushCv{};
+    bool                            m_flushRequested{false};
     obs_source_frame                m_frame{};
 
     // Utility functions
 
     void *run() override; // Thread callback
-    void processPacketItem(PacketItem *packetItem);
+    void processPacketItem(const PacketItem &packetItem);
+    void processFlushRequest();
 
     void createDecompressionSession();
 };
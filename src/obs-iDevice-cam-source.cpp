@@ -18,15 +18,12 @@ Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
 
 #include <obs-module.h>
 #include <chrono>
+#include <ctime>
 #include <usbmuxd.h>
 #include <obs-avc.h>
 
 #include "Portal.hpp"
-#include "FFMpegVideoDecoder.hpp"
-#include "FFMpegAudioDecoder.hpp"
-#ifdef __APPLE__
-#include "VideoToolboxVideoDecoder.hpp"
-#endif
+#include "DeviceSession.hpp"
 
 #define TEXT_INPUT_NAME                 obs_module_text("IDEVICESCAM.Title")
 
@@ -35,7 +32,20 @@ Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
 #define SETTING_PROP_LATENCY            "latency"
 #define SETTING_PROP_LATENCY_NORMAL     0
 #define SETTING_PROP_LATENCY_LOW        1
+#define SETTING_PROP_LATENCY_ULTRA_LOW  2
 #define SETTING_PROP_HARDWARE_DECODER   "setting_use_hw_decoder"
+#define SETTING_PROP_DECODE_THREADS     "decode_threads"
+#define SETTING_PROP_DECODE_THREADING   "decode_threading"
+#define SETTING_PROP_DECODE_THREADING_AUTO  0
+#define SETTING_PROP_DECODE_THREADING_FRAME 1
+#define SETTING_PROP_DECODE_THREADING_SLICE 2
+#define SETTING_PROP_JITTER_BUFFER_DEPTH    "jitter_buffer_depth"
+#define SETTING_PROP_DECODE_QUALITY         "decode_quality"
+#define SETTING_PROP_REFRESH_STATUS         "refresh_status"
+#define SETTING_PROP_REPLAY_DURATION        "replay_duration"
+#define SETTING_PROP_REPLAY_DIRECTORY       "replay_directory"
+#define SETTING_PROP_REPLAY_SAVE            "replay_save"
+#define SETTING_PROP_RECORD_TOGGLE          "record_toggle"
 
 using namespace portal;
 
@@ -45,18 +55,24 @@ public:
     obs_source_t*           m_source{nullptr};
     obs_data_t*             m_settings{nullptr};
     bool                    m_active{false};
+    bool                    m_showing{false};
     obs_source_frame        m_frame{};
     std::string             m_deviceUUID{};
     Portal::shared_ptr      m_sharedPortal{nullptr};
     Portal                  m_portal{};
-    VideoDecoder*           m_videoDecoder{nullptr};
 
-#ifdef __APPLE__
-    VideoToolboxDecoder     m_videoToolboxVideoDecoder{};
-#endif
+    // Shared with every other source showing the same device. Set once the
+    // device has been found.
+    std::mutex              m_sessionMutex{};
+    DeviceSession::shared_ptr m_session{nullptr};
 
-    FFMpegVideoDecoder      m_ffmpegVideoDecoder{};
-    FFMpegAudioDecoder      m_ffmpegAudioDecoder{};
+    // Guarded by m_sessionMutex. This source's settings, handed to the
+    // session, which merges them with its other sources', whenever they
+    // change. The hotkey fires on a thread of its own.
+    SourceSettings          m_sourceSettings{};
+    std::string             m_replayDirectory{};
+    obs_hotkey_id           m_saveReplayHotkey{OBS_INVALID_HOTKEY_ID};
+    obs_hotkey_id           m_toggleRecordingHotkey{OBS_INVALID_HOTKEY_ID};
 
     IOSCameraInput(obs_source_t* source, obs_data_t* settings)
         :
@@ -76,78 +92,267 @@ public:
         const auto portalReference = std::shared_ptr<portal::Portal>(&portal, null_deleter);
         m_sharedPortal = portalReference;
 
-#ifdef __APPLE__
-        m_videoToolboxVideoDecoder.m_source = m_source;
-        m_videoToolboxVideoDecoder.init();
-#endif
+        m_active = obs_source_active(m_source);
+        m_showing = obs_source_showing(m_source);
 
-        m_ffmpegVideoDecoder.m_source = m_source;
-        m_ffmpegVideoDecoder.init();
+        loadSettings(m_settings);
 
-        m_ffmpegAudioDecoder.m_source = m_source;
-        m_ffmpegAudioDecoder.init();
+        m_saveReplayHotkey = obs_hotkey_register_source(m_source, "idevices.save_replay",
+                                                        obs_module_text("IDEVICESCAM.SaveReplay"),
+                                                        onSaveReplayHotkey, this);
 
-        m_videoDecoder = &m_ffmpegVideoDecoder;
+        m_toggleRecordingHotkey = obs_hotkey_register_source(m_source, "idevices.toggle_recording",
+                                                             obs_module_text("IDEVICESCAM.ToggleRecording"),
+                                                             onToggleRecordingHotkey, this);
+    }
 
-        loadSettings(m_settings);
-        m_active = true;
+    ~IOSCameraInput()
+    {
+        obs_hotkey_unregister(m_saveReplayHotkey);
+        obs_hotkey_unregister(m_toggleRecordingHotkey);
+
+        // The other sources keep the device; the last one disconnects it
+        std::lock_guard<std::mutex> lock{m_sessionMutex};
+        if (m_session)
+        {
+            m_session->detach(m_source);
+            m_session = nullptr;
+        }
     }
 
-    ~IOSCameraInput() = default;
+    DeviceSession::shared_ptr session()
+    {
+        std::lock_guard<std::mutex> lock{m_sessionMutex};
+        return m_session;
+    }
 
     void activate()
     {
         blog(LOG_INFO, "Activating");
         m_active = true;
+        updateDecoding();
     }
 
     void deactivate()
     {
         blog(LOG_INFO, "Deactivating");
         m_active = false;
+        updateDecoding();
+    }
+
+    void show()
+    {
+        m_showing = true;
+        updateDecoding();
+    }
+
+    void hide()
+    {
+        m_showing = false;
+        updateDecoding();
+    }
+
+    void updateDecoding()
+    {
+        // The session decodes for whichever of its sources needs it most
+        const auto session = this->session();
+        if (session)
+        {
+            session->setSourceState(m_source, m_active, m_showing);
+        }
     }
 
     void loadSettings(obs_data_t* settings)
     {
+        updateDecodeOptions(settings);
+        updateLatencyMode(settings);
+#ifdef __APPLE__
+        updateHardwareDecoder(settings);
+#endif
+        updateReplay(settings);
+
         const auto device_uuid = obs_data_get_string(settings, SETTING_DEVICE_UUID);
 
         blog(LOG_INFO, "Loaded Settings: Connecting to device");
         connectToDevice(device_uuid, false);
     }
 
-    void reconnectToDevice()
+    void updateDecodeOptions(obs_data_t* settings)
     {
-        if (m_deviceUUID.size() >= 1)
+        const auto latency = obs_data_get_int(settings, SETTING_PROP_LATENCY);
+        const auto is_unbuffered = (latency != SETTING_PROP_LATENCY_NORMAL);
+
+        DecodeOptions decodeOptions{};
+        decodeOptions.threadCount = (int)obs_data_get_int(settings, SETTING_PROP_DECODE_THREADS);
+
+        // Ultra Low outputs each picture the moment it is decoded, which
+        // rules out frame threading whatever the threading setting says
+        decodeOptions.immediateOutput = (latency == SETTING_PROP_LATENCY_ULTRA_LOW);
+
+        switch (obs_data_get_int(settings, SETTING_PROP_DECODE_THREADING))
         {
-            connectToDevice(m_deviceUUID, true);
+        case SETTING_PROP_DECODE_THREADING_FRAME:
+            decodeOptions.threading = DecodeThreading::FrameAndSlice;
+            break;
+
+        case SETTING_PROP_DECODE_THREADING_SLICE:
+            decodeOptions.threading = DecodeThreading::Slice;
+            break;
+
+        default:
+            // Frame threading holds back one frame per extra thread, so
+            // only use it when OBS is buffering anyway.
+            decodeOptions.threading = is_unbuffered ? DecodeThreading::Slice : DecodeThreading::FrameAndSlice;
+            break;
         }
+
+        std::lock_guard<std::mutex> lock{m_sessionMutex};
+        m_sourceSettings.decodeOptions = decodeOptions;
+        applySettingsLocked();
     }
 
-    void connectToDevice(const std::string uuid, const bool force)
+    void updateLatencyMode(obs_data_t* settings)
+    {
+        std::lock_guard<std::mutex> lock{m_sessionMutex};
+        m_sourceSettings.isUnbuffered = (obs_data_get_int(settings, SETTING_PROP_LATENCY) != SETTING_PROP_LATENCY_NORMAL);
+        applySettingsLocked();
+    }
+
+#ifdef __APPLE__
+    void updateHardwareDecoder(obs_data_t* settings)
+    {
+        std::lock_guard<std::mutex> lock{m_sessionMutex};
+        m_sourceSettings.useHardwareDecoder = obs_data_get_bool(settings, SETTING_PROP_HARDWARE_DECODER);
+        applySettingsLocked();
+    }
+#endif
+
+    void updateReplay(obs_data_t* settings)
+    {
+        std::lock_guard<std::mutex> lock{m_sessionMutex};
+
+        m_sourceSettings.replayDuration =
+            static_cast<uint64_t>(obs_data_get_int(settings, SETTING_PROP_REPLAY_DURATION)) * 1000000000;
+        m_replayDirectory = obs_data_get_string(settings, SETTING_PROP_REPLAY_DIRECTORY);
+
+        applySettingsLocked();
+    }
+
+    // Expects m_sessionMutex to be held
+    void applySettingsLocked()
     {
-        if (m_portal.m_device)
+        if (m_session)
         {
-            // Make sure that we're not already connected to the device
-            if ((force == false) &&
-                (m_portal.m_device->uuid().compare(uuid) == 0) &&
-                m_portal.m_device->isConnected())
-            {
-                blog(LOG_DEBUG, "Already connected to the device. Skipping.");
-                return;
-            }
+            m_session->setSourceSettings(m_source, m_sourceSettings);
+        }
+    }
+
+    void saveReplay()
+    {
+        std::string directory;
+        DeviceSession::shared_ptr session;
+        {
+            std::lock_guard<std::mutex> lock{m_sessionMutex};
+            directory = m_replayDirectory;
+            session = m_session;
+        }
+
+        if (!session)
+        {
+            blog(LOG_WARNING, "No device to save a replay of");
+            return;
+        }
 
-            // Disconnect from from the old device
-            m_portal.m_device->disconnect();
-            m_portal.m_device = nullptr;
+        if (directory.empty())
+        {
+            blog(LOG_WARNING, "Choose a folder for replays in the source's properties first");
+            return;
         }
 
-        blog(LOG_INFO, "Connecting to device");
+        session->saveReplay(outputPath(directory, "Replay %Y-%m-%d %H-%M-%S ", *session));
+    }
+
+    void toggleRecording()
+    {
+        std::string directory;
+        DeviceSession::shared_ptr session;
+        {
+            std::lock_guard<std::mutex> lock{m_sessionMutex};
+            directory = m_replayDirectory;
+            session = m_session;
+        }
 
-        m_ffmpegVideoDecoder.flush();
+        if (!session)
+        {
+            blog(LOG_WARNING, "No device to record");
+            return;
+        }
 
-#ifdef __APPLE__
-        m_videoToolboxVideoDecoder.Flush();
-#endif
+        if (session->isRecording())
+        {
+            session->stopRecording();
+            return;
+        }
+
+        if (directory.empty())
+        {
+            blog(LOG_WARNING, "Choose a folder for recordings in the source's properties first");
+            return;
+        }
+
+        session->startRecording(outputPath(directory, "Recording %Y-%m-%d %H-%M-%S ", *session) + ".mp4");
+    }
+
+    // Named after the device too, in case several are saved at once
+    static std::string outputPath(const std::string &directory, const char *format, const DeviceSession &session)
+    {
+        char name[64];
+        const auto now = time(nullptr);
+        strftime(name, sizeof(name), format, localtime(&now));
+
+        return directory + "/" + name + session.uuid().substr(0, 8);
+    }
+
+    static void onSaveReplayHotkey(void* data, obs_hotkey_id id, obs_hotkey_t* hotkey, bool pressed)
+    {
+        UNUSED_PARAMETER(id);
+        UNUSED_PARAMETER(hotkey);
+
+        if (pressed)
+        {
+            reinterpret_cast<IOSCameraInput *>(data)->saveReplay();
+        }
+    }
+
+    static void onToggleRecordingHotkey(void* data, obs_hotkey_id id, obs_hotkey_t* hotkey, bool pressed)
+    {
+        UNUSED_PARAMETER(id);
+        UNUSED_PARAMETER(hotkey);
+
+        if (pressed)
+        {
+            reinterpret_cast<IOSCameraInput *>(data)->toggleRecording();
+        }
+    }
+
+    void reconnectToDevice()
+    {
+        if (m_deviceUUID.size() >= 1)
+        {
+            connectToDevice(m_deviceUUID, true);
+        }
+    }
+
+    void connectToDevice(const std::string uuid, const bool force)
+    {
+        std::lock_guard<std::mutex> lock{m_sessionMutex};
+
+        if (m_session && (m_session->uuid().compare(uuid) != 0))
+        {
+            // Leave the old device to the sources still showing it
+            m_session->detach(m_source);
+            m_session = nullptr;
+        }
 
         // Find device
         auto devices = m_portal.getDevices();
@@ -159,41 +364,24 @@ public:
             if (device_uuid.compare(uuid) == 0)
             {
                 blog(LOG_DEBUG, "comparing \n%s\n%s\n", device_uuid.c_str(), uuid.c_str());
-                m_portal.connectToDevice(device);
-            }
-        }
-    }
-
-    void portal_onDevicePacketReceive(std::vector<char> packet, const int type, const int tag)
-    {
-        enum class PacketType { Video = 101, Audio = 102 };
 
-        try
-        {
-            switch (type)
-            {
-            case PacketType::Video:
-                m_videoDecoder->input(packet, type, tag);
-                break;
-
-            case PacketType::Audio:
-                m_ffmpegAudioDecoder.input(packet, type, tag);
-                break;
+                if (!m_session)
+                {
+                    m_session = DeviceSession::acquire(uuid);
+                    m_session->attach(m_source, m_active, m_showing, m_sourceSettings);
+                }
 
-            default:
-                break;
+                // Another source may have connected the session already
+                m_session->connect(device, force);
             }
         }
-        catch (...)
-        {
-            // This isn't great, but I haven't been able to figure out what is
-            // causing the exception that happens when the phone is plugged in
-            // with the app open OBS Studio is launched with the iOS Camera
-            // plugin ready. This also doesn't happen _all_ the time. Which
-            // makes this 'fun'.
+    }
 
-            blog(LOG_INFO, "Exception caught...");
-        }
+    void portal_onDevicePacketsReceive(const ProtocolPacketSpan &packets) override
+    {
+        // Device sessions connect to the devices and receive their packets;
+        // this Portal only lists them.
+        UNUSED_PARAMETER(packets);
     }
 
     void portal_onDeviceListUpdate(const DeviceMap deviceMap)
@@ -243,6 +431,68 @@ public:
 
 #pragma mark - Settings Config
 
+static void updateStatusProperties(obs_properties_t* props, IOSCameraInput* cameraInput)
+{
+    const auto session = cameraInput ? cameraInput->session() : nullptr;
+
+    auto depthProperty = obs_properties_get(props, SETTING_PROP_JITTER_BUFFER_DEPTH);
+    const auto showsDepth = session && session->jitterBuffer().isEnabled();
+    obs_property_set_visible(depthProperty, showsDepth);
+
+    if (showsDepth)
+    {
+        char depth[128];
+        snprintf(depth, sizeof(depth), "%s: %.0f ms", obs_module_text("IDEVICESCAM.Settings.JitterBufferDepth"),
+                 static_cast<double>(session->jitterBuffer().depth()) / 1000000.0);
+
+        obs_property_set_description(depthProperty, depth);
+    }
+
+    auto qualityProperty = obs_properties_get(props, SETTING_PROP_DECODE_QUALITY);
+    const auto showsQuality = session && session->usesSoftwareDecoder();
+    obs_property_set_visible(qualityProperty, showsQuality);
+
+    if (showsQuality)
+    {
+        const auto &governor = session->governor();
+
+        const char *level{nullptr};
+        switch (governor.level())
+        {
+        case DecodeLevel::Full:
+            level = obs_module_text("IDEVICESCAM.Settings.DecodeQuality.Full");
+            break;
+        case DecodeLevel::NoLoopFilter:
+            level = obs_module_text("IDEVICESCAM.Settings.DecodeQuality.NoLoopFilter");
+            break;
+        case DecodeLevel::SkipNonReference:
+            level = obs_module_text("IDEVICESCAM.Settings.DecodeQuality.SkipNonReference");
+            break;
+        case DecodeLevel::KeyframesOnly:
+            level = obs_module_text("IDEVICESCAM.Settings.DecodeQuality.KeyframesOnly");
+            break;
+        }
+
+        // With why it last changed
+        const auto reason = governor.reason();
+
+        char quality[320];
+        snprintf(quality, sizeof(quality), reason.empty() ? "%s: %s" : "%s: %s (%s)",
+                 obs_module_text("IDEVICESCAM.Settings.DecodeQuality"), level, reason.c_str());
+
+        obs_property_set_description(qualityProperty, quality);
+    }
+}
+
+static bool refreshStatus(obs_properties_t* props, obs_property_t* p, void* data)
+{
+    UNUSED_PARAMETER(p);
+
+    // Both read live state, so they're only current as of the last refresh
+    updateStatusProperties(props, reinterpret_cast<IOSCameraInput *>(data));
+    return true;
+}
+
 static bool refereshDevices(obs_properties_t* props, obs_property_t* p, void* data)
 {
     UNUSED_PARAMETER(p);
@@ -280,6 +530,28 @@ static bool reconnectToDevice(obs_properties_t* props, obs_property_t* p, void*
     return false;
 }
 
+static bool saveReplay(obs_properties_t* props, obs_property_t* p, void* data)
+{
+    UNUSED_PARAMETER(props);
+    UNUSED_PARAMETER(p);
+
+    auto cameraInput = reinterpret_cast<IOSCameraInput *>(data);
+    cameraInput->saveReplay();
+
+    return false;
+}
+
+static bool toggleRecording(obs_properties_t* props, obs_property_t* p, void* data)
+{
+    UNUSED_PARAMETER(props);
+    UNUSED_PARAMETER(p);
+
+    auto cameraInput = reinterpret_cast<IOSCameraInput *>(data);
+    cameraInput->toggleRecording();
+
+    return false;
+}
+
 #pragma mark - Plugin Callbacks
 
 static const char *getIosCameraInputName(void *)
@@ -320,6 +592,18 @@ static void activateIosCameraInput(void* data)
     cameraInput->activate();
 }
 
+static void showIosCameraInput(void* data)
+{
+    auto cameraInput = reinterpret_cast<IOSCameraInput *>(data);
+    cameraInput->show();
+}
+
+static void hideIosCameraInput(void* data)
+{
+    auto cameraInput = reinterpret_cast<IOSCameraInput *>(data);
+    cameraInput->hide();
+}
+
 static obs_properties_t *getIosCameraProperties(void* data)
 {
     UNUSED_PARAMETER(data);
@@ -350,11 +634,55 @@ static obs_properties_t *getIosCameraProperties(void* data)
                               obs_module_text("IDEVICESCAM.Settings.Latency.Low"),
                               SETTING_PROP_LATENCY_LOW);
 
+    obs_property_list_add_int(latency_modes,
+                              obs_module_text("IDEVICESCAM.Settings.Latency.UltraLow"),
+                              SETTING_PROP_LATENCY_ULTRA_LOW);
+
+    obs_properties_add_text(ppts, SETTING_PROP_JITTER_BUFFER_DEPTH,
+                            obs_module_text("IDEVICESCAM.Settings.JitterBufferDepth"), OBS_TEXT_INFO);
+    obs_properties_add_text(ppts, SETTING_PROP_DECODE_QUALITY,
+                            obs_module_text("IDEVICESCAM.Settings.DecodeQuality"), OBS_TEXT_INFO);
+    obs_properties_add_button(ppts, SETTING_PROP_REFRESH_STATUS,
+                              obs_module_text("IDEVICESCAM.Settings.RefreshStatus"), refreshStatus);
+
+    updateStatusProperties(ppts, reinterpret_cast<IOSCameraInput *>(data));
+
+    auto threading_modes = obs_properties_add_list(ppts, SETTING_PROP_DECODE_THREADING,
+                                                   obs_module_text("IDEVICESCAM.Settings.DecodeThreading"),
+                                                   OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+
+    obs_property_list_add_int(threading_modes,
+                              obs_module_text("IDEVICESCAM.Settings.DecodeThreading.Auto"),
+                              SETTING_PROP_DECODE_THREADING_AUTO);
+
+    obs_property_list_add_int(threading_modes,
+                              obs_module_text("IDEVICESCAM.Settings.DecodeThreading.Frame"),
+                              SETTING_PROP_DECODE_THREADING_FRAME);
+
+    obs_property_list_add_int(threading_modes,
+                              obs_module_text("IDEVICESCAM.Settings.DecodeThreading.Slice"),
+                              SETTING_PROP_DECODE_THREADING_SLICE);
+
+    obs_properties_add_int(ppts, SETTING_PROP_DECODE_THREADS,
+                           obs_module_text("IDEVICESCAM.Settings.DecodeThreads"), 0, 16, 1);
+
 #ifdef __APPLE__
     obs_properties_add_bool(ppts, SETTING_PROP_HARDWARE_DECODER,
                             obs_module_text("IDEVICESCAM.Settings.UseHardwareDecoder"));
 #endif
 
+    obs_properties_add_int(ppts, SETTING_PROP_REPLAY_DURATION,
+                           obs_module_text("IDEVICESCAM.Settings.ReplayDuration"), 0, 600, 5);
+
+    obs_properties_add_path(ppts, SETTING_PROP_REPLAY_DIRECTORY,
+                            obs_module_text("IDEVICESCAM.Settings.ReplayDirectory"),
+                            OBS_PATH_DIRECTORY, nullptr, nullptr);
+
+    obs_properties_add_button(ppts, SETTING_PROP_REPLAY_SAVE, obs_module_text("IDEVICESCAM.SaveReplay"), saveReplay);
+
+    obs_properties_add_button(ppts, SETTING_PROP_RECORD_TOGGLE, obs_module_text("IDEVICESCAM.ToggleRecording"),
+                              toggleRecording);
+
     return ppts;
 }
 
@@ -362,9 +690,13 @@ static void getIosCameraDefaults(obs_data_t* settings)
 {
     obs_data_set_default_string(settings, SETTING_DEVICE_UUID, "");
     obs_data_set_default_int(settings, SETTING_PROP_LATENCY, SETTING_PROP_LATENCY_LOW);
+    obs_data_set_default_int(settings, SETTING_PROP_DECODE_THREADING, SETTING_PROP_DECODE_THREADING_AUTO);
+    obs_data_set_default_int(settings, SETTING_PROP_DECODE_THREADS, 0);
 #ifdef __APPLE__
     obs_data_set_default_bool(settings, SETTING_PROP_HARDWARE_DECODER, false);
 #endif
+    obs_data_set_default_int(settings, SETTING_PROP_REPLAY_DURATION, 0);
+    obs_data_set_default_string(settings, SETTING_PROP_REPLAY_DIRECTORY, "");
 }
 
 static void saveIosCameraInput(void* data, obs_data_t* settings)
@@ -384,20 +716,14 @@ static void updateIosCameraInput(void* data, obs_data_t* settings)
     const auto uuid = obs_data_get_string(settings, SETTING_DEVICE_UUID);
     input->connectToDevice(uuid, false);
 
-    const auto is_unbuffered = (obs_data_get_int(settings, SETTING_PROP_LATENCY) == SETTING_PROP_LATENCY_LOW);
-    obs_source_set_async_unbuffered(input->m_source, is_unbuffered);
+    input->updateDecodeOptions(settings);
 
 #ifdef __APPLE__
-    bool useHardwareDecoder = obs_data_get_bool(settings, SETTING_PROP_HARDWARE_DECODER);
-    if (useHardwareDecoder)
-    {
-        input->m_videoDecoder = &input->m_videoToolboxVideoDecoder;
-    }
-    else
-    {
-        input->m_videoDecoder = &input->m_ffmpegVideoDecoder;
-    }
+    input->updateHardwareDecoder(settings);
 #endif
+
+    input->updateLatencyMode(settings);
+    input->updateReplay(settings);
 }
 
 void RegisterIOSCameraSource()
@@ -413,6 +739,8 @@ void RegisterIOSCameraSource()
     info.destroy         = destroyIosCameraInput;
     info.deactivate      = deactivateIosCameraInput;
     info.activate        = activateIosCameraInput;
+    info.show            = showIosCameraInput;
+    info.hide            = hideIosCameraInput;
     info.get_defaults    = getIosCameraDefaults;
     info.get_properties  = getIosCameraProperties;
     info.save            = saveIosCameraInput;
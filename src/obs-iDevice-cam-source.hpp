@@ -21,10 +21,10 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 
 #include <obs-module.h>
 
-#define blog(level, fmt, ...)                                      \
-    do                                                             \
-    {                                                              \
-        blog(level, "[obs-ios-camera-plugin] " fmt, ##__VA_ARGS__) \
+#define blog(level, fmt, ...)                                       \
+    do                                                              \
+    {                                                               \
+        blog(level, "[obs-ios-camera-plugin] " fmt, ##__VA_ARGS__); \
     } while (0)
 
 #endif // IDEVICESCAMSOURCE_H
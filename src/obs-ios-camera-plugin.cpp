@@ -19,6 +19,9 @@ Copyright (C) 2018-2019	Will Townsend <will@townsend.io>
 #include <obs-module.h>
 #include <obs.hpp>
 
+#include "DecodePool.hpp"
+#include "LatencyTracer.hpp"
+
 OBS_DECLARE_MODULE()
 OBS_MODULE_USE_DEFAULT_LOCALE("obs-ios-camera-plugin", "en-US")
 
@@ -32,3 +35,10 @@ bool obs_module_load()
     RegisterIOSCameraSource();
     return true;
 }
+
+void obs_module_unload()
+{
+    // Every source is gone by now, so no strand is left on the pool
+    DecodePool::shared().shutdown();
+    LatencyTracer::shared().shutdown();
+}